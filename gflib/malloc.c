@@ -1,6 +1,12 @@
 #include "global.h"
 #include "malloc.h"
 
+#ifdef HEAP_STATS
+// The functions themselves, not the macros that charge call sites.
+#undef Alloc
+#undef AllocZeroed
+#endif
+
 EWRAM_DATA ALIGNED(4) u8 gHeap [HEAP_SIZE] = {0};
 
 #if !MODERN
@@ -10,6 +16,17 @@ static u32 sHeapSize;
 
 #define MALLOC_SYSTEM_ID 0xA3A3
 
+#ifdef HEAP_STATS
+#define NUM_HEAP_CALLSITES 512
+#define NO_CALLSITE 0xFFFF
+#endif
+
+#ifdef HEAP_REPLAY
+// tools/checks/heapreplay.c builds this file for the host and counts the
+// blocks that each allocation looks at before it finds one.
+extern u32 gHeapReplayBlocksVisited;
+#endif
+
 struct MemBlock {
     // Whether this block is currently allocated.
     bool16 flag;
@@ -26,6 +43,12 @@ struct MemBlock {
     // Next block pointer. Equals sHeapStart if this is the last block.
     struct MemBlock *next;
 
+#ifdef HEAP_STATS
+    // The call site this block is charged to, or NO_CALLSITE.
+    u16 callsite;
+    u16 unused;
+#endif
+
     // Data in the memory block. (Arrays of length 0 are a GNU extension.)
     u8 data[0];
 };
@@ -42,6 +65,9 @@ static inline void PutMemBlockHeader(void *block, struct MemBlock *prev, struct
     header->size = size;
     header->prev = prev;
     header->next = next;
+#ifdef HEAP_STATS
+    header->callsite = NO_CALLSITE;
+#endif
 }
 
 #if !MODERN
@@ -49,13 +75,8 @@ void PutFirstMemBlockHeader(void *block, u32 size)
 {
     PutMemBlockHeader(block, (struct MemBlock *)block, (struct MemBlock *)block, size - sizeof(struct MemBlock));
 }
-#endif
 
-#if !MODERN
 static void *AllocInternal(void *heapStart, u32 size)
-#else
-static inline void *AllocInternal(void *heapStart, u32 size)
-#endif
 {
     struct MemBlock *pos = (struct MemBlock *)heapStart;
     struct MemBlock *head = pos;
@@ -63,15 +84,13 @@ static inline void *AllocInternal(void *heapStart, u32 size)
     u32 foundBlockSize;
 
     // Alignment
-    #if !MODERN
     if (size & 3)
         size = 4 * ((size / 4) + 1);
-    #else
-    if (size % 4)
-        size += 4 - (size % 4);
-    #endif
 
     for (;;) {
+#ifdef HEAP_REPLAY
+        gHeapReplayBlocksVisited++;
+#endif
         // Loop through the blocks looking for unused block that's big enough.
 
         if (!pos->flag) {
@@ -147,6 +166,311 @@ void FreeInternal(void *heapStart, void *pointer)
     }
 }
 
+#else
+
+// Modern builds don't need to match, so instead of walking every block from
+// the start of the heap, the free blocks are indexed by size. The blocks
+// themselves, and the prev/next chain of neighbors that CheckHeap walks, are
+// laid out exactly as above.
+//
+// A free block smaller than LARGE_BLOCK_SIZE is on the list for its size
+// class, which holds sizes from 8 << class up to twice that. An allocation
+// takes the first block from the smallest class whose every block is big
+// enough, so it usually doesn't search a list. Larger free blocks are in a
+// binary tree ordered by size and then address, and an allocation that no
+// list can serve takes the smallest one that fits. Only
+// HEAP_SIZE / LARGE_BLOCK_SIZE blocks can be that large, so the tree isn't
+// balanced. An allocation only fails if no free block is big enough, the same
+// as before.
+//
+// A free block's links are kept in its data, so every block holds at least
+// MIN_BLOCK_SIZE bytes.
+
+#define NUM_SIZE_CLASSES 7
+#define MIN_BLOCK_SIZE sizeof(struct FreeLinks)
+#define LARGE_BLOCK_SIZE (8 << NUM_SIZE_CLASSES)
+
+struct FreeLinks {
+    // Size class list neighbors.
+    struct MemBlock *prevFree;
+    struct MemBlock *nextFree;
+};
+
+struct TreeLinks {
+    struct MemBlock *left;
+    struct MemBlock *right;
+    struct MemBlock *parent;
+};
+
+static struct MemBlock *sFreeLists[NUM_SIZE_CLASSES];
+static struct MemBlock *sLargeBlocks;
+
+#define FREE_LINKS(block) ((struct FreeLinks *)(block)->data)
+#define TREE_LINKS(block) ((struct TreeLinks *)(block)->data)
+
+// The class whose sizes include size.
+static inline u32 GetSizeClass(u32 size)
+{
+    u32 sizeClass = 0;
+
+    while (size >= (16u << sizeClass))
+        sizeClass++;
+
+    return sizeClass;
+}
+
+// Whether a is before b in the tree.
+static inline bool32 IsBlockBefore(struct MemBlock *a, struct MemBlock *b)
+{
+    return a->size < b->size || (a->size == b->size && a < b);
+}
+
+static void InsertLargeBlock(struct MemBlock *block)
+{
+    struct MemBlock *parent = NULL;
+    struct MemBlock **link = &sLargeBlocks;
+
+    while (*link != NULL)
+    {
+        parent = *link;
+        link = IsBlockBefore(block, parent) ? &TREE_LINKS(parent)->left : &TREE_LINKS(parent)->right;
+    }
+
+    TREE_LINKS(block)->left = NULL;
+    TREE_LINKS(block)->right = NULL;
+    TREE_LINKS(block)->parent = parent;
+    *link = block;
+}
+
+// Puts replacement, which may be NULL, where block is in the tree.
+static void ReplaceLargeBlock(struct MemBlock *block, struct MemBlock *replacement)
+{
+    struct MemBlock *parent = TREE_LINKS(block)->parent;
+
+    if (parent == NULL)
+        sLargeBlocks = replacement;
+    else if (TREE_LINKS(parent)->left == block)
+        TREE_LINKS(parent)->left = replacement;
+    else
+        TREE_LINKS(parent)->right = replacement;
+
+    if (replacement != NULL)
+        TREE_LINKS(replacement)->parent = parent;
+}
+
+static void RemoveLargeBlock(struct MemBlock *block)
+{
+    struct TreeLinks *links = TREE_LINKS(block);
+    struct MemBlock *next;
+
+    if (links->left == NULL)
+    {
+        ReplaceLargeBlock(block, links->right);
+    }
+    else if (links->right == NULL)
+    {
+        ReplaceLargeBlock(block, links->left);
+    }
+    else
+    {
+        // Put the block that comes after it in its place.
+        next = links->right;
+        while (TREE_LINKS(next)->left != NULL)
+            next = TREE_LINKS(next)->left;
+
+        if (next != links->right)
+        {
+            ReplaceLargeBlock(next, TREE_LINKS(next)->right);
+            TREE_LINKS(next)->right = links->right;
+            TREE_LINKS(links->right)->parent = next;
+        }
+
+        ReplaceLargeBlock(block, next);
+        TREE_LINKS(next)->left = links->left;
+        TREE_LINKS(links->left)->parent = next;
+    }
+}
+
+// The smallest block in the tree that can hold size bytes.
+static struct MemBlock *FindLargeBlock(u32 size)
+{
+    struct MemBlock *pos = sLargeBlocks;
+    struct MemBlock *best = NULL;
+
+    while (pos != NULL)
+    {
+#ifdef HEAP_REPLAY
+        gHeapReplayBlocksVisited++;
+#endif
+        if (pos->size >= size)
+        {
+            best = pos;
+            pos = TREE_LINKS(pos)->left;
+        }
+        else
+        {
+            pos = TREE_LINKS(pos)->right;
+        }
+    }
+
+    return best;
+}
+
+static void InsertFreeBlock(struct MemBlock *block)
+{
+    u32 sizeClass;
+
+    if (block->size >= LARGE_BLOCK_SIZE)
+    {
+        InsertLargeBlock(block);
+        return;
+    }
+
+    sizeClass = GetSizeClass(block->size);
+    FREE_LINKS(block)->prevFree = NULL;
+    FREE_LINKS(block)->nextFree = sFreeLists[sizeClass];
+    if (sFreeLists[sizeClass] != NULL)
+        FREE_LINKS(sFreeLists[sizeClass])->prevFree = block;
+    sFreeLists[sizeClass] = block;
+}
+
+static void RemoveFreeBlock(struct MemBlock *block)
+{
+    struct FreeLinks *links;
+
+    if (block->size >= LARGE_BLOCK_SIZE)
+    {
+        RemoveLargeBlock(block);
+        return;
+    }
+
+    links = FREE_LINKS(block);
+    if (links->prevFree != NULL)
+        FREE_LINKS(links->prevFree)->nextFree = links->nextFree;
+    else
+        sFreeLists[GetSizeClass(block->size)] = links->nextFree;
+    if (links->nextFree != NULL)
+        FREE_LINKS(links->nextFree)->prevFree = links->prevFree;
+}
+
+static struct MemBlock *FindFreeBlock(u32 size)
+{
+    struct MemBlock *pos;
+    u32 sizeClass;
+
+    if (size < LARGE_BLOCK_SIZE)
+    {
+        // Every block in the classes above size's own holds size bytes,
+        // as does every block in its own class if size starts it.
+        sizeClass = GetSizeClass(size);
+        if (size != (8u << sizeClass))
+            sizeClass++;
+
+        for (; sizeClass < NUM_SIZE_CLASSES; sizeClass++)
+        {
+#ifdef HEAP_REPLAY
+            gHeapReplayBlocksVisited++;
+#endif
+            if (sFreeLists[sizeClass] != NULL)
+                return sFreeLists[sizeClass];
+        }
+
+        pos = FindLargeBlock(size);
+        if (pos != NULL)
+            return pos;
+
+        // Only part of size's own class is big enough.
+        for (pos = sFreeLists[GetSizeClass(size)]; pos != NULL; pos = FREE_LINKS(pos)->nextFree)
+        {
+#ifdef HEAP_REPLAY
+            gHeapReplayBlocksVisited++;
+#endif
+            if (pos->size >= size)
+                return pos;
+        }
+
+        return NULL;
+    }
+
+    return FindLargeBlock(size);
+}
+
+static inline void *AllocInternal(void *heapStart, u32 size)
+{
+    struct MemBlock *head = (struct MemBlock *)heapStart;
+    struct MemBlock *block;
+    struct MemBlock *splitBlock;
+
+    // Alignment
+    if (size % 4)
+        size += 4 - (size % 4);
+    if (size < MIN_BLOCK_SIZE)
+        size = MIN_BLOCK_SIZE;
+
+    block = FindFreeBlock(size);
+    if (block == NULL)
+        return NULL;
+
+    RemoveFreeBlock(block);
+    block->flag = TRUE;
+
+    if (block->size - size >= 2 * sizeof(struct MemBlock)) {
+        // The block is significantly bigger than the requested size, so split
+        // the rest into a separate free block.
+        splitBlock = (struct MemBlock *)(block->data + size);
+
+        PutMemBlockHeader(splitBlock, block, block->next, block->size - size - sizeof(struct MemBlock));
+
+        block->size = size;
+        block->next = splitBlock;
+
+        if (splitBlock->next != head)
+            splitBlock->next->prev = splitBlock;
+
+        InsertFreeBlock(splitBlock);
+    }
+
+    return block->data;
+}
+
+void FreeInternal(void *heapStart, void *pointer)
+{
+    if (pointer) {
+        struct MemBlock *head = (struct MemBlock *)heapStart;
+        struct MemBlock *block = (struct MemBlock *)((u8 *)pointer - sizeof(struct MemBlock));
+        block->flag = FALSE;
+
+        // If the freed block isn't the last one, merge with the next block
+        // if it's not in use.
+        if (block->next != head && !block->next->flag) {
+            RemoveFreeBlock(block->next);
+            block->size += sizeof(struct MemBlock) + block->next->size;
+            block->next->magic = 0;
+            block->next = block->next->next;
+            if (block->next != head)
+                block->next->prev = block;
+        }
+
+        // If the freed block isn't the first one, merge with the previous block
+        // if it's not in use.
+        if (block != head && !block->prev->flag) {
+            RemoveFreeBlock(block->prev);
+            block->prev->next = block->next;
+
+            if (block->next != head)
+                block->next->prev = block->prev;
+
+            block->magic = 0;
+            block->prev->size += sizeof(struct MemBlock) + block->size;
+            block = block->prev;
+        }
+
+        InsertFreeBlock(block);
+    }
+}
+
+#endif
+
 #if !MODERN
 static void *AllocZeroedInternal(void *heapStart, u32 size)
 #else
@@ -205,12 +529,196 @@ static bool32 CheckMemBlockInternal(void *pointer)
     return TRUE;
 }
 
+#ifdef HEAP_STATS
+// A block's call site is only set while it's allocated, so Free knows whether
+// AllocAt counted it. The last entry is for every call site that doesn't fit in
+// the others. Each entry's peakBytes and allocCount start over at every dump.
+struct HeapCallsite
+{
+    const char *file;
+    u16 line;
+    u16 liveCount;
+    u32 liveBytes;
+    u32 peakBytes;
+    u32 allocCount;
+};
+
+EWRAM_DATA static struct HeapCallsite sHeapCallsites[NUM_HEAP_CALLSITES] = {0};
+EWRAM_DATA static u32 sHeapLiveBytes = 0;
+EWRAM_DATA static u32 sHeapPeakBytes = 0;
+EWRAM_DATA static u32 sHeapDumpPeakBytes = 0;
+EWRAM_DATA static u32 sHeapFailedAllocs = 0;
+EWRAM_DATA static u32 sHeapDumpCount = 0;
+
+static u16 GetCallsite(const char *file, u32 line)
+{
+    u32 i = (((u32)file >> 2) + line * 31) % (NUM_HEAP_CALLSITES - 1);
+    u32 j;
+
+    for (j = 0; j < NUM_HEAP_CALLSITES - 1; j++)
+    {
+        if (sHeapCallsites[i].file == NULL)
+        {
+            sHeapCallsites[i].file = file;
+            sHeapCallsites[i].line = line;
+            return i;
+        }
+
+        if (sHeapCallsites[i].file == file && sHeapCallsites[i].line == line)
+            return i;
+
+        if (++i == NUM_HEAP_CALLSITES - 1)
+            i = 0;
+    }
+
+    return NUM_HEAP_CALLSITES - 1;
+}
+
+static void RecordAlloc(void *pointer, const char *file, u32 line)
+{
+    struct MemBlock *block;
+    struct HeapCallsite *site;
+
+    if (pointer == NULL)
+    {
+        sHeapFailedAllocs++;
+        return;
+    }
+
+    block = (struct MemBlock *)((u8 *)pointer - sizeof(struct MemBlock));
+    block->callsite = GetCallsite(file, line);
+
+    site = &sHeapCallsites[block->callsite];
+    site->liveBytes += block->size;
+    site->liveCount++;
+    site->allocCount++;
+    if (site->liveBytes > site->peakBytes)
+        site->peakBytes = site->liveBytes;
+
+    sHeapLiveBytes += sizeof(struct MemBlock) + block->size;
+    if (sHeapLiveBytes > sHeapPeakBytes)
+        sHeapPeakBytes = sHeapLiveBytes;
+    if (sHeapLiveBytes > sHeapDumpPeakBytes)
+        sHeapDumpPeakBytes = sHeapLiveBytes;
+}
+
+static void RecordFree(void *pointer)
+{
+    struct MemBlock *block;
+    struct HeapCallsite *site;
+
+    if (pointer == NULL)
+        return;
+
+    block = (struct MemBlock *)((u8 *)pointer - sizeof(struct MemBlock));
+    if (block->callsite == NO_CALLSITE)
+        return;
+
+    site = &sHeapCallsites[block->callsite];
+    site->liveBytes -= block->size;
+    site->liveCount--;
+    sHeapLiveBytes -= sizeof(struct MemBlock) + block->size;
+    block->callsite = NO_CALLSITE;
+}
+
+// InitHeap frees every block at once.
+static void ClearLiveHeapStats(void)
+{
+    u32 i;
+
+    for (i = 0; i < NUM_HEAP_CALLSITES; i++)
+    {
+        sHeapCallsites[i].liveBytes = 0;
+        sHeapCallsites[i].liveCount = 0;
+    }
+
+    sHeapLiveBytes = 0;
+}
+
+void *AllocAt(u32 size, const char *file, u32 line)
+{
+    void *mem = Alloc(size);
+
+    RecordAlloc(mem, file, line);
+    return mem;
+}
+
+void *AllocZeroedAt(u32 size, const char *file, u32 line)
+{
+    void *mem = AllocZeroed(size);
+
+    RecordAlloc(mem, file, line);
+    return mem;
+}
+
+// Logs one HEAP line with the heap's totals, then one HEAPSITE line for each
+// call site that has blocks allocated or allocated any since the last dump.
+// All sizes are in bytes, and the totals include the blocks' headers.
+void HeapStatsDump(u32 tag)
+{
+    #if !MODERN
+    struct MemBlock *head = (struct MemBlock *)sHeapStart;
+    #else
+    struct MemBlock *head = (struct MemBlock *)gHeap;
+    #endif
+    struct MemBlock *pos;
+    struct HeapCallsite *site;
+    u32 freeBytes = 0;
+    u32 freeBlocks = 0;
+    u32 largestFree = 0;
+    u32 i;
+
+    // The heap isn't set up yet.
+    if (head == NULL || head->magic != MALLOC_SYSTEM_ID || !MgbaOpen())
+        return;
+
+    pos = head;
+    do
+    {
+        if (!pos->flag)
+        {
+            freeBytes += pos->size;
+            freeBlocks++;
+            if (pos->size > largestFree)
+                largestFree = pos->size;
+        }
+        pos = pos->next;
+    } while (pos != head);
+
+    MgbaPrintf(MGBA_LOG_INFO, "HEAP %lu tag=%08lx live=%lu peak=%lu dumppeak=%lu free=%lu blocks=%lu largest=%lu failed=%lu",
+               (unsigned long)sHeapDumpCount, (unsigned long)tag, (unsigned long)sHeapLiveBytes,
+               (unsigned long)sHeapPeakBytes, (unsigned long)sHeapDumpPeakBytes, (unsigned long)freeBytes,
+               (unsigned long)freeBlocks, (unsigned long)largestFree, (unsigned long)sHeapFailedAllocs);
+
+    for (i = 0; i < NUM_HEAP_CALLSITES; i++)
+    {
+        site = &sHeapCallsites[i];
+        if (site->liveCount == 0 && site->allocCount == 0)
+            continue;
+
+        MgbaPrintf(MGBA_LOG_INFO, "HEAPSITE %lu %s:%u live=%lu count=%u peak=%lu allocs=%lu",
+                   (unsigned long)sHeapDumpCount, site->file != NULL ? site->file : "?", site->line,
+                   (unsigned long)site->liveBytes, site->liveCount, (unsigned long)site->peakBytes,
+                   (unsigned long)site->allocCount);
+
+        site->peakBytes = site->liveBytes;
+        site->allocCount = 0;
+    }
+
+    sHeapDumpPeakBytes = sHeapLiveBytes;
+    sHeapDumpCount++;
+}
+#endif
+
 #if !MODERN
 void InitHeap(void *heapStart, u32 heapSize)
 {
     sHeapStart = heapStart;
     sHeapSize = heapSize;
     PutFirstMemBlockHeader(heapStart, heapSize);
+#ifdef HEAP_STATS
+    ClearLiveHeapStats();
+#endif
 }
 
 void *Alloc(u32 size)
@@ -225,6 +733,9 @@ void *AllocZeroed(u32 size)
 
 void Free(void *pointer)
 {
+#ifdef HEAP_STATS
+    RecordFree(pointer);
+#endif
     FreeInternal(sHeapStart, pointer);
 }
 
@@ -236,7 +747,17 @@ bool32 CheckMemBlock(void *pointer)
 #else
 void InitHeap()
 {
+    u32 i;
+
+    for (i = 0; i < NUM_SIZE_CLASSES; i++)
+        sFreeLists[i] = NULL;
+    sLargeBlocks = NULL;
+
     PutMemBlockHeader(gHeap, (struct MemBlock *)gHeap, (struct MemBlock *)gHeap, HEAP_SIZE - sizeof(struct MemBlock));
+    InsertFreeBlock((struct MemBlock *)gHeap);
+#ifdef HEAP_STATS
+    ClearLiveHeapStats();
+#endif
 }
 
 void *Alloc(u32 size)
@@ -251,6 +772,9 @@ void *AllocZeroed(u32 size)
 
 void Free(void *pointer)
 {
+#ifdef HEAP_STATS
+    RecordFree(pointer);
+#endif
     FreeInternal(gHeap, pointer);
 }
 
@@ -283,3 +807,76 @@ bool32 CheckHeap()
 
     return TRUE;
 }
+
+#if MODERN
+bool32 ArenaCreate(struct Arena *arena, u32 size)
+{
+    if (size % 4)
+        size += 4 - (size % 4);
+
+#ifdef HEAP_STATS
+    arena->start = AllocAt(size, __FILE__, __LINE__);
+#else
+    arena->start = Alloc(size);
+#endif
+    arena->size = arena->start != NULL ? size : 0;
+    arena->used = 0;
+    arena->highWater = 0;
+
+    return arena->start != NULL;
+}
+
+void ArenaDestroy(struct Arena *arena)
+{
+    Free(arena->start);
+    arena->start = NULL;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+void *ArenaAlloc(struct Arena *arena, u32 size)
+{
+    void *mem;
+
+    // Alignment
+    if (size % 4)
+        size += 4 - (size % 4);
+
+    if (size > arena->size - arena->used)
+        return NULL;
+
+    mem = arena->start + arena->used;
+    arena->used += size;
+
+    if (arena->used > arena->highWater)
+        arena->highWater = arena->used;
+
+    return mem;
+}
+
+void *ArenaAllocZeroed(struct Arena *arena, u32 size)
+{
+    void *mem = ArenaAlloc(arena, size);
+
+    if (mem != NULL)
+    {
+        if (size % 4)
+            size += 4 - (size % 4);
+
+        CpuFill32(0, mem, size);
+    }
+
+    return mem;
+}
+
+u32 ArenaGetMark(struct Arena *arena)
+{
+    return arena->used;
+}
+
+void ArenaRelease(struct Arena *arena, u32 mark)
+{
+    if (mark < arena->used)
+        arena->used = mark;
+}
+#endif
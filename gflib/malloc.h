@@ -20,12 +20,50 @@ void *Alloc(u32 size);
 void *AllocZeroed(u32 size);
 void Free(void *pointer);
 
+// With HEAP_STATS defined, each block is charged to the file and line that
+// called Alloc or AllocZeroed for it, and HeapStatsDump logs every call site
+// that has blocks allocated, along with the heap's peak usage and its free
+// blocks, to mGBA's debug log. tag goes in the log to tell the dumps apart.
+// SetMainCallback2 dumps with the outgoing callback as the tag, so a call
+// site that leaks shows up as one whose blocks add up from screen to screen.
+// tools/heapreport reads the log.
+#ifdef HEAP_STATS
+void *AllocAt(u32 size, const char *file, u32 line);
+void *AllocZeroedAt(u32 size, const char *file, u32 line);
+void HeapStatsDump(u32 tag);
+#define Alloc(size) AllocAt(size, __FILE__, __LINE__)
+#define AllocZeroed(size) AllocZeroedAt(size, __FILE__, __LINE__)
+#endif
+
 #if !MODERN
 void InitHeap(void *pointer, u32 size);
 #define HeapInit() InitHeap(gHeap, HEAP_SIZE)
 #else
 void InitHeap(void);
 #define HeapInit() InitHeap()
+
+// An arena is one block of gHeap that hands out buffers by bumping a
+// pointer, for buffers that all go away together, such as a screen's. Take a
+// mark with ArenaGetMark before allocating and pass it to ArenaRelease to free
+// everything allocated since, or destroy the arena to give the whole block
+// back. An arena and Alloc can be used side by side, so a screen can move its
+// buffers to one a few at a time. highWater is the most the arena has ever had
+// allocated, for sizing it. Arenas are only in modern builds, since agbcc
+// builds have to match the original ROM.
+struct Arena
+{
+    u8 *start;
+    u32 size;
+    u32 used;
+    u32 highWater;
+};
+
+bool32 ArenaCreate(struct Arena *arena, u32 size);
+void ArenaDestroy(struct Arena *arena);
+void *ArenaAlloc(struct Arena *arena, u32 size);
+void *ArenaAllocZeroed(struct Arena *arena, u32 size);
+u32 ArenaGetMark(struct Arena *arena);
+void ArenaRelease(struct Arena *arena, u32 mark);
 #endif
 
 #endif // GUARD_ALLOC_H
@@ -19,6 +19,18 @@ void AGBPrintFlush(void);
 void AGBAssert(const char *pFile, int nLine, const char *pExpression, int nStopProgram);
 #endif
 
+// Messages to mGBA's debug log, which MgbaOpen turns on. It returns FALSE if
+// the game isn't running in mGBA, and then the messages go nowhere.
+#ifdef HEAP_STATS
+#define MGBA_LOG_FATAL 0
+#define MGBA_LOG_ERROR 1
+#define MGBA_LOG_WARN 2
+#define MGBA_LOG_INFO 3
+#define MGBA_LOG_DEBUG 4
+bool32 MgbaOpen(void);
+void MgbaPrintf(s32 level, const char *pBuf, ...);
+#endif
+
 #undef AGB_ASSERT
 #ifdef NDEBUG
 #define AGB_ASSERT(exp)
@@ -322,5 +322,25 @@ void CopyFromSprites(u8 *dest);
 u8 SpriteTileAllocBitmapOp(u16 bit, u8 op);
 void ClearSpriteCopyRequests(void);
 void ResetAffineAnimData(void);
+#ifdef UBFIX
+void KeepSpriteTemplate(u8 spriteId);
+#endif
+
+#if MODERN
+// Sprite tile usage, for seeing how much space fragmentation wastes.
+struct SpriteTileStats
+{
+    u16 reservedTiles;
+    u16 allocatedTiles;
+    u16 freeTiles;
+    u16 freeRuns;
+    u16 largestFreeRun;
+};
+
+void GetSpriteTileStats(struct SpriteTileStats *stats);
+#ifdef HEAP_STATS
+void SpriteTileStatsDump(u32 tag);
+#endif
+#endif
 
 #endif //GUARD_SPRITE_H
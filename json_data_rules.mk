@@ -1,8 +1,23 @@
 # JSON files are run through jsonproc, which is a tool that converts JSON data to an output file
 # based on an Inja template. https://github.com/pantor/inja
 
-AUTO_GEN_TARGETS += $(DATA_SRC_SUBDIR)/wild_encounters.h
-$(DATA_SRC_SUBDIR)/wild_encounters.h: $(DATA_SRC_SUBDIR)/wild_encounters.json $(DATA_SRC_SUBDIR)/wild_encounters.json.txt
-	$(JSONPROC) $^ $@
+# Each job is a JSON file, a template and the output, which also goes in
+# JSONPROC_OUTPUTS. jsonproc renders every job in one run, parsing each file
+# once, and only rewrites the outputs whose text changed, so the stamp records
+# when the jobs were last run.
+JSONPROC_JOBS := $(DATA_SRC_SUBDIR)/wild_encounters.json $(DATA_SRC_SUBDIR)/wild_encounters.json.txt $(DATA_SRC_SUBDIR)/wild_encounters.h
+JSONPROC_OUTPUTS := $(DATA_SRC_SUBDIR)/wild_encounters.h
+
+JSONPROC_STAMP := $(C_BUILDDIR)/jsonproc.stamp
+
+# Deleting an output doesn't make the stamp out of date, so the jobs are also
+# forced to run while any output is missing.
+JSONPROC_MISSING := $(filter-out $(wildcard $(JSONPROC_OUTPUTS)),$(JSONPROC_OUTPUTS))
+
+AUTO_GEN_TARGETS += $(JSONPROC_OUTPUTS)
+$(JSONPROC_STAMP): $(filter-out $(JSONPROC_OUTPUTS),$(JSONPROC_JOBS)) $(if $(JSONPROC_MISSING),FORCE)
+	$(JSONPROC) $(JSONPROC_JOBS)
+	@touch $@
+$(JSONPROC_OUTPUTS): $(JSONPROC_STAMP) ;
 
 $(C_BUILDDIR)/wild_encounter.o: c_dep += $(DATA_SRC_SUBDIR)/wild_encounters.h
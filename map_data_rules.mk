@@ -13,10 +13,20 @@ $(DATA_ASM_BUILDDIR)/maps.o: $(DATA_ASM_SUBDIR)/maps.s $(LAYOUTS_DIR)/layouts.in
 $(DATA_ASM_BUILDDIR)/map_events.o: $(DATA_ASM_SUBDIR)/map_events.s $(MAPS_DIR)/events.inc $(MAP_EVENTS)
 	$(PREPROC) $< charmap.txt | $(CPP) -I include - | $(AS) $(ASFLAGS) -o $@
 
-$(MAPS_DIR)/%/header.inc: $(MAPS_DIR)/%/map.json
-	$(MAPJSON) map emerald $< $(LAYOUTS_DIR)/layouts.json
-$(MAPS_DIR)/%/events.inc: $(MAPS_DIR)/%/header.inc ;
-$(MAPS_DIR)/%/connections.inc: $(MAPS_DIR)/%/events.inc ;
+# mapjson converts every map in one run, and only rewrites the files whose
+# text changed, so the stamp records when the maps were last converted.
+MAP_JSONS := $(wildcard $(MAPS_DIR)/*/map.json)
+MAPS_STAMP := $(DATA_ASM_BUILDDIR)/maps.stamp
+
+# Deleting a map's output doesn't make the stamp out of date, so the maps are
+# also forced to convert while any output is missing.
+MAP_OUTPUTS := $(MAP_HEADERS) $(MAP_EVENTS) $(MAP_CONNECTIONS)
+MAP_OUTPUTS_MISSING := $(filter-out $(wildcard $(MAP_OUTPUTS)),$(MAP_OUTPUTS))
+
+$(MAPS_STAMP): $(MAP_JSONS) $(LAYOUTS_DIR)/layouts.json $(if $(MAP_OUTPUTS_MISSING),FORCE)
+	$(MAPJSON) maps emerald $(LAYOUTS_DIR)/layouts.json $(MAP_JSONS)
+	@touch $@
+$(MAP_OUTPUTS): $(MAPS_STAMP) ;
 
 $(MAPS_DIR)/groups.inc: $(MAPS_DIR)/map_groups.json
 	$(MAPJSON) groups emerald $<
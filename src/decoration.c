@@ -2077,6 +2077,9 @@ static u8 AddDecorationIconObjectFromIconTable(u16 tilesTag, u16 paletteTag, u8
     template->paletteTag = paletteTag;
     spriteId = CreateSprite(template, 0, 0, 0);
     FreeItemIconTemporaryBuffers();
+#ifdef UBFIX
+    KeepSpriteTemplate(spriteId);
+#endif
     free(template);
     return spriteId;
 }
@@ -2116,6 +2119,9 @@ static u8 AddDecorationIconObjectFromObjectEvent(u16 tilesTag, u16 paletteTag, u
         template->tileTag = tilesTag;
         template->paletteTag = paletteTag;
         spriteId = CreateSprite(template, 0, 0, 0);
+    #ifdef UBFIX
+        KeepSpriteTemplate(spriteId);
+    #endif
         free(template);
     }
     else
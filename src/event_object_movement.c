@@ -1578,6 +1578,9 @@ u8 CreateObjectGraphicsSprite(u16 graphicsId, void (*callback)(struct Sprite *),
         LoadObjectEventPalette(spriteTemplate->paletteTag);
 
     spriteId = CreateSprite(spriteTemplate, x, y, subpriority);
+#ifdef UBFIX
+    KeepSpriteTemplate(spriteId);
+#endif
     free(spriteTemplate);
 
     if (spriteId != MAX_SPRITES && subspriteTables != NULL)
@@ -117,6 +117,9 @@ u8 AddItemIconSprite(u16 tilesTag, u16 paletteTag, u16 itemId)
         spriteId = CreateSprite(spriteTemplate, 0, 0, 0);
 
         FreeItemIconTemporaryBuffers();
+    #ifdef UBFIX
+        KeepSpriteTemplate(spriteId);
+    #endif
         Free(spriteTemplate);
 
         return spriteId;
@@ -154,6 +157,9 @@ u8 AddCustomItemIconSprite(const struct SpriteTemplate *customSpriteTemplate, u1
         spriteId = CreateSprite(spriteTemplate, 0, 0, 0);
 
         FreeItemIconTemporaryBuffers();
+    #ifdef UBFIX
+        KeepSpriteTemplate(spriteId);
+    #endif
         Free(spriteTemplate);
 
         return spriteId;
@@ -176,4 +176,40 @@ void NoCashGBAPrintf(const char *pBuf, ...)
 */
 
 #endif
-#endif
\ No newline at end of file
+#endif
+
+// mGBA's debug log. HEAP_STATS builds log the heap's usage here, so these are
+// in agbcc and modern builds alike, whether or not NDEBUG is defined.
+#ifdef HEAP_STATS
+#include <stdarg.h>
+#include <stdio.h>
+#include "gba/gba.h"
+
+#define REG_MGBA_DEBUG_STRING ((vu8 *)0x4FFF600)
+#define REG_MGBA_DEBUG_FLAGS (*(vu16 *)0x4FFF700)
+#define REG_MGBA_DEBUG_ENABLE (*(vu16 *)0x4FFF780)
+#define MGBA_DEBUG_STRING_SIZE 0x100
+#define MGBA_DEBUG_SEND 0x100
+
+bool32 MgbaOpen(void)
+{
+    REG_MGBA_DEBUG_ENABLE = 0xC0DE;
+    return REG_MGBA_DEBUG_ENABLE == 0x1DEA;
+}
+
+void MgbaPrintf(s32 level, const char *pBuf, ...)
+{
+    char bufPrint[0x200];
+    va_list vArgv;
+    s32 i;
+
+    va_start(vArgv, pBuf);
+    vsprintf(bufPrint, pBuf, vArgv);
+    va_end(vArgv);
+
+    for (i = 0; bufPrint[i] != 0 && i < MGBA_DEBUG_STRING_SIZE - 1; i++)
+        REG_MGBA_DEBUG_STRING[i] = bufPrint[i];
+    REG_MGBA_DEBUG_STRING[i] = 0;
+    REG_MGBA_DEBUG_FLAGS = level | MGBA_DEBUG_SEND;
+}
+#endif
@@ -209,6 +209,12 @@ static void CallCallbacks(void)
 
 void SetMainCallback2(MainCallback callback)
 {
+#ifdef HEAP_STATS
+    HeapStatsDump((u32)gMain.callback2);
+#if MODERN
+    SpriteTileStatsDump((u32)gMain.callback2);
+#endif
+#endif
     gMain.callback2 = callback;
     gMain.state = 0;
 }
@@ -57,6 +57,9 @@ static u8 CreateSpriteAt(u8 index, const struct SpriteTemplate *template, s16 x,
 static void ResetOamMatrices(void);
 static void ResetSprite(struct Sprite *sprite);
 static s16 AllocSpriteTiles(u16 tileCount);
+#if MODERN
+static void SetSpriteTileBits(u32 start, u32 count, bool32 allocated);
+#endif
 static void RequestSpriteFrameImageCopy(u16 index, u16 tileNum, const struct SpriteFrameImage *images);
 static void ResetAllSprites(void);
 static void BeginAnim(struct Sprite *sprite);
@@ -280,18 +283,29 @@ u32 gOamMatrixAllocBitmap;
 u8 gReservedSpritePaletteCount;
 
 EWRAM_DATA struct Sprite gSprites[MAX_SPRITES + 1] = {0};
+#if !MODERN
 EWRAM_DATA static u16 sSpritePriorities[MAX_SPRITES] = {0};
+#else
+EWRAM_DATA static u32 sSpriteSortKeys[MAX_SPRITES] = {0};
+#endif
 EWRAM_DATA static u8 sSpriteOrder[MAX_SPRITES] = {0};
 EWRAM_DATA static bool8 sShouldProcessSpriteCopyRequests = 0;
 EWRAM_DATA static u8 sSpriteCopyRequestCount = 0;
 EWRAM_DATA static struct SpriteCopyRequest sSpriteCopyRequests[MAX_SPRITES] = {0};
 EWRAM_DATA u8 gOamLimit = 0;
 EWRAM_DATA u16 gReservedSpriteTileCount = 0;
+#if !MODERN
 EWRAM_DATA static u8 sSpriteTileAllocBitmap[128] = {0};
+#else
+EWRAM_DATA static u32 sSpriteTileAllocBitmap[TOTAL_OBJ_TILE_COUNT / 32] = {0};
+#endif
 EWRAM_DATA s16 gSpriteCoordOffsetX = 0;
 EWRAM_DATA s16 gSpriteCoordOffsetY = 0;
 EWRAM_DATA struct OamMatrix gOamMatrices[OAM_MATRIX_COUNT] = {0};
 EWRAM_DATA bool8 gAffineAnimsDisabled = FALSE;
+#ifdef UBFIX
+EWRAM_DATA static struct SpriteTemplate sSpriteTemplateCopies[MAX_SPRITES] = {0};
+#endif
 
 void ResetSpriteData(void)
 {
@@ -361,6 +375,7 @@ void UpdateOamCoords(void)
     }
 }
 
+#if !MODERN
 void BuildSpritePriorities(void)
 {
     u16 i;
@@ -473,6 +488,108 @@ void SortSprites(void)
     }
 }
 
+#else
+// Modern builds give each sprite one key to sort on, which orders sprites the
+// same way as the comparisons above: by priority and subpriority, and then
+// from the bottom of the screen up. Below the priority is Y, adjusted the same
+// way and turned around so that lower sprites have smaller keys.
+#define SORT_KEY_Y_BITS 9
+#define SORT_RADIX_BITS 7
+#define SORT_RADIX_PASSES 3
+
+// sSpriteOrder is kept from frame to frame, so it's usually sorted already or
+// close to it, and an insertion sort has few sprites to move. If it has to
+// move too many, the rest of the sort is a radix sort instead, which takes the
+// same time however out of order the sprites are. Both sorts leave sprites
+// with equal keys in the order they were in, so the order is the same as
+// above either way.
+#define SORT_MAX_MOVES (MAX_SPRITES * 2)
+
+void BuildSpritePriorities(void)
+{
+    u32 i;
+    for (i = 0; i < MAX_SPRITES; i++)
+    {
+        struct Sprite *sprite = &gSprites[i];
+        u32 priority = sprite->subpriority | (sprite->oam.priority << 8);
+        s32 y = sprite->oam.y;
+
+        if (y >= DISPLAY_HEIGHT)
+            y -= 256;
+
+        if (sprite->oam.affineMode == ST_OAM_AFFINE_DOUBLE
+         && sprite->oam.size == ST_OAM_SIZE_3
+         && (sprite->oam.shape == ST_OAM_SQUARE || sprite->oam.shape == ST_OAM_V_RECTANGLE)
+         && y > 128)
+            y -= 256;
+
+        sSpriteSortKeys[i] = (priority << SORT_KEY_Y_BITS) | (DISPLAY_HEIGHT - 1 - y);
+    }
+}
+
+static void RadixSortSprites(void)
+{
+    u8 buffer[MAX_SPRITES];
+    u8 starts[1 << SORT_RADIX_BITS];
+    u8 *src = sSpriteOrder;
+    u8 *dest = buffer;
+    u8 *temp;
+    u32 pass, i, shift, digit, count, sum;
+
+    for (pass = 0; pass < SORT_RADIX_PASSES; pass++)
+    {
+        shift = pass * SORT_RADIX_BITS;
+
+        for (digit = 0; digit < ARRAY_COUNT(starts); digit++)
+            starts[digit] = 0;
+
+        for (i = 0; i < MAX_SPRITES; i++)
+            starts[(sSpriteSortKeys[src[i]] >> shift) % ARRAY_COUNT(starts)]++;
+
+        for (digit = 0, sum = 0; digit < ARRAY_COUNT(starts); digit++)
+        {
+            count = starts[digit];
+            starts[digit] = sum;
+            sum += count;
+        }
+
+        for (i = 0; i < MAX_SPRITES; i++)
+            dest[starts[(sSpriteSortKeys[src[i]] >> shift) % ARRAY_COUNT(starts)]++] = src[i];
+
+        temp = src;
+        src = dest;
+        dest = temp;
+    }
+
+    if (src != sSpriteOrder)
+        memcpy(sSpriteOrder, src, MAX_SPRITES);
+}
+
+void SortSprites(void)
+{
+    u32 i, j;
+    u32 moves = 0;
+
+    for (i = 1; i < MAX_SPRITES; i++)
+    {
+        u8 index = sSpriteOrder[i];
+        u32 key = sSpriteSortKeys[index];
+
+        for (j = i; j > 0 && sSpriteSortKeys[sSpriteOrder[j - 1]] > key; j--)
+            sSpriteOrder[j] = sSpriteOrder[j - 1];
+
+        sSpriteOrder[j] = index;
+        moves += i - j;
+
+        if (moves > SORT_MAX_MOVES)
+        {
+            RadixSortSprites();
+            return;
+        }
+    }
+}
+#endif
+
 void CopyMatricesToOamBuffer(void)
 {
     u8 i;
@@ -515,6 +632,20 @@ u8 CreateSprite(const struct SpriteTemplate *template, s16 x, s16 y, u8 subprior
     return MAX_SPRITES;
 }
 
+#ifdef UBFIX
+// Sprites keep their template pointer and free their tiles and palette by its
+// tags. A sprite made from a template on the heap gets a copy of it here, so
+// the heap block can be freed while the sprite is still around.
+void KeepSpriteTemplate(u8 spriteId)
+{
+    if (spriteId != MAX_SPRITES)
+    {
+        sSpriteTemplateCopies[spriteId] = *gSprites[spriteId].template;
+        gSprites[spriteId].template = &sSpriteTemplateCopies[spriteId];
+    }
+}
+#endif
+
 u8 CreateSpriteAtEnd(const struct SpriteTemplate *template, s16 x, s16 y, u8 subpriority)
 {
     s16 i;
@@ -629,10 +760,14 @@ void DestroySprite(struct Sprite *sprite)
     {
         if (!sprite->usingSheet)
         {
+#if !MODERN
             m16 i;
             m16 tileEnd = (sprite->images->size / TILE_SIZE_4BPP) + sprite->oam.tileNum;
             for (i = sprite->oam.tileNum; i < tileEnd; i++)
                 FREE_SPRITE_TILE(i);
+#else
+            SetSpriteTileBits(sprite->oam.tileNum, sprite->images->size / TILE_SIZE_4BPP, FALSE);
+#endif
         }
         ResetSprite(sprite);
     }
@@ -713,6 +848,7 @@ void CalcCenterToCornerVec(struct Sprite *sprite, u8 shape, u8 size, u8 affineMo
     sprite->centerToCornerVecY = y;
 }
 
+#if !MODERN
 s16 AllocSpriteTiles(u16 tileCount)
 {
     u16 i;
@@ -789,6 +925,165 @@ u8 SpriteTileAllocBitmapOp(u16 bit, u8 op)
     return retVal;
 }
 
+#else
+
+// Modern builds keep one bit per tile in words, tile n in bit n % 32 of word
+// n / 32, and look for free tiles and mark them a word at a time. The
+// ARM7TDMI has no instruction to count leading or trailing zeros, so the
+// lowest set bit of a word is found by multiplying it by a de Bruijn sequence.
+static const u8 sDeBruijnBitPositions[32] =
+{
+    0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+    31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9,
+};
+
+// The index of the lowest set bit in word, which must not be 0.
+#define LOWEST_SET_BIT(word) sDeBruijnBitPositions[(((word) & -(word)) * 0x077CB531) >> 27]
+
+// The first tile from tile on that is allocated, or free if free is TRUE. If
+// there isn't one, returns TOTAL_OBJ_TILE_COUNT.
+static u32 FindSpriteTile(u32 tile, bool32 free)
+{
+    u32 flip = free ? 0xFFFFFFFF : 0;
+    u32 index = tile / 32;
+    u32 word;
+
+    if (tile >= TOTAL_OBJ_TILE_COUNT)
+        return TOTAL_OBJ_TILE_COUNT;
+
+    word = (sSpriteTileAllocBitmap[index] ^ flip) & (0xFFFFFFFF << (tile % 32));
+
+    while (word == 0)
+    {
+        if (++index == ARRAY_COUNT(sSpriteTileAllocBitmap))
+            return TOTAL_OBJ_TILE_COUNT;
+
+        word = sSpriteTileAllocBitmap[index] ^ flip;
+    }
+
+    return index * 32 + LOWEST_SET_BIT(word);
+}
+
+// Marks count tiles from start as allocated, or free if allocated is FALSE.
+static void SetSpriteTileBits(u32 start, u32 count, bool32 allocated)
+{
+    u32 end = start + count;
+    u32 index, lastIndex, mask;
+
+    if (end > TOTAL_OBJ_TILE_COUNT)
+        end = TOTAL_OBJ_TILE_COUNT;
+
+    if (start >= end)
+        return;
+
+    lastIndex = (end - 1) / 32;
+    mask = 0xFFFFFFFF << (start % 32);
+
+    for (index = start / 32; index <= lastIndex; index++)
+    {
+        if (index == lastIndex)
+            mask &= 0xFFFFFFFF >> (31 - (end - 1) % 32);
+
+        if (allocated)
+            sSpriteTileAllocBitmap[index] |= mask;
+        else
+            sSpriteTileAllocBitmap[index] &= ~mask;
+
+        mask = 0xFFFFFFFF;
+    }
+}
+
+// Finds the same tiles as above: the first run of tileCount free tiles after
+// the reserved ones.
+s16 AllocSpriteTiles(u16 tileCount)
+{
+    u32 start;
+    u32 end;
+
+    if (tileCount == 0)
+    {
+        // Free all unreserved tiles if the tile count is 0.
+        SetSpriteTileBits(gReservedSpriteTileCount, TOTAL_OBJ_TILE_COUNT - gReservedSpriteTileCount, FALSE);
+        return 0;
+    }
+
+    start = gReservedSpriteTileCount;
+
+    for (;;)
+    {
+        start = FindSpriteTile(start, TRUE);
+        if (start + tileCount > TOTAL_OBJ_TILE_COUNT)
+            return -1;
+
+        end = FindSpriteTile(start, FALSE);
+        if (end - start >= tileCount)
+            break;
+
+        start = end;
+    }
+
+    SetSpriteTileBits(start, tileCount, TRUE);
+    return start;
+}
+
+u8 SpriteTileAllocBitmapOp(u16 bit, u8 op)
+{
+    u32 index = bit / 32;
+    u32 mask = 1u << (bit % 32);
+
+    if (op == 0)
+        sSpriteTileAllocBitmap[index] &= ~mask;
+    else if (op == 1)
+        sSpriteTileAllocBitmap[index] |= mask;
+    else if (sSpriteTileAllocBitmap[index] & mask)
+        return 1 << (bit % 8);
+
+    return 0;
+}
+
+// The free tiles after the reserved ones, the runs they're in and the longest
+// of those, which is the most a sprite sheet can have. The free tiles outside
+// the longest run are what fragmentation wastes.
+void GetSpriteTileStats(struct SpriteTileStats *stats)
+{
+    u32 start = gReservedSpriteTileCount;
+    u32 end;
+
+    stats->reservedTiles = gReservedSpriteTileCount;
+    stats->freeTiles = 0;
+    stats->freeRuns = 0;
+    stats->largestFreeRun = 0;
+
+    while ((start = FindSpriteTile(start, TRUE)) < TOTAL_OBJ_TILE_COUNT)
+    {
+        end = FindSpriteTile(start, FALSE);
+        stats->freeTiles += end - start;
+        stats->freeRuns++;
+        if (end - start > stats->largestFreeRun)
+            stats->largestFreeRun = end - start;
+        start = end;
+    }
+
+    stats->allocatedTiles = TOTAL_OBJ_TILE_COUNT - gReservedSpriteTileCount - stats->freeTiles;
+}
+
+#ifdef HEAP_STATS
+// Logs the sprite tile stats to mGBA's debug log, next to the heap's.
+void SpriteTileStatsDump(u32 tag)
+{
+    struct SpriteTileStats stats;
+
+    if (!MgbaOpen())
+        return;
+
+    GetSpriteTileStats(&stats);
+    MgbaPrintf(MGBA_LOG_INFO, "OBJTILES tag=%08lx reserved=%u allocated=%u free=%u runs=%u largest=%u",
+               (unsigned long)tag, stats.reservedTiles, stats.allocatedTiles, stats.freeTiles,
+               stats.freeRuns, stats.largestFreeRun);
+}
+#endif
+#endif
+
 void SpriteCallbackDummy(struct Sprite *sprite)
 {
 }
@@ -1519,12 +1814,16 @@ void FreeSpriteTilesByTag(u16 tag)
     u8 index = IndexOfSpriteTileTag(tag);
     if (index != 0xFF)
     {
+#if !MODERN
         u16 i;
         u16 start = sSpriteTileRanges[index][0];
         u16 count = sSpriteTileRanges[index][1];
 
         for (i = start; i < start + count; i++)
             FREE_SPRITE_TILE(i);
+#else
+        SetSpriteTileBits(sSpriteTileRanges[index][0], sSpriteTileRanges[index][1], FALSE);
+#endif
 
         sSpriteTileRangeTags[index] = TAG_NONE;
     }
@@ -18,12 +18,22 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+// For st_mtim and mmap() with -std=c11.
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <limits.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 /* extended.c */
 void ieee754_write_extended (double, uint8_t*);
@@ -49,18 +59,25 @@ do                                          \
 
 #endif // _MSC_VER
 
+#if defined(__APPLE__)
+#define STAT_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#elif defined(_WIN32)
+#define STAT_MTIME_NSEC(st) 0
+#else
+#define STAT_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
 typedef struct {
 	unsigned long num_samples;
-	union {
-		uint8_t *samples8;
-		uint16_t *samples16;
-	};
+	uint8_t *samples8;
+	// The SSND chunk's sound data, which points into the .aif file.
+	const uint8_t *sound_data;
+	unsigned long sound_data_length;
 	uint8_t midi_note;
 	uint8_t sample_size;
 	bool has_loop;
 	unsigned long loop_offset;
 	double sample_rate;
-	unsigned long real_num_samples;
 } AifData;
 
 struct Bytes {
@@ -88,28 +105,94 @@ struct Bytes *read_bytearray(const char *filename)
 	bytes->data = malloc(bytes->length);
 	unsigned long read = fread(bytes->data, bytes->length, 1, f);
 	fclose(f);
-	if (read <= 0)
+	// An empty file, such as the manifest of an up-to-date build, is fine.
+	if (read <= 0 && bytes->length != 0)
 	{
 		FATAL_ERROR("Failed to read data from '%s'!\n", filename);
 	}
 	return bytes;
 }
 
-void write_bytearray(const char *filename, struct Bytes *bytes)
+void free_bytearray(struct Bytes *bytes)
+{
+	free(bytes->data);
+	free(bytes);
+}
+
+// Maps the whole file into memory instead of reading it, so that large
+// samples are paged in as they're converted. Falls back to reading the file
+// where mmap() isn't available.
+struct Bytes *map_bytearray(const char *filename)
+{
+#ifdef _WIN32
+	return read_bytearray(filename);
+#else
+	struct Bytes *bytes = malloc(sizeof(struct Bytes));
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		FATAL_ERROR("Failed to open '%s' for reading!\n", filename);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0)
+	{
+		FATAL_ERROR("Failed to read data from '%s'!\n", filename);
+	}
+	bytes->length = st.st_size;
+	bytes->data = mmap(NULL, bytes->length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (bytes->data == MAP_FAILED)
+	{
+		FATAL_ERROR("Failed to read data from '%s'!\n", filename);
+	}
+	return bytes;
+#endif
+}
+
+void unmap_bytearray(struct Bytes *bytes)
+{
+#ifdef _WIN32
+	free_bytearray(bytes);
+#else
+	munmap(bytes->data, bytes->length);
+	free(bytes);
+#endif
+}
+
+FILE *open_output_file(const char *filename)
 {
 	FILE *f = fopen(filename, "wb");
 	if (!f)
 	{
 		FATAL_ERROR("Failed to open '%s' for writing!\n", filename);
 	}
-	fwrite(bytes->data, bytes->length, 1, f);
-	fclose(f);
+	return f;
 }
 
-void free_bytearray(struct Bytes *bytes)
+void write_output(FILE *f, const char *filename, const void *data, unsigned long length)
 {
-	free(bytes->data);
-	free(bytes);
+	if (length != 0 && fwrite(data, length, 1, f) != 1)
+	{
+		fclose(f);
+		remove(filename);
+		FATAL_ERROR("Failed to write to '%s'!\n", filename);
+	}
+}
+
+void close_output_file(FILE *f, const char *filename)
+{
+	if (fclose(f) != 0)
+	{
+		remove(filename);
+		FATAL_ERROR("Failed to write to '%s'!\n", filename);
+	}
+}
+
+void write_bytearray(const char *filename, struct Bytes *bytes)
+{
+	FILE *f = open_output_file(filename);
+	write_output(f, filename, bytes->data, bytes->length);
+	close_output_file(f, filename);
 }
 
 char *get_file_extension(char *filename)
@@ -298,29 +381,10 @@ void read_aif(struct Bytes *aif, AifData *aif_data)
 			// Skip offset and blockSize
 			pos += 8;
 
-			unsigned long num_samples = chunk_size - 8;
-			if (aif_data->sample_size == 8)
-			{
-				uint8_t *sample_data = (uint8_t *)malloc(num_samples * sizeof(uint8_t));
-				memcpy(sample_data, &aif->data[pos], num_samples);
-	
-				aif_data->samples8 = sample_data;
-				aif_data->real_num_samples = num_samples;
-			}
-			else
-			{
-				uint16_t *sample_data = (uint16_t *)malloc(num_samples * sizeof(uint16_t));
-				uint16_t *sample_data_swapped = (uint16_t *)malloc(num_samples * sizeof(uint16_t));
-				memcpy(sample_data, &aif->data[pos], num_samples);
-				for (long unsigned i = 0; i < num_samples; i++)
-				{
-					sample_data_swapped[i] = __builtin_bswap16(sample_data[i]);
-				}
-	
-				aif_data->samples16 = sample_data_swapped;
-				aif_data->real_num_samples = num_samples;
-				free(sample_data);
-			}
+			// The samples are converted straight from the file by aif2pcm(),
+			// once the COMM Chunk has given their size.
+			aif_data->sound_data = &aif->data[pos];
+			aif_data->sound_data_length = chunk_size - 8;
 			pos += chunk_size - 8;
 		}
 		else
@@ -482,73 +546,67 @@ int get_delta_index(uint8_t sample, uint8_t prev_sample)
 	return best_index;
 }
 
-struct Bytes *delta_compress(struct Bytes *pcm)
+// Remembers get_delta_index for each (prev_sample, sample) pair, plus one, so
+// that zero marks a pair that hasn't been looked up yet. Samples repeat the
+// same pairs a lot, and in batch mode the table is shared by every file.
+uint8_t gDeltaIndexTable[256][256];
+
+int lookup_delta_index(uint8_t sample, uint8_t prev_sample)
 {
-	struct Bytes *delta = malloc(sizeof(struct Bytes));
-	// estimate the length so we can malloc
-	int num_blocks = pcm->length / 64;
-	delta->length = num_blocks * 33;
+	uint8_t *entry = &gDeltaIndexTable[prev_sample][sample];
 
-	int extra = pcm->length % 64;
-	if (extra)
-	{
-		delta->length += 1;
-		extra -= 1;
-	}
-	if (extra)
-	{
-		delta->length += 1;
-		extra -= 1;
-	}
-	if (extra)
-	{
-		delta->length += (extra + 1) / 2;
-	}
+	if (*entry == 0)
+		*entry = get_delta_index(sample, prev_sample) + 1;
 
-	delta->data = malloc(delta->length + 33);
+	return *entry - 1;
+}
 
-	unsigned int i = 0;
-	unsigned int j = 0;
+// Compresses length samples into delta, which must have room for 33 bytes
+// per 64 samples, and returns the compressed length. Each 64 samples are
+// compressed on their own, so a long sample can be compressed a few blocks
+// at a time.
+unsigned long delta_compress(const uint8_t *pcm, unsigned long length, uint8_t *delta)
+{
+	unsigned long i = 0;
+	unsigned long j = 0;
 	int k;
 	uint8_t base;
 	int delta_index;
 
-	while (i < pcm->length)
+	while (i < length)
 	{
-		base = pcm->data[i++];
-		delta->data[j++] = base;
+		base = pcm[i++];
+		delta[j++] = base;
 
-		if (i >= pcm->length)
+		if (i >= length)
 		{
 			break;
 		}
-		delta_index = get_delta_index(pcm->data[i++], base);
+		delta_index = lookup_delta_index(pcm[i++], base);
 		base += gDeltaEncodingTable[delta_index];
-		delta->data[j++] = delta_index;
+		delta[j++] = delta_index;
 
 		for (k = 0; k < 31; k++)
 		{
-			if (i >= pcm->length)
+			if (i >= length)
 			{
 				break;
 			}
-			delta_index = get_delta_index(pcm->data[i++], base);
+			delta_index = lookup_delta_index(pcm[i++], base);
 			base += gDeltaEncodingTable[delta_index];
-			delta->data[j] = (delta_index << 4);
+			delta[j] = (delta_index << 4);
 
-			if (i >= pcm->length)
+			if (i >= length)
 			{
 				break;
 			}
-			delta_index = get_delta_index(pcm->data[i++], base);
+			delta_index = lookup_delta_index(pcm[i++], base);
 			base += gDeltaEncodingTable[delta_index];
-			delta->data[j++] |= delta_index;
+			delta[j++] |= delta_index;
 		}
 	}
 
-	delta->length = j;
-
-	return delta;
+	return j;
 }
 
 #define STORE_U32_LE(dest, value) \
@@ -567,65 +625,71 @@ do { \
 	(var) |= (*((src) + 3) << 24); \
 } while (0)
 
+// The number of samples converted at a time. It must be a multiple of the
+// 64-sample blocks that delta_compress() works in.
+#define PCM_BLOCK_SIZE 4096
+
 // Reads an .aif file and produces a .pcm file containing an array of 8-bit samples.
+// The samples are converted and written a block at a time, so the memory used
+// doesn't grow with the length of the sample.
 void aif2pcm(const char *aif_filename, const char *pcm_filename, bool compress)
 {
-	struct Bytes *aif = read_bytearray(aif_filename);
+	struct Bytes *aif = map_bytearray(aif_filename);
 	AifData aif_data = {0};
 	read_aif(aif, &aif_data);
-	
-	// Convert 16-bit to 8-bit if necessary
-	if (aif_data.sample_size == 16)
-	{
-		aif_data.real_num_samples /= 2;
-		uint8_t *converted_samples = malloc(aif_data.real_num_samples * sizeof(uint8_t));
-		for (unsigned long i = 0; i < aif_data.real_num_samples; i++)
-		{
-			converted_samples[i] = aif_data.samples16[i] >> 8;
-		}
-		free(aif_data.samples16);
-		aif_data.samples8 = converted_samples;
-	}
 
-	int header_size = 0x10;
-	struct Bytes *pcm;
-	struct Bytes output = {0,0};
-
-	if (compress)
-	{
-		struct Bytes *input = malloc(sizeof(struct Bytes));
-		input->data = aif_data.samples8;
-		input->length = aif_data.real_num_samples;
-		pcm = delta_compress(input);
-		free(input);
-	}
-	else
-	{
-		pcm = malloc(sizeof(struct Bytes));
-		pcm->data = aif_data.samples8;
-		pcm->length = aif_data.real_num_samples;
-	}
-	output.length = header_size + pcm->length;
-	output.data = malloc(output.length);
+	// 16-bit samples are big-endian, so the high byte comes first.
+	unsigned long sample_stride = aif_data.sample_size == 16 ? 2 : 1;
+	unsigned long real_num_samples = aif_data.sound_data_length / sample_stride;
 
+	uint8_t header[0x10];
 	uint32_t pitch_adjust = (uint32_t)(aif_data.sample_rate * 1024);
 	uint32_t loop_offset = (uint32_t)(aif_data.loop_offset);
 	uint32_t adjusted_num_samples = (uint32_t)(aif_data.num_samples - 1);
 	uint32_t flags = 0;
 	if (aif_data.has_loop) flags |= 0x40000000;
 	if (compress) flags |= 1;
-	STORE_U32_LE(output.data + 0, flags);
-	STORE_U32_LE(output.data + 4, pitch_adjust);
-	STORE_U32_LE(output.data + 8, loop_offset);
-	STORE_U32_LE(output.data + 12, adjusted_num_samples);
-	memcpy(&output.data[header_size], pcm->data, pcm->length);
-	write_bytearray(pcm_filename, &output);
+	STORE_U32_LE(header + 0, flags);
+	STORE_U32_LE(header + 4, pitch_adjust);
+	STORE_U32_LE(header + 8, loop_offset);
+	STORE_U32_LE(header + 12, adjusted_num_samples);
 
-	free(aif->data);
-	free(aif);
-	free(pcm);
-	free(output.data);
-	free(aif_data.samples8);
+	FILE *f = open_output_file(pcm_filename);
+	write_output(f, pcm_filename, header, sizeof(header));
+
+	uint8_t samples[PCM_BLOCK_SIZE];
+	uint8_t delta[PCM_BLOCK_SIZE / 64 * 33];
+
+	for (unsigned long start = 0; start < real_num_samples; start += PCM_BLOCK_SIZE)
+	{
+		unsigned long count = real_num_samples - start;
+		if (count > PCM_BLOCK_SIZE)
+		{
+			count = PCM_BLOCK_SIZE;
+		}
+
+		const uint8_t *block = &aif_data.sound_data[start * sample_stride];
+		if (sample_stride != 1)
+		{
+			for (unsigned long i = 0; i < count; i++)
+			{
+				samples[i] = block[i * sample_stride];
+			}
+			block = samples;
+		}
+
+		if (compress)
+		{
+			write_output(f, pcm_filename, delta, delta_compress(block, count, delta));
+		}
+		else
+		{
+			write_output(f, pcm_filename, block, count);
+		}
+	}
+
+	close_output_file(f, pcm_filename);
+	unmap_bytearray(aif);
 }
 
 // Reads a .pcm file containing an array of 8-bit samples and produces an .aif file.
@@ -882,9 +946,10 @@ void usage(void)
 {
 	fprintf(stderr, "Usage: aif2pcm bin_file [aif_file]\n");
 	fprintf(stderr, "       aif2pcm aif_file [bin_file] [--compress]\n");
+	fprintf(stderr, "       aif2pcm --batch manifest_file\n");
 }
 
-int main(int argc, char **argv)
+void run_command(int argc, char **argv)
 {
 	if (argc < 2)
 	{
@@ -908,7 +973,11 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (strcmp(extension, "aif") == 0 || strcmp(extension, "aiff") == 0)
+	if (extension == NULL)
+	{
+		FATAL_ERROR("Input file must be .aif or .bin: '%s'\n", input_file);
+	}
+	else if (strcmp(extension, "aif") == 0 || strcmp(extension, "aiff") == 0)
 	{
 		if (argc >= 3)
 		{
@@ -940,6 +1009,85 @@ int main(int argc, char **argv)
 	{
 		FATAL_ERROR("Input file must be .aif or .bin: '%s'\n", input_file);
 	}
+}
+
+bool get_mtime(const char *filename, long long *mtime)
+{
+	struct stat st;
+
+	if (stat(filename, &st) != 0)
+		return false;
+
+	*mtime = (long long)st.st_mtime * 1000000000LL + STAT_MTIME_NSEC(st);
+	return true;
+}
+
+#define MAX_BATCH_ARGS 8
+
+// Runs each line of the manifest as the arguments of a separate aif2pcm
+// command, such as "input.aif output.bin --compress". Lines whose output is
+// at least as new as their input are skipped, as are lines whose input
+// doesn't exist, which are left for make to report.
+void run_batch(const char *manifest_filename)
+{
+	struct Bytes *manifest = read_bytearray(manifest_filename);
+	char *text = malloc(manifest->length + 1);
+	int line_num = 0;
+
+	memcpy(text, manifest->data, manifest->length);
+	text[manifest->length] = 0;
+	free_bytearray(manifest);
+
+	for (char *line = text; line != NULL; )
+	{
+		char *next = strchr(line, '\n');
+
+		if (next != NULL)
+			*next++ = 0;
+
+		line_num++;
+
+		int argc = 1;
+		char *args[MAX_BATCH_ARGS];
+
+		args[0] = "aif2pcm";
+
+		for (char *token = strtok(line, " \t\r"); token != NULL; token = strtok(NULL, " \t\r"))
+		{
+			if (argc == 1 && token[0] == '#')
+				break;
+
+			if (argc == MAX_BATCH_ARGS)
+				FATAL_ERROR("%s:%d: Too many arguments.\n", manifest_filename, line_num);
+
+			args[argc++] = token;
+		}
+
+		line = next;
+
+		if (argc == 1)
+			continue;
+
+		long long input_mtime, output_mtime;
+
+		if (!get_mtime(args[1], &input_mtime))
+			continue;
+
+		if (argc >= 3 && args[2][0] != '-' && get_mtime(args[2], &output_mtime) && output_mtime >= input_mtime)
+			continue;
+
+		run_command(argc, args);
+	}
+
+	free(text);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 3 && strcmp(argv[1], "--batch") == 0)
+		run_batch(argv[2]);
+	else
+		run_command(argc, argv);
 
 	return 0;
 }
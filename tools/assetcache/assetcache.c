@@ -0,0 +1,352 @@
+// Runs an asset conversion tool through a cache of its outputs.
+//
+// Usage: assetcache TOOL INPUT_PATH OUTPUT_PATH [options...]
+//
+// The cache is keyed by the contents of TOOL and INPUT_PATH, the input file's
+// extension, the output file's name (mid2agb takes its labels from it), and
+// the options, including the contents of any option that names a file. On a
+// hit, OUTPUT_PATH becomes a copy of the cached file. Where the file system
+// can clone files (btrfs, XFS), the copy shares the cached file's blocks, so
+// checkouts that build the same assets don't each store them. On a miss, the
+// tool runs and its output is added to the cache.
+//
+// The cache lives in ASSET_CACHE_DIR, or in ~/.cache/pokeemerald-assets if
+// that isn't set. It can be deleted at any time. Outputs are never hard links
+// to cached files, since setting an output's mtime would set the cached
+// file's too, and with it the mtime of every other checkout's output.
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/wait.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#define FATAL_ERROR(format, ...)            \
+do {                                        \
+    fprintf(stderr, format, ##__VA_ARGS__); \
+    exit(1);                                \
+} while (0)
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+static uint64_t HashBytes(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+// Returns false if the file can't be read.
+static bool HashFile(const char *path, uint64_t *hash)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
+        return false;
+
+    unsigned char buffer[65536];
+    size_t count;
+
+    while ((count = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        *hash = HashBytes(*hash, buffer, count);
+
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+static const char *GetExtension(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+
+    if (dot == NULL || (slash != NULL && dot < slash))
+        return "";
+
+    return dot;
+}
+
+static const char *GetFileName(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    return slash != NULL ? slash + 1 : path;
+}
+
+static int RunTool(char **argv)
+{
+#ifdef _WIN32
+    return _spawnvp(_P_WAIT, argv[0], (const char *const *)argv);
+#else
+    pid_t pid = fork();
+
+    if (pid < 0)
+        FATAL_ERROR("Failed to start \"%s\".\n", argv[0]);
+
+    if (pid == 0)
+    {
+        execvp(argv[0], argv);
+        fprintf(stderr, "Failed to run \"%s\". (error: %s)\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return 1;
+
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+
+    return 128 + WTERMSIG(status);
+#endif
+}
+
+static bool CopyFile(const char *sourcePath, const char *destPath)
+{
+    FILE *source = fopen(sourcePath, "rb");
+
+    if (source == NULL)
+        return false;
+
+    FILE *dest = fopen(destPath, "wb");
+
+    if (dest == NULL)
+    {
+        fclose(source);
+        return false;
+    }
+
+    unsigned char buffer[65536];
+    size_t count;
+    bool ok = true;
+
+    while ((count = fread(buffer, 1, sizeof(buffer), source)) > 0)
+        if (fwrite(buffer, 1, count, dest) != count)
+            ok = false;
+
+    if (ferror(source))
+        ok = false;
+
+    fclose(source);
+
+    if (fclose(dest) != 0)
+        ok = false;
+
+    return ok;
+}
+
+// Makes destPath a clone of sourcePath that shares its blocks. Returns false
+// if the file system can't clone files.
+static bool CloneFile(const char *sourcePath, const char *destPath)
+{
+#ifdef FICLONE
+    int source = open(sourcePath, O_RDONLY);
+
+    if (source < 0)
+        return false;
+
+    int dest = open(destPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (dest < 0)
+    {
+        close(source);
+        return false;
+    }
+
+    bool ok = ioctl(dest, FICLONE, source) == 0;
+
+    close(source);
+
+    if (close(dest) != 0)
+        ok = false;
+
+    return ok;
+#else
+    (void)sourcePath;
+    (void)destPath;
+    return false;
+#endif
+}
+
+static void MakeDirectory(const char *path)
+{
+#ifdef _WIN32
+    mkdir(path);
+#else
+    mkdir(path, 0777);
+#endif
+}
+
+// Creates every missing directory in path, which must end with a slash.
+static void MakeDirectories(char *path)
+{
+    for (char *p = path + 1; *p != 0; p++)
+    {
+        if (*p == '/')
+        {
+            *p = 0;
+            MakeDirectory(path);
+            *p = '/';
+        }
+    }
+}
+
+static char *GetCacheDir(void)
+{
+    const char *dir = getenv("ASSET_CACHE_DIR");
+    char *path;
+
+    if (dir != NULL && *dir != 0)
+    {
+        path = malloc(strlen(dir) + 2);
+        if (path == NULL)
+            FATAL_ERROR("Failed to allocate memory for cache path.\n");
+        sprintf(path, "%s/", dir);
+        return path;
+    }
+
+    const char *home = getenv("HOME");
+
+    if (home == NULL || *home == 0)
+        return NULL;
+
+    path = malloc(strlen(home) + 32);
+    if (path == NULL)
+        FATAL_ERROR("Failed to allocate memory for cache path.\n");
+    sprintf(path, "%s/.cache/pokeemerald-assets/", home);
+    return path;
+}
+
+// Makes outputPath a clone of the cached file, or a plain copy if it can't be
+// cloned. Either way it's a new file, so it gets the current time as its
+// mtime, and make doesn't see it as older than a freshly checked out input.
+static bool RestoreFromCache(const char *cachePath, const char *outputPath)
+{
+    struct stat st;
+
+    if (stat(cachePath, &st) != 0)
+        return false;
+
+    remove(outputPath);
+
+    if (CloneFile(cachePath, outputPath) || CopyFile(cachePath, outputPath))
+        return true;
+
+    remove(outputPath);
+    return false;
+}
+
+// Other builds may be storing the same entry, so it's written under a
+// temporary name and renamed into place.
+static void StoreInCache(char *cachePath, const char *outputPath)
+{
+    char *tempPath = malloc(strlen(cachePath) + 32);
+
+    if (tempPath == NULL)
+        FATAL_ERROR("Failed to allocate memory for cache path.\n");
+
+    sprintf(tempPath, "%s.%ld.tmp", cachePath, (long)getpid());
+    MakeDirectories(cachePath);
+
+    if (CopyFile(outputPath, tempPath))
+    {
+        chmod(tempPath, 0444);
+
+        if (rename(tempPath, cachePath) != 0)
+            remove(tempPath);
+    }
+    else
+    {
+        remove(tempPath);
+    }
+
+    free(tempPath);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+        FATAL_ERROR("Usage: assetcache TOOL INPUT_PATH OUTPUT_PATH [options...]\n");
+
+    char **toolArgv = &argv[1];
+
+    // Anything that isn't a plain conversion, such as "gbagfx --manifest",
+    // runs as is.
+    if (argc < 4 || argv[2][0] == '-' || argv[3][0] == '-')
+        return RunTool(toolArgv);
+
+    const char *inputPath = argv[2];
+    const char *outputPath = argv[3];
+    char *cacheDir = GetCacheDir();
+    uint64_t toolHash = FNV_OFFSET_BASIS;
+    uint64_t inputHash = FNV_OFFSET_BASIS;
+    uint64_t optionsHash = FNV_OFFSET_BASIS;
+
+    if (cacheDir == NULL || !HashFile(argv[1], &toolHash) || !HashFile(inputPath, &inputHash))
+        return RunTool(toolArgv);
+
+    optionsHash = HashBytes(optionsHash, GetExtension(inputPath), strlen(GetExtension(inputPath)) + 1);
+    optionsHash = HashBytes(optionsHash, GetFileName(outputPath), strlen(GetFileName(outputPath)) + 1);
+
+    for (int i = 4; i < argc; i++)
+    {
+        optionsHash = HashBytes(optionsHash, argv[i], strlen(argv[i]) + 1);
+        HashFile(argv[i], &optionsHash);
+    }
+
+    char *cachePath = malloc(strlen(cacheDir) + 64);
+
+    if (cachePath == NULL)
+        FATAL_ERROR("Failed to allocate memory for cache path.\n");
+
+    char key[49];
+
+    sprintf(key, "%016llx%016llx%016llx", (unsigned long long)toolHash, (unsigned long long)inputHash, (unsigned long long)optionsHash);
+    sprintf(cachePath, "%s%.2s/%s", cacheDir, key, key + 2);
+
+    if (RestoreFromCache(cachePath, outputPath))
+        return 0;
+
+    remove(outputPath);
+
+    int status = RunTool(toolArgv);
+
+    if (status == 0)
+        StoreInCache(cachePath, outputPath);
+
+    free(cachePath);
+    free(cacheDir);
+    return status;
+}
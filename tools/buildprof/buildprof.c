@@ -0,0 +1,558 @@
+// Records how long each tool run in a build takes, and summarizes the records.
+//
+// Usage: buildprof run TRACE_FILE -- TOOL [args...]
+//        buildprof summary TRACE_FILE [--top N] [--chrome JSON_FILE]
+//
+// "run" runs the tool and appends one line to TRACE_FILE with its start and
+// end times, user and system CPU time, peak RSS, exit code, and the total
+// size of its inputs and outputs. An argument that names a file the tool
+// created or modified counts as an output, and any other argument that names a
+// file counts as an input. Files the tool reads from stdin or writes to stdout
+// aren't counted. Each line goes to the file in a single append, so parallel
+// jobs can share one trace. If the trace can't be written, the tool still runs.
+//
+// "summary" prints the time spent in each tool and the N slowest runs, and
+// can also write the runs in Chrome's trace event format, which chrome://tracing
+// and Perfetto can open. Runs that overlapped go on separate rows.
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+#define FATAL_ERROR(format, ...)            \
+do {                                        \
+    fprintf(stderr, format, ##__VA_ARGS__); \
+    exit(1);                                \
+} while (0)
+
+// Long lines are cut short so each one is written atomically. Fields can
+// fill up to MAX_RECORD_LENGTH, leaving room for the separators.
+#define MAX_RECORD_LENGTH 4000
+#define RECORD_BUFFER_SIZE (MAX_RECORD_LENGTH + 4)
+
+struct Record
+{
+    int64_t startUs;
+    int64_t endUs;
+    int64_t userUs;
+    int64_t systemUs;
+    int64_t maxRssKb;
+    int64_t inputBytes;
+    int64_t outputBytes;
+    int exitCode;
+    char *tool;
+    char *label;
+    char *command;
+};
+
+struct ToolTotal
+{
+    const char *tool;
+    int count;
+    int64_t wallUs;
+    int64_t cpuUs;
+    int64_t maxRssKb;
+};
+
+struct FileState
+{
+    bool exists;
+    int64_t size;
+    int64_t mtimeNs;
+};
+
+struct RusageResult
+{
+    int64_t userUs;
+    int64_t systemUs;
+    int64_t maxRssKb;
+};
+
+static int64_t GetTimeUs(void)
+{
+    struct timespec ts;
+
+    timespec_get(&ts, TIME_UTC);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct FileState GetFileState(const char *path)
+{
+    struct FileState state = { false, 0, 0 };
+    struct stat st;
+
+    // Programs, such as the compiler stages preproc --compile runs, aren't
+    // counted.
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && !(st.st_mode & S_IXUSR))
+    {
+        state.exists = true;
+        state.size = st.st_size;
+#ifdef _WIN32
+        state.mtimeNs = (int64_t)st.st_mtime * 1000000000;
+#else
+        state.mtimeNs = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    }
+
+    return state;
+}
+
+static const char *GetFileName(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    return slash != NULL ? slash + 1 : path;
+}
+
+static int RunTool(char **argv, struct RusageResult *usage)
+{
+    memset(usage, 0, sizeof(*usage));
+
+#ifdef _WIN32
+    return _spawnvp(_P_WAIT, argv[0], (const char *const *)argv);
+#else
+    pid_t pid = fork();
+
+    if (pid < 0)
+        FATAL_ERROR("Failed to start \"%s\".\n", argv[0]);
+
+    if (pid == 0)
+    {
+        execvp(argv[0], argv);
+        fprintf(stderr, "Failed to run \"%s\". (error: %s)\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    int status;
+    struct rusage ru;
+
+    // The usage includes any children the tool waited for.
+    while (wait4(pid, &status, 0, &ru) < 0)
+        if (errno != EINTR)
+            return 1;
+
+    usage->userUs = (int64_t)ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+    usage->systemUs = (int64_t)ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+    usage->maxRssKb = ru.ru_maxrss;
+
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+
+    return 128 + WTERMSIG(status);
+#endif
+}
+
+// Appends s to the record, turning tabs and newlines into spaces so the
+// record stays on one line.
+static void AppendField(char *record, size_t *length, const char *s)
+{
+    for (; *s != 0 && *length < MAX_RECORD_LENGTH; s++)
+        record[(*length)++] = (*s == '\t' || *s == '\n' || *s == '\r') ? ' ' : *s;
+}
+
+// Names the run after the tool, with the file it ran through, such as
+// assetcache, and the mode it ran in, such as --batch, if there is one.
+static void AppendToolName(char *record, size_t *length, char **argv)
+{
+    int i = 0;
+
+    AppendField(record, length, GetFileName(argv[i]));
+
+    if (strcmp(GetFileName(argv[i]), "assetcache") == 0 && argv[i + 1] != NULL)
+    {
+        i++;
+        AppendField(record, length, " ");
+        AppendField(record, length, GetFileName(argv[i]));
+    }
+
+    if (argv[i + 1] != NULL && strncmp(argv[i + 1], "--", 2) == 0)
+    {
+        AppendField(record, length, " ");
+        AppendField(record, length, argv[i + 1]);
+    }
+}
+
+static int Run(const char *tracePath, char **argv, int argc)
+{
+    struct FileState *before = malloc(sizeof(struct FileState) * (argc + 1));
+
+    if (before == NULL)
+        FATAL_ERROR("Failed to allocate memory for file states.\n");
+
+    for (int i = 1; i < argc; i++)
+        before[i] = GetFileState(argv[i]);
+
+    struct RusageResult usage;
+    int64_t startUs = GetTimeUs();
+    int exitCode = RunTool(argv, &usage);
+    int64_t endUs = GetTimeUs();
+    int64_t inputBytes = 0;
+    int64_t outputBytes = 0;
+    const char *firstInput = NULL;
+    const char *firstOutput = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        struct FileState after = GetFileState(argv[i]);
+        int j = 1;
+
+        while (j < i && strcmp(argv[j], argv[i]) != 0)
+            j++;
+
+        // Files named more than once only count once.
+        if (!after.exists || j < i)
+            continue;
+
+        if (!before[i].exists || before[i].mtimeNs != after.mtimeNs || before[i].size != after.size)
+        {
+            outputBytes += after.size;
+            if (firstOutput == NULL)
+                firstOutput = argv[i];
+        }
+        else
+        {
+            inputBytes += after.size;
+            if (firstInput == NULL)
+                firstInput = argv[i];
+        }
+    }
+
+    free(before);
+
+    char *record = malloc(RECORD_BUFFER_SIZE);
+
+    if (record == NULL)
+        FATAL_ERROR("Failed to allocate memory for trace record.\n");
+
+    size_t length = snprintf(record, MAX_RECORD_LENGTH, "%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t%d\t",
+        (long long)startUs, (long long)endUs, (long long)usage.userUs, (long long)usage.systemUs,
+        (long long)usage.maxRssKb, (long long)inputBytes, (long long)outputBytes, exitCode);
+
+    AppendToolName(record, &length, argv);
+    record[length++] = '\t';
+    AppendField(record, &length, firstOutput != NULL ? firstOutput : firstInput != NULL ? firstInput : "");
+    record[length++] = '\t';
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (i != 0)
+            AppendField(record, &length, " ");
+        AppendField(record, &length, argv[i]);
+    }
+
+    record[length++] = '\n';
+
+    int fd = open(tracePath, O_WRONLY | O_CREAT | O_APPEND, 0666);
+
+    if (fd < 0 || write(fd, record, length) != (ssize_t)length)
+        fprintf(stderr, "buildprof: failed to write to \"%s\"\n", tracePath);
+
+    if (fd >= 0)
+        close(fd);
+
+    free(record);
+    return exitCode;
+}
+
+static char *DuplicateString(const char *s, size_t length)
+{
+    char *copy = malloc(length + 1);
+
+    if (copy == NULL)
+        FATAL_ERROR("Failed to allocate memory for trace record.\n");
+
+    memcpy(copy, s, length);
+    copy[length] = 0;
+    return copy;
+}
+
+// Splits off the next tab-separated field of a record.
+static char *NextField(char **s)
+{
+    char *start = *s;
+    char *end = start + strcspn(start, "\t");
+
+    *s = *end != 0 ? end + 1 : end;
+    return DuplicateString(start, end - start);
+}
+
+static struct Record *ReadTrace(const char *tracePath, int *count)
+{
+    FILE *fp = fopen(tracePath, "r");
+
+    if (fp == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for reading.\n", tracePath);
+
+    struct Record *records = NULL;
+    int capacity = 0;
+    char line[RECORD_BUFFER_SIZE + 1];
+
+    *count = 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        struct Record r;
+        long long fields[7];
+        int consumed;
+
+        line[strcspn(line, "\n")] = 0;
+
+        if (sscanf(line, "%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t%d\t%n", &fields[0], &fields[1],
+                   &fields[2], &fields[3], &fields[4], &fields[5], &fields[6], &r.exitCode, &consumed) != 8)
+            continue;
+
+        char *rest = line + consumed;
+
+        r.startUs = fields[0];
+        r.endUs = fields[1];
+        r.userUs = fields[2];
+        r.systemUs = fields[3];
+        r.maxRssKb = fields[4];
+        r.inputBytes = fields[5];
+        r.outputBytes = fields[6];
+        r.tool = NextField(&rest);
+        r.label = NextField(&rest);
+        r.command = NextField(&rest);
+
+        if (*count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            records = realloc(records, sizeof(struct Record) * capacity);
+            if (records == NULL)
+                FATAL_ERROR("Failed to allocate memory for trace records.\n");
+        }
+
+        records[(*count)++] = r;
+    }
+
+    fclose(fp);
+    return records;
+}
+
+static int CompareStart(const void *a, const void *b)
+{
+    const struct Record *ra = a;
+    const struct Record *rb = b;
+
+    return (ra->startUs > rb->startUs) - (ra->startUs < rb->startUs);
+}
+
+static int CompareWall(const void *a, const void *b)
+{
+    const struct Record *ra = *(const struct Record *const *)a;
+    const struct Record *rb = *(const struct Record *const *)b;
+    int64_t wallA = ra->endUs - ra->startUs;
+    int64_t wallB = rb->endUs - rb->startUs;
+
+    return (wallA < wallB) - (wallA > wallB);
+}
+
+static int CompareToolWall(const void *a, const void *b)
+{
+    const struct ToolTotal *ta = a;
+    const struct ToolTotal *tb = b;
+
+    return (ta->wallUs < tb->wallUs) - (ta->wallUs > tb->wallUs);
+}
+
+static void WriteJsonString(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+
+    for (; *s != 0; s++)
+    {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\')
+            fprintf(fp, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(fp, "\\u%04x", c);
+        else
+            fputc(c, fp);
+    }
+
+    fputc('"', fp);
+}
+
+// Expects the records sorted by start time.
+static void WriteChromeTrace(const char *path, const struct Record *records, int count)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for writing.\n", path);
+
+    // Each row holds the end time of the last run placed on it.
+    int64_t *rowEnds = malloc(sizeof(int64_t) * (count + 1));
+
+    if (rowEnds == NULL)
+        FATAL_ERROR("Failed to allocate memory for trace rows.\n");
+
+    int rowCount = 0;
+    int64_t origin = count > 0 ? records[0].startUs : 0;
+
+    fprintf(fp, "{\"traceEvents\":[");
+
+    for (int i = 0; i < count; i++)
+    {
+        const struct Record *r = &records[i];
+        int row = 0;
+
+        while (row < rowCount && rowEnds[row] > r->startUs)
+            row++;
+
+        if (row == rowCount)
+            rowCount++;
+
+        rowEnds[row] = r->endUs;
+
+        fprintf(fp, "%s\n{\"name\":", i ? "," : "");
+        WriteJsonString(fp, *r->label ? r->label : r->tool);
+        fprintf(fp, ",\"cat\":");
+        WriteJsonString(fp, r->tool);
+        fprintf(fp, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,\"args\":{\"cpu_ms\":%.3f,\"max_rss_kb\":%lld,\"input_bytes\":%lld,\"output_bytes\":%lld,\"exit_code\":%d,\"command\":",
+            row + 1, (long long)(r->startUs - origin), (long long)(r->endUs - r->startUs),
+            (r->userUs + r->systemUs) / 1000.0, (long long)r->maxRssKb, (long long)r->inputBytes,
+            (long long)r->outputBytes, r->exitCode);
+        WriteJsonString(fp, r->command);
+        fprintf(fp, "}}");
+    }
+
+    fprintf(fp, "\n]}\n");
+
+    if (fclose(fp) != 0)
+        FATAL_ERROR("Failed to write \"%s\".\n", path);
+
+    free(rowEnds);
+}
+
+static void PrintSummary(struct Record *records, int count, int top)
+{
+    struct ToolTotal *totals = calloc(count + 1, sizeof(struct ToolTotal));
+    struct Record **byWall = malloc(sizeof(struct Record *) * (count + 1));
+
+    if (totals == NULL || byWall == NULL)
+        FATAL_ERROR("Failed to allocate memory for summary.\n");
+
+    int toolCount = 0;
+    int64_t totalWallUs = 0;
+    int64_t totalCpuUs = 0;
+    int64_t spanEndUs = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        struct Record *r = &records[i];
+        int t = 0;
+
+        while (t < toolCount && strcmp(totals[t].tool, r->tool) != 0)
+            t++;
+
+        if (t == toolCount)
+            totals[toolCount++].tool = r->tool;
+
+        totals[t].count++;
+        totals[t].wallUs += r->endUs - r->startUs;
+        totals[t].cpuUs += r->userUs + r->systemUs;
+        if (r->maxRssKb > totals[t].maxRssKb)
+            totals[t].maxRssKb = r->maxRssKb;
+
+        totalWallUs += r->endUs - r->startUs;
+        totalCpuUs += r->userUs + r->systemUs;
+        if (r->endUs > spanEndUs)
+            spanEndUs = r->endUs;
+
+        byWall[i] = r;
+    }
+
+    qsort(totals, toolCount, sizeof(struct ToolTotal), CompareToolWall);
+    qsort(byWall, count, sizeof(struct Record *), CompareWall);
+
+    printf("%d runs over %.2f s, %.2f s of tool wall time, %.2f s of CPU time\n\n",
+        count, count ? (spanEndUs - records[0].startUs) / 1e6 : 0.0, totalWallUs / 1e6, totalCpuUs / 1e6);
+
+    printf("%10s %10s %6s %10s  %s\n", "wall ms", "cpu ms", "runs", "max rss KB", "tool");
+
+    for (int t = 0; t < toolCount; t++)
+        printf("%10.1f %10.1f %6d %10lld  %s\n", totals[t].wallUs / 1000.0, totals[t].cpuUs / 1000.0,
+            totals[t].count, (long long)totals[t].maxRssKb, totals[t].tool);
+
+    printf("\nSlowest %d runs:\n", top < count ? top : count);
+    printf("%10s %10s %10s %10s %10s  %s\n", "wall ms", "cpu ms", "rss KB", "in bytes", "out bytes", "tool: file");
+
+    for (int i = 0; i < count && i < top; i++)
+    {
+        struct Record *r = byWall[i];
+
+        printf("%10.1f %10.1f %10lld %10lld %10lld  %s: %s%s\n", (r->endUs - r->startUs) / 1000.0,
+            (r->userUs + r->systemUs) / 1000.0, (long long)r->maxRssKb, (long long)r->inputBytes,
+            (long long)r->outputBytes, r->tool, r->label, r->exitCode ? " (failed)" : "");
+    }
+
+    free(totals);
+    free(byWall);
+}
+
+static int Summarize(int argc, char **argv)
+{
+    const char *tracePath = argv[2];
+    const char *chromePath = NULL;
+    int top = 20;
+
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--top") == 0 && i + 1 < argc)
+            top = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--chrome") == 0 && i + 1 < argc)
+            chromePath = argv[++i];
+        else
+            FATAL_ERROR("Unknown option \"%s\".\n", argv[i]);
+    }
+
+    int count;
+    struct Record *records = ReadTrace(tracePath, &count);
+
+    qsort(records, count, sizeof(struct Record), CompareStart);
+    PrintSummary(records, count, top);
+
+    if (chromePath != NULL)
+        WriteChromeTrace(chromePath, records, count);
+
+    for (int i = 0; i < count; i++)
+    {
+        free(records[i].tool);
+        free(records[i].label);
+        free(records[i].command);
+    }
+
+    free(records);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 5 && strcmp(argv[1], "run") == 0 && strcmp(argv[3], "--") == 0)
+        return Run(argv[2], &argv[4], argc - 4);
+
+    if (argc >= 3 && strcmp(argv[1], "summary") == 0)
+        return Summarize(argc, argv);
+
+    FATAL_ERROR("Usage: buildprof run TRACE_FILE -- TOOL [args...]\n"
+                "       buildprof summary TRACE_FILE [--top N] [--chrome JSON_FILE]\n");
+}
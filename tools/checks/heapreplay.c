@@ -0,0 +1,163 @@
+// Replays a synthetic allocation trace against gflib/malloc.c built for the
+// host, and counts the blocks each Alloc looks at before it finds one. The
+// Makefile builds it once as agbcc builds have the allocator (MODERN=0) and
+// once as modern builds do (MODERN=1), so the two can be compared.
+//
+// Usage: heapreplay [SCREENS]
+//
+// Each screen allocates 20 to 79 blocks: 80% of them 4 to 255 bytes, the rest
+// 0x200 to 0x9FF bytes or, one time in four, 0x800 to 0x37FF bytes. Then it
+// frees all but an eighth of the blocks that are live, in random order, so
+// some of them stay around from screen to screen as they do in the game.
+// The trace comes from a fixed seed, so the counts are the same every run.
+// SCREENS is 2000 by default.
+//
+// Every block is filled when it's allocated and checked before it's freed,
+// and CheckHeap runs after every screen. Either failing exits with status 1.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "global.h"
+#include "malloc.h"
+
+#define FATAL_ERROR(format, ...)            \
+do {                                        \
+    fprintf(stderr, format, ##__VA_ARGS__); \
+    exit(1);                                \
+} while (0)
+
+#define MAX_LIVE_BLOCKS 4000
+
+struct LiveBlock
+{
+    u8 *data;
+    u32 size;
+    u8 fill;
+};
+
+u32 gHeapReplayBlocksVisited;
+
+bool32 CheckHeap(void);
+
+static struct LiveBlock sLiveBlocks[MAX_LIVE_BLOCKS];
+static u32 sRandom = 12345;
+
+// The allocator clears blocks with CpuFill32.
+void CpuSet(const void *src, void *dest, u32 control)
+{
+    u32 count = control & 0x1FFFFF;
+    u32 unitSize = (control & CPU_SET_32BIT) ? 4 : 2;
+    const u8 *in = src;
+    u8 *out = dest;
+    u32 i;
+
+    for (i = 0; i < count; i++)
+    {
+        memcpy(out, in, unitSize);
+        out += unitSize;
+        if (!(control & CPU_SET_SRC_FIXED))
+            in += unitSize;
+    }
+}
+
+static u32 Random(u32 n)
+{
+    sRandom = sRandom * 1103515245 + 12345;
+    return (sRandom >> 8) % n;
+}
+
+static u32 RandomSize(void)
+{
+    if (Random(10) < 8)
+        return 4 + Random(252);
+    else if (Random(4) != 0)
+        return 0x200 + Random(0x800);
+    else
+        return 0x800 + Random(0x3000);
+}
+
+static void CheckBlock(const struct LiveBlock *block)
+{
+    u32 i;
+
+    for (i = 0; i < block->size; i++)
+    {
+        if (block->data[i] != block->fill)
+            FATAL_ERROR("Block of %u bytes at heap offset 0x%X was overwritten.\n",
+                        (unsigned)block->size, (unsigned)(block->data - gHeap));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long screens = 2000;
+    unsigned long allocs = 0;
+    unsigned long failed = 0;
+    unsigned long mostVisited = 0;
+    unsigned long visited = 0;
+    u32 numLive = 0;
+    unsigned long i;
+
+    if (argc > 2)
+        FATAL_ERROR("Usage: heapreplay [SCREENS]\n");
+    if (argc == 2)
+    {
+        char *end;
+
+        screens = strtoul(argv[1], &end, 10);
+        if (*end != '\0' || screens == 0)
+            FATAL_ERROR("SCREENS must be a positive number, not \"%s\".\n", argv[1]);
+    }
+
+    HeapInit();
+
+    for (i = 0; i < screens; i++)
+    {
+        u32 count = 20 + Random(60);
+        u32 keep;
+        u32 j;
+
+        for (j = 0; j < count && numLive < MAX_LIVE_BLOCKS; j++)
+        {
+            struct LiveBlock *block = &sLiveBlocks[numLive];
+            u32 size = RandomSize();
+            u32 before = gHeapReplayBlocksVisited;
+
+            block->data = Alloc(size);
+            allocs++;
+            if (gHeapReplayBlocksVisited - before > mostVisited)
+                mostVisited = gHeapReplayBlocksVisited - before;
+            visited += gHeapReplayBlocksVisited - before;
+            if (block->data == NULL)
+            {
+                failed++;
+                continue;
+            }
+
+            block->size = size;
+            block->fill = Random(256);
+            memset(block->data, block->fill, size);
+            numLive++;
+        }
+
+        keep = numLive / 8;
+        while (numLive > keep)
+        {
+            u32 k = Random(numLive);
+
+            CheckBlock(&sLiveBlocks[k]);
+            Free(sLiveBlocks[k].data);
+            sLiveBlocks[k] = sLiveBlocks[--numLive];
+        }
+
+        if (!CheckHeap())
+            FATAL_ERROR("CheckHeap failed after screen %lu.\n", i + 1);
+    }
+
+    printf("%lu screens, %lu allocations, %lu failed\n", screens, allocs, failed);
+    printf("blocks visited: %lu, %.2f per allocation, at most %lu\n",
+           visited, (double)visited / allocs, mostVisited);
+
+    return 0;
+}
@@ -0,0 +1,353 @@
+// Checks that gbagfx's Huffman compressor round-trips, and times it and the
+// decompressor.
+//
+// Usage: huffcheck LIST_FILE [PASSES]
+//
+// LIST_FILE names one file per line. Files ending in .8bpp are compressed
+// with 8-bit symbols, as "gbagfx FILE FILE.huff -depth 8" would, and others
+// with 4-bit symbols. Some generated inputs are added to them, with many
+// distinct symbols, with one, and with counts that make long codes, each at
+// both depths.
+//
+// Each input is compressed by HuffCompress in tools/gbagfx/huff.c and
+// decompressed both by HuffDecompress and by a decoder below that reads the
+// data the way the GBA BIOS does, one bit at a time from the root of the tree.
+// Both have to give back the input. Then the inputs are all compressed, and
+// all decompressed, PASSES times (10 by default), and the average time a pass
+// takes is printed. Any input that doesn't round-trip exits with status 1.
+//
+// huffcheck.sh runs it over the 4bpp and 8bpp files the ROM build makes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "global.h"
+#include "huff.h"
+
+#define MAX_LINE_LENGTH 1024
+#define MAX_INPUTS 8192
+#define GENERATED_SIZE 0x2000
+
+struct Input
+{
+    char *name;
+    unsigned char *data;
+    int size;
+    int bitDepth;
+};
+
+static struct Input sInputs[MAX_INPUTS];
+static int sNumInputs;
+static uint32_t sRandom = 1;
+
+static uint32_t Random(uint32_t n)
+{
+    sRandom = sRandom * 1103515245 + 12345;
+    return (sRandom >> 8) % n;
+}
+
+static void AddInput(const char *name, unsigned char *data, int size, int bitDepth)
+{
+    if (sNumInputs == MAX_INPUTS)
+        FATAL_ERROR("More than %d inputs.\n", MAX_INPUTS);
+
+    sInputs[sNumInputs].name = malloc(strlen(name) + 1);
+    if (sInputs[sNumInputs].name == NULL)
+        FATAL_ERROR("Failed to allocate memory for \"%s\".\n", name);
+    strcpy(sInputs[sNumInputs].name, name);
+    sInputs[sNumInputs].data = data;
+    sInputs[sNumInputs].size = size;
+    sInputs[sNumInputs].bitDepth = bitDepth;
+    sNumInputs++;
+}
+
+static void ReadInputs(const char *listPath)
+{
+    FILE *list = fopen(listPath, "r");
+    char line[MAX_LINE_LENGTH];
+
+    if (list == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for reading.\n", listPath);
+
+    while (fgets(line, sizeof(line), list) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0)
+            continue;
+
+        FILE *fp = fopen(line, "rb");
+
+        if (fp == NULL)
+            FATAL_ERROR("Failed to open \"%s\" for reading.\n", line);
+
+        fseek(fp, 0, SEEK_END);
+        int size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        // HuffCompress can't compress nothing, and neither can gbagfx.
+        if (size == 0)
+        {
+            fclose(fp);
+            continue;
+        }
+
+        unsigned char *data = malloc(size);
+
+        if (data == NULL)
+            FATAL_ERROR("Failed to allocate memory for \"%s\".\n", line);
+        if (fread(data, size, 1, fp) != 1)
+            FATAL_ERROR("Failed to read \"%s\".\n", line);
+        fclose(fp);
+
+        const char *extension = strrchr(line, '.');
+
+        AddInput(line, data, size, extension != NULL && strcmp(extension, ".8bpp") == 0 ? 8 : 4);
+    }
+
+    fclose(list);
+}
+
+// Fills the data with symbols of the given depth, where symbol i is picked
+// with a weight of weights[i].
+static unsigned char *GenerateData(const uint32_t *weights, int bitDepth)
+{
+    int numSymbols = 1 << bitDepth;
+    uint32_t total = 0;
+    unsigned char *data = calloc(GENERATED_SIZE, 1);
+
+    if (data == NULL)
+        FATAL_ERROR("Failed to allocate memory for generated data.\n");
+
+    for (int i = 0; i < numSymbols; i++)
+        total += weights[i];
+
+    for (int i = 0; i < GENERATED_SIZE * 8 / bitDepth; i++)
+    {
+        uint32_t pick = Random(total);
+        int symbol = 0;
+
+        while (pick >= weights[symbol])
+            pick -= weights[symbol++];
+
+        if (bitDepth == 8)
+            data[i] = symbol;
+        else
+            data[i / 2] |= symbol << ((i & 1) * 4);
+    }
+
+    return data;
+}
+
+static void AddGeneratedInputs(void)
+{
+    static const char *const kinds[] = { "even", "random", "one", "two", "long" };
+    uint32_t weights[256];
+
+    for (int bitDepth = 4; bitDepth <= 8; bitDepth += 4)
+    {
+        int numSymbols = 1 << bitDepth;
+
+        for (size_t kind = 0; kind < sizeof(kinds) / sizeof(kinds[0]); kind++)
+        {
+            for (int i = 0; i < numSymbols; i++)
+            {
+                switch (kind)
+                {
+                case 0: // Every symbol as often as the others.
+                    weights[i] = 1;
+                    break;
+                case 1: // Every symbol, with random counts.
+                    weights[i] = 1 + Random(1000);
+                    break;
+                case 2: // A single symbol.
+                    weights[i] = i == 3;
+                    break;
+                case 3: // Two symbols.
+                    weights[i] = i == 0 || i == numSymbols - 1;
+                    break;
+                case 4: // Each symbol half as common as the last, down to
+                        // 1, which gives codes as long as they get here.
+                    weights[i] = i < 20 ? 1u << (20 - i) : 1;
+                    break;
+                }
+            }
+
+            char name[32];
+
+            sprintf(name, "(%s, %d-bit)", kinds[kind], bitDepth);
+            AddInput(name, GenerateData(weights, bitDepth), GENERATED_SIZE, bitDepth);
+        }
+    }
+}
+
+static uint32_t Read32(const unsigned char *src)
+{
+    return src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+// Decodes the data the way the BIOS's HuffUnComp does. Returns false if the
+// data or the tree runs out before the last symbol.
+static bool ReferenceDecompress(const unsigned char *src, int srcSize, unsigned char *dest, int destSize)
+{
+    int bitDepth = src[0] & 15;
+    int treeEnd = 4 + (src[4] + 1) * 2;
+    int srcPos = treeEnd;
+    int node = 5;
+    uint32_t word = 0;
+    int bitsLeft = 0;
+
+    memset(dest, 0, destSize);
+
+    for (int i = 0; i < destSize * 8 / bitDepth;)
+    {
+        if (bitsLeft == 0)
+        {
+            if (srcPos + 4 > srcSize)
+                return false;
+            word = Read32(src + srcPos);
+            srcPos += 4;
+            bitsLeft = 32;
+        }
+
+        int bit = word >> 31;
+        int child = (node & ~1) + ((src[node] & 0x3F) + 1) * 2 + bit;
+
+        word <<= 1;
+        bitsLeft--;
+
+        if (child >= treeEnd)
+            return false;
+
+        if (src[node] & (0x80 >> bit))
+        {
+            if (bitDepth == 8)
+                dest[i] = src[child];
+            else
+                dest[i / 2] |= (src[child] & 0xF) << ((i & 1) * 4);
+            node = 5;
+            i++;
+        }
+        else
+        {
+            node = child;
+        }
+    }
+
+    return true;
+}
+
+static bool CheckInput(const struct Input *input, long *compressedTotal)
+{
+    int compressedSize;
+    int decompressedSize;
+    unsigned char *compressed = HuffCompress(input->data, input->size, &compressedSize, input->bitDepth);
+    unsigned char *decompressed = HuffDecompress(compressed, compressedSize, &decompressedSize);
+    unsigned char *reference = malloc(input->size);
+    bool ok = true;
+
+    if (reference == NULL)
+        FATAL_ERROR("Failed to allocate memory for \"%s\".\n", input->name);
+
+    if (decompressedSize != input->size || memcmp(decompressed, input->data, input->size) != 0)
+    {
+        fprintf(stderr, "%s: HuffDecompress doesn't give back the input\n", input->name);
+        ok = false;
+    }
+
+    if (!ReferenceDecompress(compressed, compressedSize, reference, input->size)
+     || memcmp(reference, input->data, input->size) != 0)
+    {
+        fprintf(stderr, "%s: the BIOS wouldn't give back the input\n", input->name);
+        ok = false;
+    }
+
+    *compressedTotal += compressedSize;
+    free(compressed);
+    free(decompressed);
+    free(reference);
+    return ok;
+}
+
+static double SecondsSince(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+    int passes = 10;
+
+    if (argc < 2 || argc > 3)
+        FATAL_ERROR("Usage: huffcheck LIST_FILE [PASSES]\n");
+    if (argc == 3)
+    {
+        char *end;
+
+        passes = strtol(argv[2], &end, 10);
+        if (*end != 0 || passes <= 0)
+            FATAL_ERROR("PASSES must be a positive number, not \"%s\".\n", argv[2]);
+    }
+
+    ReadInputs(argv[1]);
+    AddGeneratedInputs();
+
+    long inputTotal = 0;
+    long compressedTotal = 0;
+    int numFailed = 0;
+
+    for (int i = 0; i < sNumInputs; i++)
+    {
+        inputTotal += sInputs[i].size;
+        if (!CheckInput(&sInputs[i], &compressedTotal))
+            numFailed++;
+    }
+
+    unsigned char **compressed = malloc(sNumInputs * sizeof(*compressed));
+    int *compressedSizes = malloc(sNumInputs * sizeof(*compressedSizes));
+
+    if (compressed == NULL || compressedSizes == NULL)
+        FATAL_ERROR("Failed to allocate memory for the compressed inputs.\n");
+
+    clock_t start = clock();
+
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (int i = 0; i < sNumInputs; i++)
+        {
+            if (pass != 0)
+                free(compressed[i]);
+            compressed[i] = HuffCompress(sInputs[i].data, sInputs[i].size, &compressedSizes[i], sInputs[i].bitDepth);
+        }
+    }
+
+    double compressTime = SecondsSince(start) / passes;
+
+    start = clock();
+
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (int i = 0; i < sNumInputs; i++)
+        {
+            int size;
+
+            free(HuffDecompress(compressed[i], compressedSizes[i], &size));
+        }
+    }
+
+    double decompressTime = SecondsSince(start) / passes;
+
+    for (int i = 0; i < sNumInputs; i++)
+        free(compressed[i]);
+    free(compressed);
+    free(compressedSizes);
+
+    printf("%d inputs, %ld bytes, %ld compressed: %s\n", sNumInputs, inputTotal, compressedTotal,
+           numFailed == 0 ? "all round-trip" : "SOME DON'T ROUND-TRIP");
+    printf("compression:   %.1f ms per pass\n", compressTime * 1000);
+    printf("decompression: %.1f ms per pass\n", decompressTime * 1000);
+
+    return numFailed == 0 ? 0 : 1;
+}
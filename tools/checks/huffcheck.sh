@@ -0,0 +1,20 @@
+#!/bin/sh
+# Checks gbagfx's Huffman compressor on the 4bpp and 8bpp files the ROM build
+# makes: builds them, then has huffcheck compress each one, at 4 or 8 bits a
+# symbol to match, decompress it again, and time both. Run it from the
+# repository root. An extra argument sets how many timed passes huffcheck
+# makes.
+
+set -e
+
+list=$(mktemp)
+trap 'rm -f "$list"' EXIT
+
+# A dry run that remakes everything lists all the build's conversions, even
+# on a built tree. The build runs "$(GFX) FILE.png FILE.4bpp" and the like for
+# each of them.
+make -n -B GFX=gbagfx GFX_MANIFEST=0 | sed -n 's|^gbagfx [^ ]*\.png \([^ ]*\.[48]bpp\)\( .*\)\{0,1\}$|\1|p' | sort -u > "$list"
+
+xargs make -s < "$list"
+make -s -C tools/checks huffcheck
+tools/checks/huffcheck "$list" "$@"
@@ -0,0 +1,83 @@
+#!/usr/bin/env bash
+# Measures the cc1 time that preproc's --incbin-asm saves (INCBIN_ASM=1 in the
+# Makefile). For each C file named on the command line, or else every file in
+# src and gflib that uses INCBIN, it builds the files the INCBINs name and
+# preprocesses the C file as a modern build does. Then it runs preproc on the
+# result with and without --incbin-asm, and times cc1 on both outputs. It
+# prints the CPU time and the size of the asm for each file and in total. Run
+# it from the repository root. Files that fail to compile are listed and left
+# out.
+#
+# CC1 and CFLAGS choose the compiler. By default it's the host gcc's cc1 at
+# -O2, which doesn't need devkitARM. To time the modern build's own, use
+#   CC1="$(arm-none-eabi-gcc --print-prog-name=cc1) -quiet" CFLAGS="-mthumb ..."
+# Each cc1 run is repeated REPEAT times, 3 by default, and the fastest counts.
+
+set -e
+
+CPP=${CPP:-cpp}
+CC1=${CC1:-"$(${CC:-gcc} --print-prog-name=cc1) -quiet"}
+CFLAGS=${CFLAGS:--O2 -w}
+REPEAT=${REPEAT:-3}
+CPPFLAGS="-iquote include -iquote gflib -Wno-trigraphs -DMODERN=1"
+
+if [ $# -eq 0 ]; then
+    set -- $(grep -l 'INCBIN_' src/*.c gflib/*.c)
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+make -s tools
+
+# Prints the fastest user plus system time of REPEAT cc1 runs on $1, which
+# write their asm to $2.
+time_cc1() {
+    local best= t
+    local TIMEFORMAT='%3U %3S'
+
+    for ((run = 0; run < REPEAT; run++)); do
+        t=$( { time $CC1 $CFLAGS -o "$2" "$1" 2>&3; } 3>&2 2>&1 ) || return 1
+        t=$(echo "$t" | awk '{ printf "%.3f", $1 + $2 }')
+        if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+            best=$t
+        fi
+    done
+    echo "$best"
+}
+
+printf '%-40s %10s %10s %12s %12s\n' file expanded incbin-asm "expanded asm" "incbin asm"
+
+total_expanded=0
+total_asm=0
+size_expanded=0
+size_asm=0
+
+for file in "$@"; do
+    deps=$(tools/scaninc/scaninc -I include -I tools/agbcc/include "$file" | grep -v '\.h$' || true)
+    if [ -n "$deps" ]; then
+        make -s $deps
+    fi
+
+    # A file that doesn't get through is reported and left out of the total.
+    if ! $CPP $CPPFLAGS "$file" -o "$tmp/file.i" 2> "$tmp/errors" \
+        || ! tools/preproc/preproc "$tmp/file.i" charmap.txt > "$tmp/expanded.c" 2>> "$tmp/errors" \
+        || ! tools/preproc/preproc "$tmp/file.i" charmap.txt --incbin-asm > "$tmp/incbin.c" 2>> "$tmp/errors" \
+        || ! expanded=$(time_cc1 "$tmp/expanded.c" "$tmp/expanded.s" 2>> "$tmp/errors") \
+        || ! asm=$(time_cc1 "$tmp/incbin.c" "$tmp/incbin.s" 2>> "$tmp/errors"); then
+        printf '%-40s skipped: %s\n' "$file" "$(grep -m 1 'error' "$tmp/errors" || head -n 1 "$tmp/errors")"
+        continue
+    fi
+    expanded_size=$(wc -c < "$tmp/expanded.s")
+    asm_size=$(wc -c < "$tmp/incbin.s")
+
+    printf '%-40s %9.3fs %9.3fs %12d %12d\n' "$file" "$expanded" "$asm" "$expanded_size" "$asm_size"
+
+    total_expanded=$(awk "BEGIN { print $total_expanded + $expanded }")
+    total_asm=$(awk "BEGIN { print $total_asm + $asm }")
+    size_expanded=$((size_expanded + expanded_size))
+    size_asm=$((size_asm + asm_size))
+done
+
+printf '%-40s %9.3fs %9.3fs %12d %12d\n' total "$total_expanded" "$total_asm" "$size_expanded" "$size_asm"
+awk "BEGIN { printf \"cc1 time saved: %.3fs (%.0f%%)\n\", $total_expanded - $total_asm, ($total_expanded > 0 ? 100 * ($total_expanded - $total_asm) / $total_expanded : 0) }"
@@ -0,0 +1,262 @@
+// Checks that gbagfx's LZ compressor still produces the same bytes as the
+// original one, which searched every distance at every position, and times
+// both of them.
+//
+// Usage: lzcheck LIST_FILE [-search N] [-overflow N]
+//
+// LIST_FILE names one uncompressed file per line. Each is compressed the way
+// "gbagfx FILE FILE.lz" with the same options would compress it, once by
+// LZCompress in tools/gbagfx/lz.c and once by the copy of the original
+// compressor below, and the two outputs are compared. Then the files are
+// concatenated and the concatenation is compressed by both, which is where
+// the original's search is slowest. Any difference exits with status 1.
+//
+// lzcheck.sh runs it over the sources of every .lz file the ROM build makes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "global.h"
+#include "lz.h"
+
+#define MAX_LINE_LENGTH 1024
+
+struct Timings
+{
+    double reference;
+    double gbagfx;
+};
+
+// LZCompress from tools/gbagfx/lz.c as it was before it found matches
+// through hash chains. Don't change it: it's what the output has to match.
+static unsigned char *ReferenceLZCompress(unsigned char *src, int srcSize, int *compressedSize, const int minDistance)
+{
+    if (srcSize <= 0)
+        goto fail;
+
+    int worstCaseDestSize = 4 + srcSize + ((srcSize + 7) / 8);
+
+    // Round up to the next multiple of four.
+    worstCaseDestSize = (worstCaseDestSize + 3) & ~3;
+
+    unsigned char *dest = malloc(worstCaseDestSize);
+
+    if (dest == NULL)
+        goto fail;
+
+    // header
+    dest[0] = 0x10; // LZ compression type
+    dest[1] = (unsigned char)srcSize;
+    dest[2] = (unsigned char)(srcSize >> 8);
+    dest[3] = (unsigned char)(srcSize >> 16);
+
+    int srcPos = 0;
+    int destPos = 4;
+
+    for (;;) {
+        unsigned char *flags = &dest[destPos++];
+        *flags = 0;
+
+        for (int i = 0; i < 8; i++) {
+            int bestBlockDistance = 0;
+            int bestBlockSize = 0;
+            int blockDistance = minDistance;
+
+            while (blockDistance <= srcPos && blockDistance <= 0x1000) {
+                int blockStart = srcPos - blockDistance;
+                int blockSize = 0;
+
+                while (blockSize < 18
+                    && srcPos + blockSize < srcSize
+                    && src[blockStart + blockSize] == src[srcPos + blockSize])
+                    blockSize++;
+
+                if (blockSize > bestBlockSize) {
+                    bestBlockDistance = blockDistance;
+                    bestBlockSize = blockSize;
+
+                    if (blockSize == 18)
+                        break;
+                }
+
+                blockDistance++;
+            }
+
+            if (bestBlockSize >= 3) {
+                *flags |= (0x80 >> i);
+                srcPos += bestBlockSize;
+                bestBlockSize -= 3;
+                bestBlockDistance--;
+                dest[destPos++] = (bestBlockSize << 4) | ((unsigned int)bestBlockDistance >> 8);
+                dest[destPos++] = (unsigned char)bestBlockDistance;
+            } else {
+                dest[destPos++] = src[srcPos++];
+            }
+
+            if (srcPos == srcSize) {
+                // Pad to multiple of 4 bytes.
+                int remainder = destPos % 4;
+
+                if (remainder != 0) {
+                    for (int i = 0; i < 4 - remainder; i++)
+                        dest[destPos++] = 0;
+                }
+
+                *compressedSize = destPos;
+                return dest;
+            }
+        }
+    }
+
+fail:
+    FATAL_ERROR("Fatal error while compressing LZ file.\n");
+}
+
+// Reads the file followed by overflowSize zero bytes, as gbagfx does.
+static unsigned char *ReadFile(const char *path, int *size, int overflowSize)
+{
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for reading.\n", path);
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    unsigned char *buffer = calloc(*size + overflowSize, 1);
+
+    if (buffer == NULL)
+        FATAL_ERROR("Failed to allocate memory for \"%s\".\n", path);
+
+    if (fread(buffer, *size, 1, fp) != 1 && *size != 0)
+        FATAL_ERROR("Failed to read \"%s\".\n", path);
+
+    fclose(fp);
+    return buffer;
+}
+
+static double SecondsSince(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+// Compresses size bytes of data with both compressors, and returns whether
+// their outputs match.
+static bool CheckData(unsigned char *data, int size, int minDistance, struct Timings *timings)
+{
+    int referenceSize;
+    int gbagfxSize;
+
+    clock_t start = clock();
+    unsigned char *reference = ReferenceLZCompress(data, size, &referenceSize, minDistance);
+    timings->reference += SecondsSince(start);
+
+    start = clock();
+    unsigned char *gbagfx = LZCompress(data, size, &gbagfxSize, minDistance, false);
+    timings->gbagfx += SecondsSince(start);
+
+    bool match = referenceSize == gbagfxSize && memcmp(reference, gbagfx, referenceSize) == 0;
+
+    free(reference);
+    free(gbagfx);
+    return match;
+}
+
+static int ParseOption(const char *name, const char *value)
+{
+    char *end;
+    long n = strtol(value, &end, 10);
+
+    if (*end != 0 || n < 0 || n > 0x1000)
+        FATAL_ERROR("Bad value \"%s\" for %s.\n", value, name);
+
+    return (int)n;
+}
+
+int main(int argc, char **argv)
+{
+    int minDistance = 2;
+    int overflowSize = 0;
+
+    if (argc < 2)
+        FATAL_ERROR("Usage: lzcheck LIST_FILE [-search N] [-overflow N]\n");
+
+    for (int i = 2; i < argc; i += 2)
+    {
+        if (i + 1 == argc)
+            FATAL_ERROR("No value given for %s.\n", argv[i]);
+        else if (strcmp(argv[i], "-search") == 0)
+            minDistance = ParseOption(argv[i], argv[i + 1]);
+        else if (strcmp(argv[i], "-overflow") == 0)
+            overflowSize = ParseOption(argv[i], argv[i + 1]);
+        else
+            FATAL_ERROR("Unrecognized option \"%s\".\n", argv[i]);
+    }
+
+    if (minDistance < 1)
+        FATAL_ERROR("LZ min search distance must be positive.\n");
+
+    FILE *list = fopen(argv[1], "r");
+
+    if (list == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for reading.\n", argv[1]);
+
+    struct Timings fileTimings = {0};
+    struct Timings concatTimings = {0};
+    unsigned char *concat = NULL;
+    long concatSize = 0;
+    int numFiles = 0;
+    int numDifferent = 0;
+    char line[MAX_LINE_LENGTH];
+
+    while (fgets(line, sizeof(line), list) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0)
+            continue;
+
+        int size;
+        unsigned char *data = ReadFile(line, &size, overflowSize);
+
+        if (!CheckData(data, size + overflowSize, minDistance, &fileTimings))
+        {
+            fprintf(stderr, "%s: output differs from the original compressor's\n", line);
+            numDifferent++;
+        }
+
+        concat = realloc(concat, concatSize + size);
+        if (concat == NULL)
+            FATAL_ERROR("Failed to allocate memory for the concatenated files.\n");
+        memcpy(concat + concatSize, data, size);
+        concatSize += size;
+        numFiles++;
+        free(data);
+    }
+
+    fclose(list);
+
+    if (numFiles == 0)
+        FATAL_ERROR("\"%s\" names no files.\n", argv[1]);
+
+    // The size field in the header only has 24 bits.
+    if (concatSize >= 0x1000000)
+        concatSize = 0xFFFFFF;
+
+    if (!CheckData(concat, concatSize, minDistance, &concatTimings))
+    {
+        fprintf(stderr, "concatenation: output differs from the original compressor's\n");
+        numDifferent++;
+    }
+
+    free(concat);
+
+    printf("%d files, %ld bytes: %s\n", numFiles, concatSize,
+           numDifferent == 0 ? "all identical" : "OUTPUTS DIFFER");
+    printf("each file:     original %.2fs, gbagfx %.2fs\n", fileTimings.reference, fileTimings.gbagfx);
+    printf("concatenation: original %.2fs, gbagfx %.2fs\n", concatTimings.reference, concatTimings.gbagfx);
+
+    return numDifferent == 0 ? 0 : 1;
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Checks every .lz file the ROM build makes: builds the uncompressed files
+# they come from, then has lzcheck compress each one with gbagfx's compressor
+# and with the original one, and compare and time them. Run it from the
+# repository root. Extra arguments, such as "-search 1 -overflow 7", are
+# passed on to lzcheck.
+
+set -e
+
+list=$(mktemp)
+trap 'rm -f "$list"' EXIT
+
+# A dry run that remakes everything lists all the build's conversions, even
+# on a built tree. The build runs "$(GFX) FILE FILE.lz" for each .lz file, so
+# the sources are easy to pick out.
+make -n -B GFX=gbagfx GFX_MANIFEST=0 | sed -n 's|^gbagfx \([^ ]*\) [^ ]*\.lz$|\1|p' | sort -u > "$list"
+
+xargs make -s < "$list"
+make -s -C tools/checks lzcheck
+tools/checks/lzcheck "$list" "$@"
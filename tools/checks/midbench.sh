@@ -0,0 +1,96 @@
+#!/usr/bin/env bash
+# Times mid2agb over every song the ROM build converts, with the options
+# songs.mk gives each one, plus a long song from midgen, where much of the
+# time goes to finding repeated measures in CompressWholeNote. Run it from the
+# repository root.
+#
+# Usage: midbench.sh [REFERENCE [CURRENT]]
+#
+# Each song runs through a mid2agb built from the git revision REFERENCE and
+# through one built from CURRENT, or the one in the tree if CURRENT isn't
+# given. The two must write the same files. REFERENCE defaults to c0373d2~,
+# from before CompressWholeNote found matching measures through a hash index,
+# and "midbench.sh c0373d2~ c0373d2" times that change alone.
+#
+# Each set of conversions is repeated REPEAT times, 3 by default, and the
+# fastest user plus system time counts. MEASURES sets the long song's length
+# (see midgen.c).
+
+set -e
+
+REFERENCE=${1:-c0373d2~}
+CURRENT=$2
+REPEAT=${REPEAT:-3}
+MEASURES=${MEASURES:-20000}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Builds mid2agb from the git revision $1 under $2.
+build_revision() {
+    mkdir "$2"
+    git archive "$1" tools/mid2agb | tar -x -C "$2"
+    make -s -C "$2/tools/mid2agb"
+}
+
+make -s -C tools/checks midgen
+build_revision "$REFERENCE" "$tmp/reference"
+if [ -n "$CURRENT" ]; then
+    build_revision "$CURRENT" "$tmp/current"
+    current_mid2agb=$tmp/current/tools/mid2agb/mid2agb
+else
+    make -s -C tools/mid2agb
+    current_mid2agb=tools/mid2agb/mid2agb
+fi
+
+# A dry run that remakes everything lists all the build's conversions. Each
+# line is "mid2agb FILE.mid FILE.s OPTIONS".
+make -n -B MID=mid2agb MID_MANIFEST=0 | sed -n 's|^mid2agb \([^ ]*\) [^ ]*\.s\(.*\)$|\1\2|p' | sort -u > "$tmp/corpus"
+tools/checks/midgen "$tmp/long.mid" "$MEASURES"
+echo "$tmp/long.mid -E" > "$tmp/long"
+
+# Converts the songs listed in $2 with the mid2agb at $1, writing them to $3,
+# and prints the user plus system time it took.
+convert() {
+    local TIMEFORMAT='%3U %3S'
+    local t
+
+    rm -rf "$3"
+    mkdir "$3"
+    t=$( { time while read -r input options; do
+        name=${input##*/}
+        "$1" "$input" "$3/${name%.mid}.s" $options
+    done < "$2"; } 2>&1 )
+    echo "$t" | awk '{ printf "%.3f", $1 + $2 }'
+}
+
+# Prints the fastest of REPEAT conversions, as convert does.
+fastest() {
+    local best= t
+
+    for ((run = 0; run < REPEAT; run++)); do
+        t=$(convert "$@")
+        if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+            best=$t
+        fi
+    done
+    echo "$best"
+}
+
+status=0
+
+for set in corpus long; do
+    reference=$(fastest "$tmp/reference/tools/mid2agb/mid2agb" "$tmp/$set" "$tmp/$set-reference")
+    current=$(fastest "$current_mid2agb" "$tmp/$set" "$tmp/$set-current")
+
+    if diff -r "$tmp/$set-reference" "$tmp/$set-current" > /dev/null; then
+        result="identical"
+    else
+        result="OUTPUTS DIFFER"
+        status=1
+    fi
+
+    printf '%-7s %4d songs: reference %.3fs, current %.3fs, %s\n' "$set" "$(wc -l < "$tmp/$set")" "$reference" "$current" "$result"
+done
+
+exit $status
@@ -0,0 +1,144 @@
+// Writes a long MIDI file for midbench: one track of MEASURES measures of
+// four quarter notes. Each measure is one of VARIANTS patterns, picked from a
+// fixed seed, so later measures repeat earlier ones the way a song's do, but
+// there are many more measures than any song in the game has.
+//
+// Usage: midgen OUTPUT_FILE [MEASURES [VARIANTS]]
+//
+// MEASURES is 20000 and VARIANTS 5000 by default, so each pattern comes up
+// about four times, and each measure matches few of the others.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define FATAL_ERROR(format, ...)            \
+do {                                        \
+    fprintf(stderr, format, ##__VA_ARGS__); \
+    exit(1);                                \
+} while (0)
+
+#define TICKS_PER_BEAT 96
+
+static unsigned char *sTrack;
+static long sTrackSize;
+static long sTrackCapacity;
+static uint32_t sRandom = 7;
+
+static uint32_t Random(uint32_t n)
+{
+    sRandom = sRandom * 1103515245 + 12345;
+    return (sRandom >> 8) % n;
+}
+
+static void WriteByte(int value)
+{
+    if (sTrackSize == sTrackCapacity)
+    {
+        sTrackCapacity = sTrackCapacity ? sTrackCapacity * 2 : 0x10000;
+        sTrack = realloc(sTrack, sTrackCapacity);
+        if (sTrack == NULL)
+            FATAL_ERROR("Failed to allocate memory for the track.\n");
+    }
+
+    sTrack[sTrackSize++] = value;
+}
+
+static void WriteDelta(uint32_t delta)
+{
+    int shift = 21;
+
+    while (shift > 0 && (delta >> shift) == 0)
+        shift -= 7;
+
+    for (; shift > 0; shift -= 7)
+        WriteByte(0x80 | ((delta >> shift) & 0x7F));
+
+    WriteByte(delta & 0x7F);
+}
+
+static void WriteEvent(uint32_t delta, int status, int data1, int data2)
+{
+    WriteDelta(delta);
+    WriteByte(status);
+    WriteByte(data1);
+    WriteByte(data2);
+}
+
+static void WriteBigEndian(FILE *fp, uint32_t value, int size)
+{
+    for (int i = size - 1; i >= 0; i--)
+        fputc((value >> (i * 8)) & 0xFF, fp);
+}
+
+static long ParseCount(const char *name, const char *value)
+{
+    char *end;
+    long n = strtol(value, &end, 10);
+
+    if (*end != 0 || n <= 0)
+        FATAL_ERROR("%s must be a positive number, not \"%s\".\n", name, value);
+
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    long numMeasures = 20000;
+    long numVariants = 5000;
+
+    if (argc < 2 || argc > 4)
+        FATAL_ERROR("Usage: midgen OUTPUT_FILE [MEASURES [VARIANTS]]\n");
+    if (argc >= 3)
+        numMeasures = ParseCount("MEASURES", argv[2]);
+    if (argc == 4)
+        numVariants = ParseCount("VARIANTS", argv[3]);
+
+    // 120 beats per minute.
+    WriteDelta(0);
+    WriteByte(0xFF);
+    WriteByte(0x51);
+    WriteByte(3);
+    WriteByte(0x07);
+    WriteByte(0xA1);
+    WriteByte(0x20);
+
+    for (long measure = 0; measure < numMeasures; measure++)
+    {
+        uint32_t variant = Random(numVariants);
+
+        for (int beat = 0; beat < 4; beat++)
+        {
+            int key = 36 + (variant * 7 + beat * (variant % 5 + 1)) % 48;
+            int velocity = 64 + (variant >> 2) % 64;
+
+            WriteEvent(0, 0x90, key, velocity);
+            WriteEvent(TICKS_PER_BEAT, 0x80, key, 0);
+        }
+    }
+
+    WriteDelta(0);
+    WriteByte(0xFF);
+    WriteByte(0x2F);
+    WriteByte(0);
+
+    FILE *fp = fopen(argv[1], "wb");
+
+    if (fp == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for writing.\n", argv[1]);
+
+    fputs("MThd", fp);
+    WriteBigEndian(fp, 6, 4);
+    WriteBigEndian(fp, 0, 2); // format
+    WriteBigEndian(fp, 1, 2); // tracks
+    WriteBigEndian(fp, TICKS_PER_BEAT, 2);
+    fputs("MTrk", fp);
+    WriteBigEndian(fp, sTrackSize, 4);
+
+    if (fwrite(sTrack, sTrackSize, 1, fp) != 1)
+        FATAL_ERROR("Failed to write \"%s\".\n", argv[1]);
+
+    fclose(fp);
+    free(sTrack);
+    return 0;
+}
@@ -33,6 +33,7 @@
 
     History
     -------
+    v1.08 - patch header in place, optional SHA-1/CRC-32 of the result
     v1.07 - added support for ELF input, (PikalaxALT)
     v1.06 - added output silencing, (Sierraffinity)
     v1.05 - added debug offset argument, (Sierraffinity)
@@ -49,9 +50,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 #include "elf.h"
+#include "sha1.h"
 
-#define VER        "1.07"
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define VER        "1.08"
 #define ARGV    argv[arg]
 #define VALUE    (ARGV+2)
 #define NUMBER    strtoul(VALUE, NULL, 0)
@@ -131,17 +144,94 @@ char HeaderComplement()
 }
 
 
+//---------------------------------------------------------------------------------
+int ReadAt(int fd, void *buffer, size_t size, long offset)
+/*---------------------------------------------------------------------------------
+    Read size bytes at offset; returns 0 on a short read
+---------------------------------------------------------------------------------*/
+{
+    char *p = buffer;
+    while (size)
+    {
+#ifdef _WIN32
+        long n = lseek(fd, offset, SEEK_SET) == offset ? read(fd, p, size) : -1;
+#else
+        long n = pread(fd, p, size, offset);
+#endif
+        if (n <= 0) return 0;
+        p += n; size -= n; offset += n;
+    }
+    return 1;
+}
+
+//---------------------------------------------------------------------------------
+int WriteAt(int fd, const void *buffer, size_t size, long offset)
+/*---------------------------------------------------------------------------------
+    Write size bytes at offset; returns 0 on failure
+---------------------------------------------------------------------------------*/
+{
+    const char *p = buffer;
+    while (size)
+    {
+#ifdef _WIN32
+        long n = lseek(fd, offset, SEEK_SET) == offset ? write(fd, p, size) : -1;
+#else
+        long n = pwrite(fd, p, size, offset);
+#endif
+        if (n <= 0) return 0;
+        p += n; size -= n; offset += n;
+    }
+    return 1;
+}
+
+//---------------------------------------------------------------------------------
+uint32_t Crc32(uint32_t crc, const uint8_t *p, size_t size)
+/*---------------------------------------------------------------------------------
+    CRC-32 (the zlib/PNG polynomial), continuing from crc
+---------------------------------------------------------------------------------*/
+{
+    static uint32_t table[256];
+    if (!table[1])
+    {
+        uint32_t n, c; int k;
+        for (n=0; n<256; n++)
+        {
+            for (c=n, k=0; k<8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+    }
+    crc = ~crc;
+    while (size--) crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+//---------------------------------------------------------------------------------
+int WriteSum(const char *path, const char *sum, const char *romfile)
+/*---------------------------------------------------------------------------------
+    Write a sum in sha1sum's format, to stdout if path is empty
+---------------------------------------------------------------------------------*/
+{
+    FILE *f = *path ? fopen(path, "w") : stdout;
+    if (!f) { fprintf(stderr, "Error opening %s!\n", path); return 0; }
+    fprintf(f, "%s  %s\n", sum, romfile);
+    if (f != stdout && fclose(f) != 0) { fprintf(stderr, "Error writing %s!\n", path); return 0; }
+    return 1;
+}
+
 //---------------------------------------------------------------------------------
 int main(int argc, char *argv[])
 //---------------------------------------------------------------------------------
 {
     int arg;
     char *argfile = 0;
-    FILE *infile;
+    int infile;
     int silent = 0;
     int schedule_pad = 0;
+    const char *sha1file = 0;
+    const char *crcfile = 0;
 
-    int size,bit;
+    long size;
+    int bit;
 
     // show syntax
     if (argc <= 1)
@@ -157,6 +247,8 @@ int main(int argc, char *argv[])
         printf("    -r<version>     Patch game version (number)\n");
         printf("    -d<debug>       Enable debugging handler and set debug entry point (0 or 1)\n");
         printf("    --silent           Silence non-error output\n");
+        printf("    --sha1[=<file>]    Write the fixed ROM's SHA-1 in sha1sum's format\n");
+        printf("    --crc32[=<file>]   Write the fixed ROM's CRC-32 the same way\n");
         return -1;
     }
 
@@ -176,26 +268,23 @@ int main(int argc, char *argv[])
 
     uint32_t sh_offset = 0;
 
-    // read file
-    infile = fopen(argfile, "r+b");
-    if (!infile) { fprintf(stderr, "Error opening input file!\n"); return -1; }
-    fseek(infile, sh_offset, SEEK_SET);
-    fread(&header, sizeof(header), 1, infile);
+    // read header only; the rest of the file is left alone
+    infile = open(argfile, O_RDWR | O_BINARY);
+    if (infile < 0) { fprintf(stderr, "Error opening input file!\n"); return -1; }
+    if (!ReadAt(infile, &header, sizeof(header), sh_offset)) { fprintf(stderr, "Error reading header!\n"); return 1; }
 
     // elf check
     Elf32_Shdr secHeader;
     if (memcmp(&header, ELFMAG, 4) == 0) {
         Elf32_Ehdr *elfHeader = (Elf32_Ehdr *)&header;
-        fseek(infile, elfHeader->e_shoff, SEEK_SET);
         int i;
         for (i = 0; i < elfHeader->e_shnum; i++) {
-            fread(&secHeader, sizeof(Elf32_Shdr), 1, infile);
-            if (secHeader.sh_type == SHT_PROGBITS && secHeader.sh_addr == elfHeader->e_entry) break;
+            if (!ReadAt(infile, &secHeader, sizeof(Elf32_Shdr), elfHeader->e_shoff + i * sizeof(Elf32_Shdr))) i = elfHeader->e_shnum;
+            else if (secHeader.sh_type == SHT_PROGBITS && secHeader.sh_addr == elfHeader->e_entry) break;
         }
-        if (i == elfHeader->e_shnum) { fprintf(stderr, "Error finding entry point!\n"); return 1; }
-        fseek(infile, secHeader.sh_offset, SEEK_SET);
+        if (i >= elfHeader->e_shnum) { fprintf(stderr, "Error finding entry point!\n"); return 1; }
         sh_offset = secHeader.sh_offset;
-        fread(&header, sizeof(header), 1, infile);
+        if (!ReadAt(infile, &header, sizeof(header), sh_offset)) { fprintf(stderr, "Error reading header!\n"); return 1; }
     }
 
     // fix some data
@@ -276,6 +365,8 @@ int main(int argc, char *argv[])
                 case '-':    // long arguments
                 {
                     if (strncmp("silent", &ARGV[2], 6) == 0) { continue; }
+                    if (strncmp("sha1", &ARGV[2], 4) == 0 && (ARGV[6] == 0 || ARGV[6] == '=')) { sha1file = ARGV[6] ? &ARGV[7] : ""; continue; }
+                    if (strncmp("crc32", &ARGV[2], 5) == 0 && (ARGV[7] == 0 || ARGV[7] == '=')) { crcfile = ARGV[7] ? &ARGV[8] : ""; continue; }
                     break;
                 }
             default:
@@ -292,24 +383,66 @@ int main(int argc, char *argv[])
     header.complement = HeaderComplement();
     //header.checksum = checksum_without_header + HeaderChecksum();
 
+    struct stat st;
+    if (fstat(infile, &st) != 0) { fprintf(stderr, "Error reading input file!\n"); return 1; }
+    size = st.st_size;
+
     if (schedule_pad) {
         if (sh_offset != 0) {
             fprintf(stderr, "Warning: Cannot safely pad an ELF\n");
         } else {
-            fseek(infile, 0, SEEK_END);
-            size = ftell(infile);
-            for (bit=31; bit>=0; bit--) if (size & (1<<bit)) break;
-            if (size != (1<<bit))
+            for (bit=31; bit>=0; bit--) if (size & (1L<<bit)) break;
+            if (size != (1L<<bit))
             {
-                int todo = (1<<(bit+1)) - size;
-                while (todo--) fputc(0xFF, infile);
+                static uint8_t fill[0x10000];
+                long end = 1L<<(bit+1), n;
+                memset(fill, 0xFF, sizeof(fill));
+                for (; size < end; size += n)
+                {
+                    n = end - size < (long)sizeof(fill) ? end - size : (long)sizeof(fill);
+                    if (!WriteAt(infile, fill, n, size)) { fprintf(stderr, "Error padding ROM!\n"); return 1; }
+                }
             }
         }
     }
 
-    fseek(infile, sh_offset, SEEK_SET);
-    fwrite(&header, sizeof(header), 1, infile);
-    fclose(infile);
+    if (!WriteAt(infile, &header, sizeof(header), sh_offset)) { fprintf(stderr, "Error writing header!\n"); return 1; }
+
+    // hash the fixed file in one pass; the sums go in their own files so
+    // "make compare" can check them without another read through the ROM
+    if (sha1file || crcfile)
+    {
+        static uint8_t block[0x100000];
+        Sha1Context sha1;
+        uint32_t crc = 0;
+        uint8_t digest[20];
+        char sum[41];
+        long offset;
+        int i;
+
+        Sha1Init(&sha1);
+        for (offset = 0; offset < size; offset += sizeof(block))
+        {
+            long n = size - offset < (long)sizeof(block) ? size - offset : (long)sizeof(block);
+            if (!ReadAt(infile, block, n, offset)) { fprintf(stderr, "Error reading ROM!\n"); return 1; }
+            if (sha1file) Sha1Update(&sha1, block, n);
+            if (crcfile) crc = Crc32(crc, block, n);
+        }
+
+        if (sha1file)
+        {
+            Sha1Final(&sha1, digest);
+            for (i=0; i<20; i++) sprintf(&sum[i*2], "%02x", digest[i]);
+            if (!WriteSum(sha1file, sum, argfile)) return 1;
+        }
+        if (crcfile)
+        {
+            sprintf(sum, "%08x", (unsigned)crc);
+            if (!WriteSum(crcfile, sum, argfile)) return 1;
+        }
+    }
+
+    close(infile);
 
     if (!silent) printf("ROM fixed!\n");
 
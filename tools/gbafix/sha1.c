@@ -0,0 +1,97 @@
+//---------------------------------------------------------------------------------
+// sha1.c
+//---------------------------------------------------------------------------------
+/*
+    SHA-1 (FIPS 180-4), for checking a ROM against rom.sha1 without running
+    sha1sum over it again.
+*/
+
+#include <string.h>
+#include "sha1.h"
+
+#define ROL(x, n)    (((x) << (n)) | ((x) >> (32 - (n))))
+
+//---------------------------------------------------------------------------------
+static void Sha1Block(uint32_t state[5], const uint8_t *p)
+//---------------------------------------------------------------------------------
+{
+    uint32_t w[16];
+    uint32_t a, b, c, d, e, t;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[i*4] << 24 | (uint32_t)p[i*4+1] << 16 | (uint32_t)p[i*4+2] << 8 | p[i*4+3];
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3]; e = state[4];
+
+    // the message schedule only ever needs the last 16 words
+#define W(i)    (i < 16 ? w[i] : (w[i&15] = ROL(w[(i-3)&15] ^ w[(i-8)&15] ^ w[(i-14)&15] ^ w[i&15], 1)))
+#define ROUND(f, k)                                 \
+    t = ROL(a, 5) + (f) + e + (k) + W(i);           \
+    e = d; d = c; c = ROL(b, 30); b = a; a = t;
+
+    // one loop per round function keeps the branches out of the rounds
+    for (i = 0; i < 20; i++) { ROUND(d ^ (b & (c ^ d)), 0x5A827999) }
+    for (; i < 40; i++)      { ROUND(b ^ c ^ d, 0x6ED9EBA1) }
+    for (; i < 60; i++)      { ROUND((b & c) | (d & (b | c)), 0x8F1BBCDC) }
+    for (; i < 80; i++)      { ROUND(b ^ c ^ d, 0xCA62C1D6) }
+
+#undef W
+#undef ROUND
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+//---------------------------------------------------------------------------------
+void Sha1Init(Sha1Context *ctx)
+//---------------------------------------------------------------------------------
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xEFCDAB89;
+    ctx->state[2] = 0x98BADCFE;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xC3D2E1F0;
+    ctx->length = 0;
+}
+
+//---------------------------------------------------------------------------------
+void Sha1Update(Sha1Context *ctx, const void *data, size_t size)
+//---------------------------------------------------------------------------------
+{
+    const uint8_t *p = data;
+    size_t used = ctx->length & 63;
+
+    ctx->length += size;
+
+    if (used)
+    {
+        size_t n = 64 - used < size ? 64 - used : size;
+        memcpy(ctx->block + used, p, n);
+        p += n; size -= n; used += n;
+        if (used < 64) return;
+        Sha1Block(ctx->state, ctx->block);
+    }
+
+    for (; size >= 64; p += 64, size -= 64)
+        Sha1Block(ctx->state, p);
+
+    memcpy(ctx->block, p, size);
+}
+
+//---------------------------------------------------------------------------------
+void Sha1Final(Sha1Context *ctx, uint8_t digest[20])
+//---------------------------------------------------------------------------------
+{
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t used = ctx->length & 63;
+    size_t padSize = (used < 56 ? 56 : 120) - used;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        pad[padSize + i] = (uint8_t)(bits >> (56 - i*8));
+    Sha1Update(ctx, pad, padSize + 8);
+
+    for (i = 0; i < 20; i++)
+        digest[i] = (uint8_t)(ctx->state[i/4] >> (24 - (i%4)*8));
+}
@@ -0,0 +1,18 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct
+{
+    uint32_t    state[5];
+    uint64_t    length;            // bytes hashed so far
+    uint8_t     block[64];         // partial block
+} Sha1Context;
+
+void Sha1Init(Sha1Context *ctx);
+void Sha1Update(Sha1Context *ctx, const void *data, size_t size);
+void Sha1Final(Sha1Context *ctx, uint8_t digest[20]);
+
+#endif // SHA1_H
@@ -1,215 +1,331 @@
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
-#include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
 #include "global.h"
 #include "huff.h"
 
-static int cmp_tree(const void * a0, const void * b0) {
-    return ((struct HuffData *)a0)->value - ((struct HuffData *)b0)->value;
-}
+/*
+ * The GBA BIOS reads the tree as an array of one-byte nodes, starting with
+ * the root. The two children of an internal node are stored next to each
+ * other, at most 63 pairs past the node, and the node says which of them are
+ * leaves. The codes are read from the most significant bit of each 32-bit
+ * word down, with a 0 bit going to the left child.
+ */
 
-typedef int (*cmpfun)(const void *, const void *);
+#define MAX_SYMBOLS 256
+#define MAX_CODE_LENGTH 32
+#define MAX_CHILD_OFFSET 63
+
+// The number of bits the decoder looks up at once.
+#define DECODE_TABLE_BITS 8
+
+struct HuffSymbol {
+    int count;
+    int symbol;
+};
+
+struct HuffCode {
+    uint32_t bits;
+    int length;
+};
+
+struct TreeNode {
+    int children[2]; // Both -1 for a leaf
+    int symbol;
+    int leafCount;
+};
+
+// A node written to the tree whose children haven't been.
+struct PendingNode {
+    int node;
+    int pos;
+};
+
+struct DecodeEntry {
+    uint16_t value; // The symbol for a leaf, or else the position of the node reached
+    uint8_t length; // The number of bits used
+    bool isLeaf;
+};
+
+static int cmp_symbols(const void * a0, const void * b0) {
+    const struct HuffSymbol * a = a0;
+    const struct HuffSymbol * b = b0;
+
+    if (a->count != b->count)
+        return a->count < b->count ? -1 : 1;
+    return a->symbol - b->symbol;
+}
 
-int msort_r(void * data, size_t count, size_t size, cmpfun cmp, void * buffer) {
+static int get_code_lengths(const int * counts, int nitems, int * lengths) {
     /*
-     * Out-of-place mergesort (stable sort)
-     * Returns 1 on success, 0 on failure
+     * Two-queue Huffman construction: the leaves are sorted by count once, and
+     * merged nodes are made in order of increasing count, so the two smallest
+     * nodes are always at the front of one queue or the other.
+     * Returns the number of symbols that have a code.
      */
-    void * leftPtr;
-    void * rightPtr;
-    void * leftEnd;
-    void * rightEnd;
-    int i;
-
-    switch (count) {
-    case 0:
-        // Should never be here
+    struct HuffSymbol leaves[MAX_SYMBOLS];
+    int nodeCounts[2 * MAX_SYMBOLS];
+    int parents[2 * MAX_SYMBOLS];
+    int depths[2 * MAX_SYMBOLS];
+    int nleaves = 0;
+
+    for (int i = 0; i < nitems; i++) {
+        lengths[i] = 0;
+        if (counts[i] != 0) {
+            leaves[nleaves].count = counts[i];
+            leaves[nleaves].symbol = i;
+            nleaves++;
+        }
+    }
+
+    if (nleaves == 0)
         return 0;
 
-    case 1:
-        // Nothing to do here
-        break;
+    // The tree needs at least one branch, so a lone symbol gets an unused
+    // sibling.
+    if (nleaves == 1) {
+        lengths[leaves[0].symbol] = 1;
+        lengths[leaves[0].symbol ^ 1] = 1;
+        return 2;
+    }
 
-    case 2:
-        // Swap the two entries if the right one compares higher.
-        if (cmp(data, data + size) > 0) {
-            memcpy(buffer, data, size);
-            memcpy(data, data + size, size);
-            memcpy(data + size, buffer, size);
-        }
-        break;
-    default:
-        // Merge sort out-of-place.
-        leftPtr = data;
-        leftEnd = rightPtr = data + count / 2 * size;
-        rightEnd = data + count * size;
-
-        // Sort the left half
-        if (!msort_r(leftPtr, count / 2, size, cmp, buffer))
-            return 0;
-
-        // Sort the right half
-        if (!msort_r(rightPtr, count / 2 + (count & 1), size, cmp, buffer))
-            return 0;
-
-        // Merge the sorted halves out of place
-        i = 0;
-        do {
-            if (cmp(leftPtr, rightPtr) <= 0) {
-                memcpy(buffer + i * size, leftPtr, size);
-                leftPtr += size;
-            } else {
-                memcpy(buffer + i * size, rightPtr, size);
-                rightPtr += size;
-            }
+    qsort(leaves, nleaves, sizeof(struct HuffSymbol), cmp_symbols);
 
-        } while (++i < count && leftPtr < leftEnd && rightPtr < rightEnd);
+    // Nodes [0, nleaves) are the leaves, and the rest are the merged nodes in
+    // the order they were made.
+    for (int i = 0; i < nleaves; i++)
+        nodeCounts[i] = leaves[i].count;
 
-        // Copy the remainder
-        if (i < count) {
-            if (leftPtr < leftEnd) {
-                memcpy(buffer + i * size, leftPtr, leftEnd - leftPtr);
-            }
-            else {
-                memcpy(buffer + i * size, rightPtr, rightEnd - rightPtr);
-            }
+    int nextLeaf = 0;
+    int nextMerged = nleaves;
+    int nodeCount = nleaves;
+
+    while (nodeCount < 2 * nleaves - 1) {
+        int children[2];
+
+        for (int k = 0; k < 2; k++) {
+            // Ties go to the leaf, which keeps the longest code short.
+            if (nextLeaf < nleaves && (nextMerged == nodeCount || nodeCounts[nextLeaf] <= nodeCounts[nextMerged]))
+                children[k] = nextLeaf++;
+            else
+                children[k] = nextMerged++;
         }
 
-        // Copy the merged data back
-        memcpy(data, buffer, count * size);
-        break;
+        nodeCounts[nodeCount] = nodeCounts[children[0]] + nodeCounts[children[1]];
+        parents[children[0]] = nodeCount;
+        parents[children[1]] = nodeCount;
+        nodeCount++;
     }
 
-    return 1;
+    // The root is made last, and every node's parent is made after it.
+    depths[nodeCount - 1] = 0;
+    for (int i = nodeCount - 2; i >= 0; i--)
+        depths[i] = depths[parents[i]] + 1;
+
+    for (int i = 0; i < nleaves; i++)
+        lengths[leaves[i].symbol] = depths[i];
+
+    return nleaves;
 }
 
-int msort(void * data, size_t count, size_t size, cmpfun cmp) {
-    void * buffer = malloc(count * size);
-    if (buffer == NULL) return 0;
-    int result = msort_r(data, count, size, cmp, buffer);
-    free(buffer);
-    return result;
+static int child_offset(int pos, int slot) {
+    // The offset, in pairs, from the node at tree position pos to the pair of
+    // children in the given slot. Slot k holds tree positions 2k-1 and 2k.
+    return slot + 1 - ((5 + pos) & ~1) / 2;
 }
 
-static void write_tree(unsigned char * dest, HuffNode_t * tree, int nitems, struct BitEncoding * encoding) {
+static bool can_wait(const struct PendingNode * pending, int npending, int slot) {
+    // Whether every pending node still gets its children in time if they're
+    // placed in order from the next slot on.
+    for (int i = 0; i < npending; i++) {
+        if (child_offset(pending[i].pos, slot + i) > MAX_CHILD_OFFSET)
+            return false;
+    }
+    return true;
+}
+
+static int write_tree(unsigned char * dest, const int * lengths, int nitems, struct HuffCode * codes) {
     /*
-     * The example used to guide this function encodes the tree in a
-     * breadth-first manner.  We attempt to emulate that here.
+     * Gives each symbol the canonical code for its length, and writes the
+     * tree of those codes.
+     *
+     * The pairs of children are written one at a time, each for a node
+     * already written. A level-by-level order can't keep every node within
+     * MAX_CHILD_OFFSET pairs of its children once a level gets wide: eight
+     * bits of evenly spread data make a level of 128 internal nodes, which
+     * fill 64 pairs. So the next pair goes to the waiting node with the fewest
+     * leaves below it, whose children add the fewest nodes to the wait, unless
+     * that would leave a waiting node too far from its children. Then it goes
+     * to the node that has waited longest.
+     * Returns the number of nodes.
      */
+    struct TreeNode nodes[2 * MAX_SYMBOLS];
+    struct PendingNode pending[MAX_SYMBOLS];
+    int lengthCounts[MAX_CODE_LENGTH + 1] = {0};
+    uint32_t nextCode[MAX_CODE_LENGTH + 1];
+    uint32_t code = 0;
 
-    int i, j, k;
-
-    // There are (2 * nitems - 1) nodes in the binary tree.  Allocate that.
-    HuffNode_t * traversal = calloc(2 * nitems - 1, sizeof(HuffNode_t));
-    if (traversal == NULL)
-        FATAL_ERROR("Fatal error while compressing Huff file.\n");
-
-    // The first node is the root of the tree.
-    traversal[0] = *tree;
-    i = 1;
-
-    // Copy the tree into a breadth-first ordering using brute force.
-    for (int depth = 1; i < 2 * nitems - 1; depth++) {
-        // Consider every possible path up to the current depth.
-        for (j = 0; i < 2 * nitems - 1 && j < 1 << depth; j++) {
-            // The index of the path is used to encode the path itself.
-            // Start from the most significant relevant bit and work our way down.
-            // Keep track of the current and previous nodes.
-            HuffNode_t * currNode = traversal;
-            HuffNode_t * parent = NULL;
-            for (k = 0; k < depth; k++) {
-                if (currNode->header.isLeaf)
-                    break;
-                parent = currNode;
-                if ((j >> (depth - k - 1)) & 1)
-                    currNode = currNode->branch.right;
-                else
-                    currNode = currNode->branch.left;
-            }
-            // Check that the length of the current path equals the current depth.
-            if (k == depth) {
-                // Make sure we can encode the current branch.
-                // Bail here if we cannot.
-                // This is only applicable for 8-bit encodings.
-                if (traversal + i - parent > 128)
-                    FATAL_ERROR("Fatal error while compressing Huff file: unable to encode binary tree.\n");
-                // Copy the current node, and update its parent.
-                traversal[i] = *currNode;
-                if (parent != NULL) {
-                    if ((j & 1) == 1)
-                        parent->branch.right = traversal + i;
-                    else
-                        parent->branch.left = traversal + i;
-                }
-                // Encode the path through the tree in the lookup table
-                if (traversal[i].header.isLeaf) {
-                    encoding[traversal[i].leaf.key].nbits = depth;
-                    encoding[traversal[i].leaf.key].bitstring = j;
-                }
-                i++;
+    for (int i = 0; i < nitems; i++) {
+        if (lengths[i] > MAX_CODE_LENGTH)
+            FATAL_ERROR("Fatal error while compressing Huff file: code is too long.\n");
+        lengthCounts[lengths[i]]++;
+    }
+
+    lengthCounts[0] = 0;
+    for (int length = 1; length <= MAX_CODE_LENGTH; length++) {
+        code = (code + lengthCounts[length - 1]) << 1;
+        nextCode[length] = code;
+    }
+
+    // Build the tree from the codes. Parents are made before their children.
+    int nnodes = 1;
+
+    nodes[0].children[0] = nodes[0].children[1] = -1;
+    for (int i = 0; i < nitems; i++) {
+        if (lengths[i] == 0)
+            continue;
+
+        codes[i].bits = nextCode[lengths[i]]++;
+        codes[i].length = lengths[i];
+
+        int node = 0;
+
+        for (int bit = lengths[i] - 1; bit >= 0; bit--) {
+            int side = (codes[i].bits >> bit) & 1;
+
+            if (nodes[node].children[side] < 0) {
+                nodes[nnodes].children[0] = nodes[nnodes].children[1] = -1;
+                nodes[node].children[side] = nnodes++;
             }
+            node = nodes[node].children[side];
         }
+        nodes[node].symbol = i;
     }
 
-    // Encode the size of the tree.
-    // This is used by the decompressor to skip the tree.
-    dest[4] = nitems - 1;
+    for (int i = nnodes - 1; i >= 0; i--) {
+        bool isLeaf = nodes[i].children[0] < 0 && nodes[i].children[1] < 0;
 
-    // Encode each node in the tree.
-    for (i = 0; i < 2 * nitems - 1; i++) {
-        HuffNode_t * currNode = traversal + i;
-        if (currNode->header.isLeaf) {
-            dest[5 + i] = traversal[i].leaf.key;
-        } else {
-            dest[5 + i] = (((currNode->branch.right - traversal - i) / 2) - 1);
-            if (currNode->branch.left->header.isLeaf)
-                dest[5 + i] |= 0x80;
-            if (currNode->branch.right->header.isLeaf)
-                dest[5 + i] |= 0x40;
+        if (!isLeaf && (nodes[i].children[0] < 0 || nodes[i].children[1] < 0))
+            FATAL_ERROR("Fatal error while compressing Huff file: incomplete code.\n");
+        nodes[i].leafCount = isLeaf ? 1 : nodes[nodes[i].children[0]].leafCount + nodes[nodes[i].children[1]].leafCount;
+    }
+
+    // The pending nodes are kept in the order they were written, which is
+    // also the order of how soon their children have to be.
+    unsigned char * tree = dest + 5;
+    int npending = 1;
+    int slot;
+
+    pending[0].node = 0;
+    pending[0].pos = 0;
+
+    for (slot = 1; npending > 0; slot++) {
+        int chosen = 0;
+
+        for (int i = 1; i < npending; i++) {
+            if (nodes[pending[i].node].leafCount < nodes[pending[chosen].node].leafCount)
+                chosen = i;
+        }
+
+        if (chosen != 0) {
+            struct PendingNode rest[MAX_SYMBOLS];
+            int nrest = 0;
+
+            for (int i = 0; i < npending; i++) {
+                if (i != chosen)
+                    rest[nrest++] = pending[i];
+            }
+            for (int side = 0; side < 2; side++) {
+                if (nodes[nodes[pending[chosen].node].children[side]].leafCount > 1)
+                    rest[nrest++].pos = 2 * slot - 1 + side;
+            }
+            if (!can_wait(rest, nrest, slot + 1))
+                chosen = 0;
+        }
+
+        struct PendingNode parent = pending[chosen];
+        int offset = child_offset(parent.pos, slot);
+
+        if (offset > MAX_CHILD_OFFSET)
+            FATAL_ERROR("Fatal error while compressing Huff file: unable to encode binary tree.\n");
+
+        memmove(&pending[chosen], &pending[chosen + 1], (npending - chosen - 1) * sizeof(*pending));
+        npending--;
+        tree[parent.pos] = offset;
+
+        for (int side = 0; side < 2; side++) {
+            int child = nodes[parent.node].children[side];
+            int pos = 2 * slot - 1 + side;
+
+            if (nodes[child].leafCount == 1) {
+                tree[pos] = nodes[child].symbol;
+                tree[parent.pos] |= 0x80 >> side;
+            } else {
+                pending[npending].node = child;
+                pending[npending].pos = pos;
+                npending++;
+            }
         }
     }
 
-    free(traversal);
+    return 2 * slot - 1;
 }
 
-static inline void write_32_le(unsigned char * dest, int * destPos, uint32_t * buff, int * buffPos) {
-    dest[*destPos] = *buff;
-    dest[*destPos + 1] = *buff >> 8;
-    dest[*destPos + 2] = *buff >> 16;
-    dest[*destPos + 3] = *buff >> 24;
+static inline void write_32_le(unsigned char * dest, int * destPos, uint32_t value) {
+    dest[*destPos] = value;
+    dest[*destPos + 1] = value >> 8;
+    dest[*destPos + 2] = value >> 16;
+    dest[*destPos + 3] = value >> 24;
     *destPos += 4;
-    *buff = 0;
-    *buffPos = 0;
 }
 
-static inline void read_32_le(unsigned char * src, int * srcPos, uint32_t * buff) {
-    uint32_t tmp = src[*srcPos];
-    tmp |= src[*srcPos + 1] << 8;
-    tmp |= src[*srcPos + 2] << 16;
-    tmp |= src[*srcPos + 3] << 24;
-    *srcPos += 4;
-    *buff = tmp;
+static inline uint32_t read_32_le(unsigned char * src, int srcPos) {
+    uint32_t tmp = src[srcPos];
+    tmp |= src[srcPos + 1] << 8;
+    tmp |= src[srcPos + 2] << 16;
+    tmp |= (uint32_t)src[srcPos + 3] << 24;
+    return tmp;
 }
 
-static void write_bits(unsigned char * dest, int * destPos, struct BitEncoding * encoding, int value, uint32_t * buff, int * buffBits) {
-    int nbits = encoding[value].nbits;
-    uint32_t bitstring = encoding[value].bitstring;
-
-    if (*buffBits + nbits >= 32) {
-        int diff = *buffBits + nbits - 32;
-        *buff <<= nbits - diff;
-        *buff |= bitstring >> diff;
-        bitstring &= ~(1 << diff);
-        nbits = diff;
-        write_32_le(dest, destPos, buff, buffBits);
+static void write_bits(unsigned char * dest, int * destPos, const struct HuffCode * code, uint64_t * buff, int * buffBits) {
+    *buff = (*buff << code->length) | code->bits;
+    *buffBits += code->length;
+
+    if (*buffBits >= 32) {
+        *buffBits -= 32;
+        write_32_le(dest, destPos, *buff >> *buffBits);
+        *buff &= (1ULL << *buffBits) - 1;
     }
-    if (nbits != 0) {
-        *buff <<= nbits;
-        *buff |= bitstring;
-        *buffBits += nbits;
+}
+
+static bool build_decode_table(unsigned char * src, int treeEnd, struct DecodeEntry * table) {
+    /*
+     * For each value of the next DECODE_TABLE_BITS bits, follows the tree
+     * from the root until it reaches a leaf or runs out of bits.
+     */
+    for (int bits = 0; bits < (1 << DECODE_TABLE_BITS); bits++) {
+        int treePos = 5;
+        int length = 0;
+        bool isLeaf = false;
+
+        while (!isLeaf && length < DECODE_TABLE_BITS) {
+            int curBit = (bits >> (DECODE_TABLE_BITS - 1 - length)) & 1;
+            unsigned char treeView = src[treePos];
+            isLeaf = ((treeView << curBit) & 0x80) != 0;
+            treePos = (treePos & ~1) + ((treeView & 0x3F) + 1) * 2 + curBit;
+            if (treePos >= treeEnd)
+                return false;
+            length++;
+        }
+
+        table[bits].value = isLeaf ? src[treePos] : treePos;
+        table[bits].length = length;
+        table[bits].isLeaf = isLeaf;
     }
+
+    return true;
 }
 
 /*
@@ -222,120 +338,75 @@ unsigned char * HuffCompress(unsigned char * src, int srcSize, int * compressedS
     if (srcSize <= 0)
         goto fail;
 
-    int worstCaseDestSize = 4 + (2 << bitDepth) + srcSize * 3;
+    // The data is read in whole words, so a partial last word is padded with
+    // zeros.
+    int paddedSize = (srcSize + 3) & ~3;
+    int worstCaseDestSize = 8 + (2 << bitDepth) + paddedSize * 3;
 
     unsigned char *dest = malloc(worstCaseDestSize);
     if (dest == NULL)
         goto fail;
 
     int nitems = 1 << bitDepth;
-
-    HuffNode_t * freqs = calloc(nitems, sizeof(HuffNode_t));
-    if (freqs == NULL)
-        goto fail;
-
-    struct BitEncoding * encoding = calloc(nitems, sizeof(struct BitEncoding));
-    if (encoding == NULL)
-        goto fail;
-
-    // Set up the frequencies table.  This will inform the tree.
-    for (int i = 0; i < nitems; i++) {
-        freqs[i].header.isLeaf = 1;
-        freqs[i].header.value = 0;
-        freqs[i].leaf.key = i;
-    }
+    int counts[MAX_SYMBOLS] = {0};
+    int lengths[MAX_SYMBOLS];
+    struct HuffCode codes[MAX_SYMBOLS];
 
     // Count each nybble or byte.
-    for (int i = 0; i < srcSize; i++) {
+    for (int i = 0; i < paddedSize; i++) {
+        unsigned char value = i < srcSize ? src[i] : 0;
         if (bitDepth == 8) {
-            freqs[src[i]].header.value++;
+            counts[value]++;
         } else {
-            freqs[src[i] >> 4].header.value++;
-            freqs[src[i] & 0xF].header.value++;
+            counts[value >> 4]++;
+            counts[value & 0xF]++;
         }
     }
 
 #ifdef DEBUG
     for (int i = 0; i < nitems; i++) {
-        fprintf(stderr, "%d: %d\n", i, freqs[i].header.value);
+        fprintf(stderr, "%d: %d\n", i, counts[i]);
     }
 #endif // DEBUG
 
-    // Sort the frequency table.
-    if (!msort(freqs, nitems, sizeof(HuffNode_t), cmp_tree))
+    if (get_code_lengths(counts, nitems, lengths) == 0)
         goto fail;
 
-    // Prune zero-frequency values.
-    for (int i = 0; i < nitems; i++) {
-        if (freqs[i].header.value != 0) {
-            if (i > 0) {
-                for (int j = i; j < nitems; j++) {
-                    freqs[j - i] = freqs[j];
-                }
-                nitems -= i;
-            }
-            break;
-        }
-        // This should never happen:
-        if (i == nitems - 1)
-            goto fail;
-    }
+    // Write the tree, and create the code lookup table.
+    int nodeCount = write_tree(dest, lengths, nitems, codes);
 
-    HuffNode_t * tree = calloc(nitems * 2 - 1, sizeof(HuffNode_t));
-    if (tree == NULL)
-        goto fail;
-
-    // Iteratively collapse the two least frequent nodes.
-    HuffNode_t * endptr = freqs + nitems - 2;
-
-    for (int i = 0; i < nitems - 1; i++) {
-        HuffNode_t * left = freqs;
-        HuffNode_t * right = freqs + 1;
-        tree[i * 2] = *right;
-        tree[i * 2 + 1] = *left;
-        for (int j = 0; j < nitems - i - 2; j++)
-            freqs[j] = freqs[j + 2];
-        endptr->header.isLeaf = 0;
-        endptr->header.value = tree[i * 2].header.value + tree[i * 2 + 1].header.value;
-        endptr->branch.left = tree + i * 2;
-        endptr->branch.right = tree + i * 2 + 1;
-        endptr--;
-        if (i < nitems - 2 && !msort(freqs, nitems - i - 1, sizeof(HuffNode_t), cmp_tree))
-            goto fail;
-    }
-
-    // Write the tree breadth-first, and create the path lookup table.
-    write_tree(dest, freqs, nitems, encoding);
-
-    free(tree);
-    free(freqs);
+    // The size of the tree, counting its size byte, is used by the
+    // decompressor to skip it. It's padded so that the data is word-aligned.
+    int treeSize = (nodeCount + 1 + 3) & ~3;
+    memset(dest + 5 + nodeCount, 0, treeSize - nodeCount - 1);
+    dest[4] = treeSize / 2 - 1;
 
     // Encode the data itself.
-    int destPos = 4 + nitems * 2;
-    uint32_t destBuf = 0;
-    uint32_t srcBuf = 0;
+    int destPos = 4 + treeSize;
+    uint64_t destBuf = 0;
     int destBitPos = 0;
 
-    for (int srcPos = 0; srcPos < srcSize;) {
-        read_32_le(src, &srcPos, &srcBuf);
-        for (int i = 0; i < 32 / bitDepth; i++) {
-            write_bits(dest, &destPos, encoding, srcBuf & (0xFF >> (8 - bitDepth)), &destBuf, &destBitPos);
-            srcBuf >>= bitDepth;
+    for (int srcPos = 0; srcPos < paddedSize; srcPos++) {
+        unsigned char value = srcPos < srcSize ? src[srcPos] : 0;
+        if (bitDepth == 8) {
+            write_bits(dest, &destPos, &codes[value], &destBuf, &destBitPos);
+        } else {
+            write_bits(dest, &destPos, &codes[value & 0xF], &destBuf, &destBitPos);
+            write_bits(dest, &destPos, &codes[value >> 4], &destBuf, &destBitPos);
         }
     }
 
+    // The last word is read from its top bit down like the others.
     if (destBitPos != 0) {
-        write_32_le(dest, &destPos, &destBuf, &destBitPos);
+        write_32_le(dest, &destPos, destBuf << (32 - destBitPos));
     }
 
-    free(encoding);
-
     // Write the header.
     dest[0] = bitDepth | 0x20;
     dest[1] = srcSize;
     dest[2] = srcSize >> 8;
     dest[3] = srcSize >> 16;
-    *compressedSize_p = (destPos + 3) & ~3;
+    *compressedSize_p = destPos;
     return dest;
 
 fail:
@@ -343,7 +414,7 @@ fail:
 }
 
 unsigned char * HuffDecompress(unsigned char * src, int srcSize, int * uncompressedSize_p) {
-    if (srcSize < 4)
+    if (srcSize < 5)
         goto fail;
 
     int bitDepth = *src & 15;
@@ -352,47 +423,79 @@ unsigned char * HuffDecompress(unsigned char * src, int srcSize, int * uncompres
 
     int destSize = (src[3] << 16) | (src[2] << 8) | src[1];
 
-    unsigned char *dest = malloc(destSize);
+    unsigned char *dest = calloc(destSize > 0 ? destSize : 1, 1);
 
     if (dest == NULL)
         goto fail;
 
-    int treePos = 5;
     int treeSize = (src[4] + 1) * 2;
-    int srcPos = 4 + treeSize;
-    int destPos = 0;
-    int curValPos = 0;
-    uint32_t destTmp = 0;
-    uint32_t window;
-
-    for (;;)
-    {
-        if (srcPos >= srcSize)
+    int treeEnd = 4 + treeSize;
+    int srcPos = treeEnd;
+
+    if (treeEnd > srcSize)
+        goto fail;
+
+    struct DecodeEntry table[1 << DECODE_TABLE_BITS];
+
+    if (!build_decode_table(src, treeEnd, table))
+        goto fail;
+
+    // The unread bits, starting from the top bit.
+    uint64_t window = 0;
+    int windowBits = 0;
+    int symbolCount = destSize * (8 / bitDepth);
+
+    for (int i = 0; i < symbolCount; i++) {
+        if (windowBits <= 32 && srcPos + 4 <= srcSize) {
+            window |= (uint64_t)read_32_le(src, srcPos) << (32 - windowBits);
+            windowBits += 32;
+            srcPos += 4;
+        }
+
+        const struct DecodeEntry * entry = &table[window >> (64 - DECODE_TABLE_BITS)];
+        int value = entry->value;
+
+        if (entry->length > windowBits)
             goto fail;
-        read_32_le(src, &srcPos, &window);
-        for (int i = 0; i < 32; i++) {
-            int curBit = (window >> 31) & 1;
-            unsigned char treeView = src[treePos];
-            bool isLeaf = ((treeView << curBit) & 0x80) != 0;
-            treePos &= ~1; // align
-            treePos += ((treeView & 0x3F) + 1) * 2 + curBit;
-            if (isLeaf) {
-                destTmp >>= bitDepth;
-                destTmp |= (src[treePos] << (32 - bitDepth));
-                curValPos++;
-                if (curValPos == 32 / bitDepth) {
-                    write_32_le(dest, &destPos, &destTmp, &curValPos);
-                    if (destPos == destSize) {
-                        *uncompressedSize_p = destSize;
-                        return dest;
-                    }
+        window <<= entry->length;
+        windowBits -= entry->length;
+
+        // Codes longer than the table are finished one bit at a time.
+        if (!entry->isLeaf) {
+            int treePos = value;
+            bool isLeaf = false;
+
+            while (!isLeaf) {
+                if (windowBits == 0) {
+                    if (srcPos + 4 > srcSize)
+                        goto fail;
+                    window = (uint64_t)read_32_le(src, srcPos) << 32;
+                    windowBits = 32;
+                    srcPos += 4;
                 }
-                treePos = 5;
+
+                int curBit = window >> 63;
+                unsigned char treeView = src[treePos];
+                isLeaf = ((treeView << curBit) & 0x80) != 0;
+                treePos = (treePos & ~1) + ((treeView & 0x3F) + 1) * 2 + curBit;
+                if (treePos >= treeEnd)
+                    goto fail;
+                window <<= 1;
+                windowBits--;
             }
-            window <<= 1;
+
+            value = src[treePos];
         }
+
+        if (bitDepth == 8)
+            dest[i] = value;
+        else
+            dest[i / 2] |= (value & 0xF) << ((i & 1) * 4);
     }
 
+    *uncompressedSize_p = destSize;
+    return dest;
+
 fail:
     FATAL_ERROR("Fatal error while decompressing Huff file.\n");
 }
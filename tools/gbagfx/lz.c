@@ -1,5 +1,6 @@
 // Copyright (c) 2015 YamaArashi
 
+#include <limits.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include "global.h"
@@ -69,7 +70,136 @@ fail:
 	FATAL_ERROR("Fatal error while decompressing LZ file.\n");
 }
 
-unsigned char *LZCompress(unsigned char *src, int srcSize, int *compressedSize, const int minDistance)
+// Positions are chained by the hash of the three bytes starting there, most
+// recent first. Walking a chain visits every earlier position that could
+// start a match of 3 or more bytes, nearest first.
+#define LZ_HASH_BITS 14
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+#define LZ_MAX_DISTANCE 0x1000
+#define LZ_MIN_BLOCK_SIZE 3
+#define LZ_MAX_BLOCK_SIZE 18
+#define LZ_OPTIMAL_MAX_CHAIN_LENGTH 256
+
+struct LZMatchFinder {
+	unsigned char *src;
+	int srcSize;
+	int minDistance;
+	int maxChainLength;
+	int head[LZ_HASH_SIZE];
+	int *prev;
+	int nextInsertPos;
+};
+
+static int LZHash(unsigned char *p)
+{
+	unsigned int value = (p[0] << 16) | (p[1] << 8) | p[2];
+
+	return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static void LZInitMatchFinder(struct LZMatchFinder *finder, unsigned char *src, int srcSize, int minDistance, int maxChainLength)
+{
+	finder->src = src;
+	finder->srcSize = srcSize;
+	finder->minDistance = minDistance;
+	finder->maxChainLength = maxChainLength;
+	finder->prev = malloc(srcSize * sizeof(int));
+	finder->nextInsertPos = 0;
+
+	if (finder->prev == NULL)
+		FATAL_ERROR("Failed to allocate memory for LZ match finder.\n");
+
+	for (int i = 0; i < LZ_HASH_SIZE; i++)
+		finder->head[i] = -1;
+}
+
+// Finds the longest match for srcPos, preferring the nearest one among
+// equally long matches, exactly as a scan of every distance from minDistance
+// up would, unless maxChainLength cuts the search short. Only matches of at
+// least LZ_MIN_BLOCK_SIZE bytes are reported.
+static int LZFindMatch(struct LZMatchFinder *finder, int srcPos, int *blockDistance)
+{
+	unsigned char *src = finder->src;
+	int maxBlockSize = finder->srcSize - srcPos;
+
+	// Every position before srcPos has to be in the chains.
+	while (finder->nextInsertPos < srcPos) {
+		int pos = finder->nextInsertPos++;
+
+		if (pos + LZ_MIN_BLOCK_SIZE <= finder->srcSize) {
+			int hash = LZHash(&src[pos]);
+			finder->prev[pos] = finder->head[hash];
+			finder->head[hash] = pos;
+		}
+	}
+
+	if (maxBlockSize < LZ_MIN_BLOCK_SIZE)
+		return 0;
+
+	if (maxBlockSize > LZ_MAX_BLOCK_SIZE)
+		maxBlockSize = LZ_MAX_BLOCK_SIZE;
+
+	int bestBlockSize = 0;
+	int candidate = finder->head[LZHash(&src[srcPos])];
+	int chainLength = 0;
+
+	while (candidate >= 0 && srcPos - candidate <= LZ_MAX_DISTANCE && chainLength++ < finder->maxChainLength) {
+		if (srcPos - candidate >= finder->minDistance) {
+			int blockSize = 0;
+
+			while (blockSize < maxBlockSize && src[candidate + blockSize] == src[srcPos + blockSize])
+				blockSize++;
+
+			if (blockSize > bestBlockSize) {
+				bestBlockSize = blockSize;
+				*blockDistance = srcPos - candidate;
+
+				if (blockSize == maxBlockSize)
+					break;
+			}
+		}
+
+		candidate = finder->prev[candidate];
+	}
+
+	return bestBlockSize >= LZ_MIN_BLOCK_SIZE ? bestBlockSize : 0;
+}
+
+// Chooses a block size for every position that minimizes the total number of
+// bits, counting 9 for a literal and 17 for a block, including flag bits.
+// blockSizes[srcPos] is 0 where a literal should be emitted.
+static void LZPlanOptimalParse(struct LZMatchFinder *finder, int *blockSizes, int *blockDistances)
+{
+	int srcSize = finder->srcSize;
+	int *cost = malloc((srcSize + 1) * sizeof(int));
+
+	if (cost == NULL)
+		FATAL_ERROR("Failed to allocate memory for LZ optimal parse.\n");
+
+	for (int srcPos = 0; srcPos < srcSize; srcPos++)
+		blockSizes[srcPos] = LZFindMatch(finder, srcPos, &blockDistances[srcPos]);
+
+	cost[srcSize] = 0;
+
+	for (int srcPos = srcSize - 1; srcPos >= 0; srcPos--) {
+		int longestBlockSize = blockSizes[srcPos];
+
+		cost[srcPos] = cost[srcPos + 1] + 9;
+		blockSizes[srcPos] = 0;
+
+		// A shorter block at the same distance also matches.
+		for (int blockSize = LZ_MIN_BLOCK_SIZE; blockSize <= longestBlockSize; blockSize++) {
+			if (cost[srcPos + blockSize] + 17 < cost[srcPos]) {
+				cost[srcPos] = cost[srcPos + blockSize] + 17;
+				blockSizes[srcPos] = blockSize;
+			}
+		}
+	}
+
+	free(cost);
+}
+
+unsigned char *LZCompress(unsigned char *src, int srcSize, int *compressedSize, const int minDistance, const bool optimal)
 {
 	if (srcSize <= 0)
 		goto fail;
@@ -90,6 +220,25 @@ unsigned char *LZCompress(unsigned char *src, int srcSize, int *compressedSize,
 	dest[2] = (unsigned char)(srcSize >> 8);
 	dest[3] = (unsigned char)(srcSize >> 16);
 
+	struct LZMatchFinder finder;
+	int *blockSizes = NULL;
+	int *blockDistances = NULL;
+
+	// The optimal parse searches at every position, so it can't afford to
+	// walk the whole window on repetitive data. Its output doesn't have to
+	// match anything, so a shorter search is fine there.
+	LZInitMatchFinder(&finder, src, srcSize, minDistance, optimal ? LZ_OPTIMAL_MAX_CHAIN_LENGTH : INT_MAX);
+
+	if (optimal) {
+		blockSizes = malloc(srcSize * sizeof(int));
+		blockDistances = malloc(srcSize * sizeof(int));
+
+		if (blockSizes == NULL || blockDistances == NULL)
+			goto fail;
+
+		LZPlanOptimalParse(&finder, blockSizes, blockDistances);
+	}
+
 	int srcPos = 0;
 	int destPos = 4;
 
@@ -99,30 +248,16 @@ unsigned char *LZCompress(unsigned char *src, int srcSize, int *compressedSize,
 
 		for (int i = 0; i < 8; i++) {
 			int bestBlockDistance = 0;
-			int bestBlockSize = 0;
-			int blockDistance = minDistance;
-
-			while (blockDistance <= srcPos && blockDistance <= 0x1000) {
-				int blockStart = srcPos - blockDistance;
-				int blockSize = 0;
+			int bestBlockSize;
 
-				while (blockSize < 18
-				    && srcPos + blockSize < srcSize
-				    && src[blockStart + blockSize] == src[srcPos + blockSize])
-					blockSize++;
-
-				if (blockSize > bestBlockSize) {
-					bestBlockDistance = blockDistance;
-					bestBlockSize = blockSize;
-
-					if (blockSize == 18)
-						break;
-				}
-
-				blockDistance++;
+			if (optimal) {
+				bestBlockSize = blockSizes[srcPos];
+				bestBlockDistance = blockDistances[srcPos];
+			} else {
+				bestBlockSize = LZFindMatch(&finder, srcPos, &bestBlockDistance);
 			}
 
-			if (bestBlockSize >= 3) {
+			if (bestBlockSize >= LZ_MIN_BLOCK_SIZE) {
 				*flags |= (0x80 >> i);
 				srcPos += bestBlockSize;
 				bestBlockSize -= 3;
@@ -142,6 +277,10 @@ unsigned char *LZCompress(unsigned char *src, int srcSize, int *compressedSize,
 						dest[destPos++] = 0;
 				}
 
+				free(finder.prev);
+				free(blockSizes);
+				free(blockDistances);
+
 				*compressedSize = destPos;
 				return dest;
 			}
@@ -13,6 +13,7 @@
 #include "rl.h"
 #include "font.h"
 #include "huff.h"
+#include "manifest.h"
 
 struct CommandHandler
 {
@@ -375,6 +376,7 @@ void HandleLZCompressCommand(char *inputPath, char *outputPath, int argc, char *
 {
     int overflowSize = 0;
     int minDistance = 2; // default, for compatibility with LZ77UnCompVram()
+    bool optimal = false;
 
     for (int i = 3; i < argc; i++)
     {
@@ -406,6 +408,12 @@ void HandleLZCompressCommand(char *inputPath, char *outputPath, int argc, char *
             if (minDistance < 1)
                 FATAL_ERROR("LZ min search distance must be positive.\n");
         }
+        else if (strcmp(option, "-optimal") == 0)
+        {
+            // Smaller output, but different bytes from what the original
+            // compressor produced, so only for data that doesn't need to match.
+            optimal = true;
+        }
         else
         {
             FATAL_ERROR("Unrecognized option \"%s\".\n", option);
@@ -422,7 +430,7 @@ void HandleLZCompressCommand(char *inputPath, char *outputPath, int argc, char *
     unsigned char *buffer = ReadWholeFileZeroPadded(inputPath, &fileSize, overflowSize);
 
     int compressedSize;
-    unsigned char *compressedData = LZCompress(buffer, fileSize + overflowSize, &compressedSize, minDistance);
+    unsigned char *compressedData = LZCompress(buffer, fileSize + overflowSize, &compressedSize, minDistance, optimal);
 
     compressedData[1] = (unsigned char)fileSize;
     compressedData[2] = (unsigned char)(fileSize >> 8);
@@ -535,13 +543,10 @@ void HandleHuffDecompressCommand(char *inputPath, char *outputPath, int argc UNU
     free(uncompressedData);
 }
 
-int main(int argc, char **argv)
+static void RunCommand(int argc, char **argv)
 {
     char converted = 0;
 
-    if (argc < 3)
-        FATAL_ERROR("Usage: gbagfx INPUT_PATH OUTPUT_PATH [options...]\n");
-
     struct CommandHandler handlers[] =
     {
         { "1bpp", "png", HandleGbaToPngCommand },
@@ -621,6 +626,32 @@ int main(int argc, char **argv)
 
     if (!converted)
         FATAL_ERROR("Don't know how to convert \"%s\" to \"%s\".\n", argv[1], argv[2]);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc >= 3 && strcmp(argv[1], "--manifest") == 0)
+    {
+        int jobCount = 0;
+
+        if (argc == 5 && strcmp(argv[3], "-j") == 0)
+        {
+            if (!ParseNumber(argv[4], NULL, 10, &jobCount) || jobCount < 1)
+                FATAL_ERROR("Job count must be a positive number.\n");
+        }
+        else if (argc != 3)
+        {
+            FATAL_ERROR("Usage: gbagfx --manifest MANIFEST_PATH [-j JOBS]\n");
+        }
+
+        RunManifest(argv[2], jobCount, RunCommand);
+        return 0;
+    }
+
+    if (argc < 3)
+        FATAL_ERROR("Usage: gbagfx INPUT_PATH OUTPUT_PATH [options...]\n"
+                    "       gbagfx --manifest MANIFEST_PATH [-j JOBS]\n");
 
+    RunCommand(argc, argv);
     return 0;
 }
@@ -0,0 +1,306 @@
+// For st_mtim and sysconf() with -std=c11.
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "global.h"
+#include "util.h"
+#include "manifest.h"
+
+// A manifest lists one conversion per line, written as the arguments gbagfx
+// would get for it: "INPUT_PATH OUTPUT_PATH [options...]". Blank lines and
+// lines starting with '#' are ignored.
+//
+// A conversion whose input is the output of an earlier line runs after it.
+// All others may run at the same time. Conversions whose output is already at
+// least as new as their input are skipped, as are ones whose input doesn't
+// exist yet, which are left for make to handle.
+
+#if defined(__APPLE__)
+#define STAT_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#elif defined(_WIN32)
+#define STAT_MTIME_NSEC(st) 0
+#else
+#define STAT_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+#define MAX_MANIFEST_ARGS 64
+
+struct ManifestEntry {
+    int argc;
+    char **argv;
+    int wave;
+    volatile bool running;
+};
+
+struct ManifestQueue {
+    struct ManifestEntry *entries;
+    int entryCount;
+    int wave;
+    int nextEntry;
+    pthread_mutex_t mutex;
+    void (*runCommand)(int argc, char **argv);
+};
+
+// Looked at by RemovePartialOutputs when a conversion fails and exits.
+static struct ManifestEntry *sEntries;
+static int sEntryCount;
+
+static void RemovePartialOutputs(void)
+{
+    for (int i = 0; i < sEntryCount; i++)
+        if (sEntries[i].running)
+            remove(sEntries[i].argv[2]);
+}
+
+static bool GetMtime(const char *path, long long *mtime)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+        return false;
+
+    *mtime = (long long)st.st_mtime * 1000000000LL + STAT_MTIME_NSEC(st);
+    return true;
+}
+
+static uint32_t HashPath(const char *path)
+{
+    uint32_t hash = 0x811C9DC5;
+
+    while (*path != 0)
+    {
+        hash ^= (unsigned char)*path++;
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+// Numbers each entry by how many entries before it produce its input, so
+// that each wave only depends on earlier ones.
+static void AssignWaves(struct ManifestEntry *entries, int entryCount)
+{
+    int tableSize = 16;
+
+    while (tableSize < entryCount * 2)
+        tableSize *= 2;
+
+    // Maps an output path to the last entry that writes it.
+    int *producers = malloc(tableSize * sizeof(int));
+
+    if (producers == NULL)
+        FATAL_ERROR("Failed to allocate memory for manifest.\n");
+
+    for (int i = 0; i < tableSize; i++)
+        producers[i] = -1;
+
+    for (int i = 0; i < entryCount; i++)
+    {
+        char *inputPath = entries[i].argv[1];
+        char *outputPath = entries[i].argv[2];
+        int mask = tableSize - 1;
+        int slot;
+
+        entries[i].wave = 0;
+
+        for (slot = HashPath(inputPath) & mask; producers[slot] != -1; slot = (slot + 1) & mask)
+        {
+            if (strcmp(entries[producers[slot]].argv[2], inputPath) == 0)
+            {
+                entries[i].wave = entries[producers[slot]].wave + 1;
+                break;
+            }
+        }
+
+        for (slot = HashPath(outputPath) & mask; producers[slot] != -1; slot = (slot + 1) & mask)
+            if (strcmp(entries[producers[slot]].argv[2], outputPath) == 0)
+                break;
+
+        producers[slot] = i;
+    }
+
+    free(producers);
+}
+
+static bool NeedsConversion(struct ManifestEntry *entry)
+{
+    long long inputMtime;
+    long long outputMtime;
+
+    if (!GetMtime(entry->argv[1], &inputMtime))
+        return false;
+
+    return !GetMtime(entry->argv[2], &outputMtime) || outputMtime < inputMtime;
+}
+
+static void *RunWorker(void *arg)
+{
+    struct ManifestQueue *queue = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&queue->mutex);
+
+        while (queue->nextEntry < queue->entryCount && queue->entries[queue->nextEntry].wave != queue->wave)
+            queue->nextEntry++;
+
+        int index = queue->nextEntry++;
+
+        pthread_mutex_unlock(&queue->mutex);
+
+        if (index >= queue->entryCount)
+            return NULL;
+
+        struct ManifestEntry *entry = &queue->entries[index];
+
+        if (NeedsConversion(entry))
+        {
+            entry->running = true;
+            queue->runCommand(entry->argc, entry->argv);
+            entry->running = false;
+        }
+    }
+}
+
+// Reads the manifest as a string. An empty one, as an up-to-date build
+// writes, is just nothing to do.
+static char *ReadManifest(char *path)
+{
+    int size;
+
+    return (char *)ReadWholeFileZeroPadded(path, &size, 1);
+}
+
+// Splits the manifest into entries, with each argv pointing into text.
+static struct ManifestEntry *ParseManifest(char *path, char *text, int *entryCount)
+{
+    int capacity = 256;
+    int count = 0;
+    struct ManifestEntry *entries = malloc(capacity * sizeof(struct ManifestEntry));
+    int lineNum = 0;
+
+    if (entries == NULL)
+        FATAL_ERROR("Failed to allocate memory for manifest.\n");
+
+    for (char *line = text; line != NULL; )
+    {
+        char *next = strchr(line, '\n');
+
+        if (next != NULL)
+            *next++ = 0;
+
+        lineNum++;
+
+        int argc = 1;
+        char *args[MAX_MANIFEST_ARGS];
+
+        args[0] = "gbagfx";
+
+        for (char *token = strtok(line, " \t\r"); token != NULL; token = strtok(NULL, " \t\r"))
+        {
+            if (argc == 1 && token[0] == '#')
+                break;
+
+            if (argc == MAX_MANIFEST_ARGS)
+                FATAL_ERROR("%s:%d: Too many arguments.\n", path, lineNum);
+
+            args[argc++] = token;
+        }
+
+        line = next;
+
+        if (argc == 1)
+            continue;
+
+        if (argc < 3)
+            FATAL_ERROR("%s:%d: Expected an input and an output path.\n", path, lineNum);
+
+        if (count == capacity)
+        {
+            capacity *= 2;
+            entries = realloc(entries, capacity * sizeof(struct ManifestEntry));
+
+            if (entries == NULL)
+                FATAL_ERROR("Failed to allocate memory for manifest.\n");
+        }
+
+        entries[count].argc = argc;
+        entries[count].argv = malloc(argc * sizeof(char *));
+        entries[count].running = false;
+
+        if (entries[count].argv == NULL)
+            FATAL_ERROR("Failed to allocate memory for manifest.\n");
+
+        memcpy(entries[count].argv, args, argc * sizeof(char *));
+        count++;
+    }
+
+    *entryCount = count;
+    return entries;
+}
+
+void RunManifest(char *path, int jobCount, void (*runCommand)(int argc, char **argv))
+{
+    char *text = ReadManifest(path);
+    int entryCount;
+    struct ManifestEntry *entries = ParseManifest(path, text, &entryCount);
+    int waveCount = 0;
+
+    AssignWaves(entries, entryCount);
+
+    for (int i = 0; i < entryCount; i++)
+        if (entries[i].wave >= waveCount)
+            waveCount = entries[i].wave + 1;
+
+    if (jobCount <= 0)
+    {
+        long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+        jobCount = cpuCount > 0 ? cpuCount : 1;
+    }
+
+    pthread_t *threads = malloc(jobCount * sizeof(pthread_t));
+
+    if (threads == NULL)
+        FATAL_ERROR("Failed to allocate memory for worker threads.\n");
+
+    sEntries = entries;
+    sEntryCount = entryCount;
+    atexit(RemovePartialOutputs);
+
+    struct ManifestQueue queue;
+
+    queue.entries = entries;
+    queue.entryCount = entryCount;
+    queue.runCommand = runCommand;
+    pthread_mutex_init(&queue.mutex, NULL);
+
+    for (int wave = 0; wave < waveCount; wave++)
+    {
+        queue.wave = wave;
+        queue.nextEntry = 0;
+
+        for (int i = 0; i < jobCount; i++)
+            if (pthread_create(&threads[i], NULL, RunWorker, &queue) != 0)
+                FATAL_ERROR("Failed to create worker thread.\n");
+
+        for (int i = 0; i < jobCount; i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&queue.mutex);
+    sEntryCount = 0;
+
+    for (int i = 0; i < entryCount; i++)
+        free(entries[i].argv);
+
+    free(entries);
+    free(threads);
+    free(text);
+}
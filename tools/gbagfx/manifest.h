@@ -0,0 +1,9 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+// Runs every conversion listed in the manifest at path on jobCount threads,
+// or one per CPU if jobCount is 0, passing each one's arguments to
+// runCommand.
+void RunManifest(char *path, int jobCount, void (*runCommand)(int argc, char **argv));
+
+#endif // MANIFEST_H
@@ -0,0 +1,360 @@
+// Summarizes the heap usage that a HEAP_STATS build logs to mGBA's debug log,
+// and checks it against limits so a CI run can fail on a memory regression.
+//
+// Usage: heapreport LOG_FILE [--top N] [--leak-dumps N] [--max-peak BYTES]
+//                            [--min-largest BYTES] [--fail-on-leaks]
+//
+// The game dumps its heap each time the main callback changes. A dump is a
+// HEAP line with the heap's totals followed by a HEAPSITE line for each call
+// site that has blocks allocated, or that allocated any since the last dump.
+// Modern builds follow it with an OBJTILES line for the sprite tiles in VRAM.
+// Everything else in the log is ignored, as is whatever mGBA puts in front of
+// those words. See HeapStatsDump in gflib/malloc.c.
+//
+// The report has the heap's peak usage, its smallest largest free block and
+// most free blocks, the most sprite tiles allocated and the most free sprite
+// tiles wasted outside the largest free run, the call sites that used the
+// most, and the call sites that might leak: ones whose live bytes went up from
+// one dump to the next at least N times (3 by default) and never went down.
+//
+// --max-peak fails if the heap's usage ever went over BYTES, --min-largest
+// fails if its largest free block ever went under BYTES, and --fail-on-leaks
+// fails if any call site might leak. Failing exits with status 1.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define FATAL_ERROR(format, ...)            \
+do {                                        \
+    fprintf(stderr, format, ##__VA_ARGS__); \
+    exit(1);                                \
+} while (0)
+
+// HEAP_SIZE in gflib/malloc.h
+#define HEAP_SIZE 0x1C000
+
+#define MAX_LINE_LENGTH 1024
+
+struct Dump
+{
+    unsigned long tag;
+    unsigned long peak;
+    unsigned long freeBlocks;
+    unsigned long largestFree;
+};
+
+struct TileDump
+{
+    unsigned long tag;
+    unsigned long allocated;
+    unsigned long free;
+    unsigned long runs;
+    unsigned long largest;
+};
+
+struct Site
+{
+    char *name;
+    unsigned long peak;
+    unsigned long allocs;
+    unsigned long firstLive;
+    unsigned long live;
+    int lastDump;
+    int rises;
+    int falls;
+};
+
+static struct Site *s_sites;
+static int s_siteCount;
+static int s_siteCapacity;
+
+// Returns the number after " key=" in line, or 0 if it isn't there.
+static unsigned long GetField(const char *line, const char *key, int base)
+{
+    size_t keyLength = strlen(key);
+    const char *pos = line;
+
+    while ((pos = strstr(pos, key)) != NULL)
+    {
+        if (pos > line && pos[-1] == ' ' && pos[keyLength] == '=')
+            return strtoul(pos + keyLength + 1, NULL, base);
+        pos += keyLength;
+    }
+
+    return 0;
+}
+
+static struct Site *GetSite(const char *name, size_t length)
+{
+    for (int i = 0; i < s_siteCount; i++)
+    {
+        if (strncmp(s_sites[i].name, name, length) == 0 && s_sites[i].name[length] == 0)
+            return &s_sites[i];
+    }
+
+    if (s_siteCount == s_siteCapacity)
+    {
+        s_siteCapacity = s_siteCapacity ? s_siteCapacity * 2 : 256;
+        s_sites = realloc(s_sites, sizeof(struct Site) * s_siteCapacity);
+        if (s_sites == NULL)
+            FATAL_ERROR("Failed to allocate memory for call sites.\n");
+    }
+
+    struct Site *site = &s_sites[s_siteCount++];
+
+    memset(site, 0, sizeof(*site));
+    site->name = malloc(length + 1);
+    if (site->name == NULL)
+        FATAL_ERROR("Failed to allocate memory for call sites.\n");
+    memcpy(site->name, name, length);
+    site->name[length] = 0;
+    site->lastDump = -1;
+    return site;
+}
+
+// A site that isn't in a dump has nothing allocated, so if it had blocks at
+// its last dump, they were freed since.
+static void CatchUpSite(struct Site *site, int dump)
+{
+    if (site->lastDump >= 0 && site->lastDump < dump - 1 && site->live != 0)
+    {
+        site->falls++;
+        site->live = 0;
+    }
+}
+
+static void ReadSite(const char *line, int dump)
+{
+    // HEAPSITE <n> <file>:<line> live=...
+    const char *name = strchr(line, ' ');
+
+    if (name == NULL || (name = strchr(name + 1, ' ')) == NULL)
+        return;
+
+    name++;
+
+    size_t length = strcspn(name, " \r\n");
+    struct Site *site = GetSite(name, length);
+    unsigned long live = GetField(line, "live", 10);
+    unsigned long peak = GetField(line, "peak", 10);
+
+    CatchUpSite(site, dump);
+
+    unsigned long lastLive = site->lastDump == dump - 1 ? site->live : 0;
+
+    if (site->lastDump < 0)
+        site->firstLive = live;
+    if (live > lastLive)
+        site->rises++;
+    else if (live < lastLive)
+        site->falls++;
+
+    site->live = live;
+    site->lastDump = dump;
+    site->allocs += GetField(line, "allocs", 10);
+    if (peak > site->peak)
+        site->peak = peak;
+}
+
+static int ComparePeak(const void *a, const void *b)
+{
+    const struct Site *siteA = a;
+    const struct Site *siteB = b;
+
+    if (siteA->peak != siteB->peak)
+        return siteA->peak < siteB->peak ? 1 : -1;
+    return strcmp(siteA->name, siteB->name);
+}
+
+static void PrintUsage(void)
+{
+    FATAL_ERROR("Usage: heapreport LOG_FILE [--top N] [--leak-dumps N] [--max-peak BYTES]\n"
+                "                           [--min-largest BYTES] [--fail-on-leaks]\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+        PrintUsage();
+
+    const char *logPath = argv[1];
+    int top = 20;
+    int leakDumps = 3;
+    unsigned long maxPeak = 0;
+    unsigned long minLargest = 0;
+    bool failOnLeaks = false;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--top") == 0 && i + 1 < argc)
+            top = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--leak-dumps") == 0 && i + 1 < argc)
+            leakDumps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-peak") == 0 && i + 1 < argc)
+            maxPeak = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--min-largest") == 0 && i + 1 < argc)
+            minLargest = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--fail-on-leaks") == 0)
+            failOnLeaks = true;
+        else
+            PrintUsage();
+    }
+
+    FILE *fp = fopen(logPath, "r");
+
+    if (fp == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for reading.\n", logPath);
+
+    char line[MAX_LINE_LENGTH];
+    int dumpCount = 0;
+    struct Dump peakDump = {0};
+    struct Dump fragmentedDump = {0};
+    struct Dump mostBlocksDump = {0};
+    int peakIndex = -1;
+    int fragmentedIndex = -1;
+    int mostBlocksIndex = -1;
+    unsigned long failedAllocs = 0;
+    struct TileDump mostTilesDump = {0};
+    struct TileDump wastedTilesDump = {0};
+    int mostTilesIndex = -1;
+    int wastedTilesIndex = -1;
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        const char *record;
+
+        if ((record = strstr(line, "HEAPSITE ")) != NULL)
+        {
+            if (dumpCount > 0)
+                ReadSite(record, dumpCount - 1);
+        }
+        else if ((record = strstr(line, "OBJTILES ")) != NULL)
+        {
+            struct TileDump dump;
+
+            dump.tag = GetField(record, "tag", 16);
+            dump.allocated = GetField(record, "allocated", 10);
+            dump.free = GetField(record, "free", 10);
+            dump.runs = GetField(record, "runs", 10);
+            dump.largest = GetField(record, "largest", 10);
+
+            if (mostTilesIndex < 0 || dump.allocated > mostTilesDump.allocated)
+            {
+                mostTilesDump = dump;
+                mostTilesIndex = dumpCount - 1;
+            }
+            if (wastedTilesIndex < 0 || dump.free - dump.largest > wastedTilesDump.free - wastedTilesDump.largest)
+            {
+                wastedTilesDump = dump;
+                wastedTilesIndex = dumpCount - 1;
+            }
+        }
+        else if ((record = strstr(line, "HEAP ")) != NULL)
+        {
+            struct Dump dump;
+
+            // dumppeak is the most the heap held since the dump before.
+            dump.tag = GetField(record, "tag", 16);
+            dump.peak = GetField(record, "dumppeak", 10);
+            dump.freeBlocks = GetField(record, "blocks", 10);
+            dump.largestFree = GetField(record, "largest", 10);
+
+            if (peakIndex < 0 || dump.peak > peakDump.peak)
+            {
+                peakDump = dump;
+                peakIndex = dumpCount;
+            }
+            if (fragmentedIndex < 0 || dump.largestFree < fragmentedDump.largestFree)
+            {
+                fragmentedDump = dump;
+                fragmentedIndex = dumpCount;
+            }
+            if (mostBlocksIndex < 0 || dump.freeBlocks > mostBlocksDump.freeBlocks)
+            {
+                mostBlocksDump = dump;
+                mostBlocksIndex = dumpCount;
+            }
+
+            failedAllocs = GetField(record, "failed", 10);
+            dumpCount++;
+        }
+    }
+
+    fclose(fp);
+
+    if (dumpCount == 0)
+        FATAL_ERROR("No heap dumps in \"%s\". Was the ROM built with HEAP_STATS=1?\n", logPath);
+
+    for (int i = 0; i < s_siteCount; i++)
+        CatchUpSite(&s_sites[i], dumpCount);
+
+    qsort(s_sites, s_siteCount, sizeof(struct Site), ComparePeak);
+
+    printf("%d dumps\n", dumpCount);
+    printf("peak usage: %lu of %u bytes (%.1f%%) before dump %d (tag %08lx)\n", peakDump.peak, HEAP_SIZE,
+        peakDump.peak * 100.0 / HEAP_SIZE, peakIndex, peakDump.tag);
+    printf("smallest largest free block: %lu bytes at dump %d (tag %08lx)\n", fragmentedDump.largestFree,
+        fragmentedIndex, fragmentedDump.tag);
+    printf("most free blocks: %lu at dump %d (tag %08lx)\n", mostBlocksDump.freeBlocks, mostBlocksIndex,
+        mostBlocksDump.tag);
+    printf("failed allocations: %lu\n", failedAllocs);
+
+    if (mostTilesIndex >= 0)
+    {
+        printf("most sprite tiles allocated: %lu at dump %d (tag %08lx)\n", mostTilesDump.allocated,
+            mostTilesIndex, mostTilesDump.tag);
+        printf("most sprite tiles wasted: %lu of %lu free outside the largest run of %lu, in %lu runs, at dump %d (tag %08lx)\n",
+            wastedTilesDump.free - wastedTilesDump.largest, wastedTilesDump.free, wastedTilesDump.largest,
+            wastedTilesDump.runs, wastedTilesIndex, wastedTilesDump.tag);
+    }
+
+    printf("\nLargest %d call sites:\n", top < s_siteCount ? top : s_siteCount);
+    printf("%10s %10s %8s  %s\n", "peak", "live", "allocs", "site");
+
+    for (int i = 0; i < s_siteCount && i < top; i++)
+        printf("%10lu %10lu %8lu  %s\n", s_sites[i].peak, s_sites[i].live, s_sites[i].allocs, s_sites[i].name);
+
+    int leakCount = 0;
+
+    for (int i = 0; i < s_siteCount; i++)
+    {
+        struct Site *site = &s_sites[i];
+
+        if (site->rises < leakDumps || site->falls != 0)
+            continue;
+
+        if (leakCount++ == 0)
+        {
+            printf("\nPossible leaks (live bytes went up at %d or more dumps and never down):\n", leakDumps);
+            printf("%10s %10s %6s  %s\n", "first", "last", "rises", "site");
+        }
+
+        printf("%10lu %10lu %6d  %s\n", site->firstLive, site->live, site->rises, site->name);
+    }
+
+    bool failed = false;
+
+    if (maxPeak != 0 && peakDump.peak > maxPeak)
+    {
+        fprintf(stderr, "FAILED: peak usage %lu is over %lu bytes\n", peakDump.peak, maxPeak);
+        failed = true;
+    }
+    if (minLargest != 0 && fragmentedDump.largestFree < minLargest)
+    {
+        fprintf(stderr, "FAILED: largest free block %lu is under %lu bytes\n", fragmentedDump.largestFree, minLargest);
+        failed = true;
+    }
+    if (failOnLeaks && leakCount != 0)
+    {
+        fprintf(stderr, "FAILED: %d call sites might leak\n", leakCount);
+        failed = true;
+    }
+
+    for (int i = 0; i < s_siteCount; i++)
+        free(s_sites[i].name);
+    free(s_sites);
+
+    return failed ? 1 : 0;
+}
@@ -2,7 +2,10 @@
 
 #include "jsonproc.h"
 
+#include <fstream>
 #include <map>
+#include <sstream>
+#include <vector>
 
 #include <string>
 using std::string; using std::to_string;
@@ -23,20 +26,70 @@ string get_custom_var(string key)
     return customVars[key];
 }
 
+struct Job
+{
+    string jsonFilepath;
+    string templateFilepath;
+    string outputFilepath;
+};
+
+// Templates and JSON files are each parsed once, however many jobs use them.
+std::map<string, Template> templates;
+std::map<string, json> jsonFiles;
+
+const Template& get_template(Environment& env, const string& filepath)
+{
+    auto it = templates.find(filepath);
+    if (it == templates.end())
+        it = templates.emplace(filepath, env.parse_template(filepath)).first;
+    return it->second;
+}
+
+const json& get_json(Environment& env, const string& filepath)
+{
+    auto it = jsonFiles.find(filepath);
+    if (it == jsonFiles.end())
+        it = jsonFiles.emplace(filepath, env.load_json(filepath)).first;
+    return it->second;
+}
+
+// Leaves the file alone if it already has this text, so that nothing that
+// depends on it gets rebuilt.
+void write_if_changed(const string& filepath, const string& text)
+{
+    std::ifstream oldFile(filepath);
+    if (oldFile.is_open())
+    {
+        std::ostringstream oldText;
+        oldText << oldFile.rdbuf();
+        if (oldText.str() == text)
+            return;
+        oldFile.close();
+    }
+
+    std::ofstream file(filepath);
+    file << text;
+    file.close();
+    if (!file)
+        FATAL_ERROR("JSONPROC_ERROR: Failed to write %s\n", filepath.c_str());
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 4)
-        FATAL_ERROR("USAGE: jsonproc <json-filepath> <template-filepath> <output-filepath>\n");
+    if (argc < 4 || (argc - 1) % 3 != 0)
+        FATAL_ERROR("USAGE: jsonproc <json-filepath> <template-filepath> <output-filepath> [...]\n");
+
+    std::vector<Job> jobs;
+    for (int i = 1; i < argc; i += 3)
+        jobs.push_back({argv[i], argv[i + 1], argv[i + 2]});
 
-    string jsonfilepath = argv[1];
-    string templateFilepath = argv[2];
-    string outputFilepath = argv[3];
+    const Job *currentJob = nullptr;
 
     Environment env;
 
     // Add custom command callbacks.
-    env.add_callback("doNotModifyHeader", 0, [jsonfilepath, templateFilepath](Arguments& args) {
-        return "//\n// DO NOT MODIFY THIS FILE! It is auto-generated from " + jsonfilepath +" and Inja template " + templateFilepath + "\n//\n";
+    env.add_callback("doNotModifyHeader", 0, [&currentJob](Arguments& args) {
+        return "//\n// DO NOT MODIFY THIS FILE! It is auto-generated from " + currentJob->jsonFilepath +" and Inja template " + currentJob->templateFilepath + "\n//\n";
     });
 
     env.add_callback("subtract", 2, [](Arguments& args) {
@@ -96,13 +149,20 @@ int main(int argc, char *argv[])
         return args.at(0)->empty();
     });
 
-    try
-    {
-        env.write_with_json_file(templateFilepath, jsonfilepath, outputFilepath);
-    }
-    catch (const std::exception& e)
+    for (const Job& job : jobs)
     {
-        FATAL_ERROR("JSONPROC_ERROR: %s\n", e.what());
+        currentJob = &job;
+        customVars.clear();
+
+        try
+        {
+            const Template& tmpl = get_template(env, job.templateFilepath);
+            write_if_changed(job.outputFilepath, env.render(tmpl, get_json(env, job.jsonFilepath)));
+        }
+        catch (const std::exception& e)
+        {
+            FATAL_ERROR("JSONPROC_ERROR: %s\n", e.what());
+        }
     }
 
     return 0;
@@ -24,6 +24,12 @@ using std::ostringstream;
 #include <limits>
 using std::numeric_limits;
 
+#include <thread>
+using std::thread;
+
+#include <atomic>
+using std::atomic;
+
 #include "json11.h"
 using json11::Json;
 
@@ -60,20 +66,48 @@ void write_text_file(string filepath, string text) {
     out_file.close();
 }
 
-string generate_map_header_text(Json map_data, Json layouts_data, string version) {
-    string map_layout_id = map_data["layout"].string_value();
+// Leaves the file alone if it already holds text, so that make doesn't
+// rebuild what depends on it.
+void write_text_file_if_changed(string filepath, string text) {
+    ifstream in_file(filepath, std::ifstream::binary);
+
+    if (in_file.is_open()) {
+        ostringstream old_text;
+        old_text << in_file.rdbuf();
+        in_file.close();
+
+        if (old_text.str() == text)
+            return;
+    }
+
+    write_text_file(filepath, text);
+}
 
-    vector<Json> matched;
+// Maps each layout id to its layout, or to null if more than one layout has
+// that id.
+map<string, Json> build_layout_index(Json layouts_data) {
+    map<string, Json> index;
 
-    for (auto &field : layouts_data["layouts"].array_items()) {
-        if (map_layout_id == field["id"].string_value())
-            matched.push_back(field);
+    for (auto &layout : layouts_data["layouts"].array_items()) {
+        auto result = index.insert({layout["id"].string_value(), layout});
+        if (!result.second)
+            result.first->second = Json();
     }
 
-    if (matched.size() != 1)
-        FATAL_ERROR("Failed to find matching layout for %s.\n", map_layout_id.c_str());
+    return index;
+}
+
+Json find_layout(const map<string, Json> &layout_index, string layout_id) {
+    auto it = layout_index.find(layout_id);
 
-    Json layout = matched[0];
+    if (it == layout_index.end() || it->second == Json())
+        FATAL_ERROR("Failed to find matching layout for %s.\n", layout_id.c_str());
+
+    return it->second;
+}
+
+string generate_map_header_text(Json map_data, const map<string, Json> &layout_index, string version) {
+    Json layout = find_layout(layout_index, map_data["layout"].string_value());
 
     ostringstream text;
 
@@ -271,28 +305,62 @@ string get_directory_name(string filename) {
     return filename.substr(0, dir_pos + 1);
 }
 
-void process_map(string map_filepath, string layouts_filepath, string version) {
-    string mapdata_err, layouts_err;
+Json read_layouts(string layouts_filepath) {
+    string err;
+    Json layouts_data = Json::parse(read_text_file(layouts_filepath), err);
+
+    if (layouts_data == Json())
+        FATAL_ERROR("%s\n", err.c_str());
+
+    return layouts_data;
+}
+
+void process_map(string map_filepath, const map<string, Json> &layout_index, string version, bool only_if_changed) {
+    string mapdata_err;
 
     string mapdata_json_text = read_text_file(map_filepath);
-    string layouts_json_text = read_text_file(layouts_filepath);
 
     Json map_data = Json::parse(mapdata_json_text, mapdata_err);
     if (map_data == Json())
         FATAL_ERROR("%s\n", mapdata_err.c_str());
 
-    Json layouts_data = Json::parse(layouts_json_text, layouts_err);
-    if (layouts_data == Json())
-        FATAL_ERROR("%s\n", layouts_err.c_str());
-
-    string header_text = generate_map_header_text(map_data, layouts_data, version);
+    string header_text = generate_map_header_text(map_data, layout_index, version);
     string events_text = generate_map_events_text(map_data);
     string connections_text = generate_map_connections_text(map_data);
 
     string files_dir = get_directory_name(map_filepath);
-    write_text_file(files_dir + "header.inc", header_text);
-    write_text_file(files_dir + "events.inc", events_text);
-    write_text_file(files_dir + "connections.inc", connections_text);
+    auto write = only_if_changed ? write_text_file_if_changed : write_text_file;
+    write(files_dir + "header.inc", header_text);
+    write(files_dir + "events.inc", events_text);
+    write(files_dir + "connections.inc", connections_text);
+}
+
+// Converts every map against one copy of the layouts, spread over one thread
+// per CPU. Outputs that haven't changed are left alone.
+void process_maps(vector<string> map_filepaths, string layouts_filepath, string version) {
+    Json layouts_data = read_layouts(layouts_filepath);
+    map<string, Json> layout_index = build_layout_index(layouts_data);
+    atomic<size_t> next_map(0);
+
+    auto worker = [&]() {
+        for (size_t i = next_map++; i < map_filepaths.size(); i = next_map++)
+            process_map(map_filepaths[i], layout_index, version, true);
+    };
+
+    size_t thread_count = thread::hardware_concurrency();
+    if (thread_count == 0)
+        thread_count = 1;
+    if (thread_count > map_filepaths.size())
+        thread_count = map_filepaths.size();
+
+    vector<thread> threads;
+    for (size_t i = 1; i < thread_count; i++)
+        threads.emplace_back(worker);
+
+    worker();
+
+    for (auto &t : threads)
+        t.join();
 }
 
 string generate_groups_text(Json groups_data) {
@@ -504,11 +572,7 @@ string generate_layouts_constants_text(Json layouts_data) {
 }
 
 void process_layouts(string layouts_filepath) {
-    string err;
-    Json layouts_data = Json::parse(read_text_file(layouts_filepath), err);
-
-    if (layouts_data == Json())
-        FATAL_ERROR("%s\n", err.c_str());
+    Json layouts_data = read_layouts(layouts_filepath);
 
     string layout_headers_text = generate_layout_headers_text(layouts_data);
     string layouts_table_text = generate_layouts_table_text(layouts_data);
@@ -533,8 +597,8 @@ int main(int argc, char *argv[]) {
 
     char *mode_arg = argv[1];
     string mode(mode_arg);
-    if (mode != "layouts" && mode != "map" && mode != "groups")
-        FATAL_ERROR("ERROR: <mode> must be 'layouts', 'map', or 'groups'.\n");
+    if (mode != "layouts" && mode != "map" && mode != "maps" && mode != "groups")
+        FATAL_ERROR("ERROR: <mode> must be 'layouts', 'map', 'maps', or 'groups'.\n");
 
     if (mode == "map") {
         if (argc != 5)
@@ -543,7 +607,17 @@ int main(int argc, char *argv[]) {
         string filepath(argv[3]);
         string layouts_filepath(argv[4]);
 
-        process_map(filepath, layouts_filepath, version);
+        Json layouts_data = read_layouts(layouts_filepath);
+        process_map(filepath, build_layout_index(layouts_data), version, false);
+    }
+    else if (mode == "maps") {
+        if (argc < 4)
+            FATAL_ERROR("USAGE: mapjson maps <game-version> <layouts_file> [map_file...]\n");
+
+        string layouts_filepath(argv[3]);
+        vector<string> filepaths(argv + 4, argv + argc);
+
+        process_maps(filepaths, layouts_filepath, version);
     }
     else if (mode == "groups") {
         if (argc != 4)
@@ -23,127 +23,111 @@
 #include <cstdarg>
 #include <cstring>
 #include <vector>
-#include "agb.h"
-#include "main.h"
+#include "converter.h"
 #include "midi.h"
 #include "tables.h"
 
-int g_agbTrack;
-
-static std::string s_lastOpName;
-static int s_blockNum;
-static bool s_keepLastOpName;
-static int s_lastNote;
-static int s_lastVelocity;
-static bool s_noteChanged;
-static bool s_velocityChanged;
-static bool s_inPattern;
-static int s_extendedCommand;
-static int s_memaccOp;
-static int s_memaccParam1;
-static int s_memaccParam2;
-
-void PrintAgbHeader()
+void Converter::PrintAgbHeader()
 {
-    std::fprintf(g_outputFile, "\t.include \"MPlayDef.s\"\n\n");
-    std::fprintf(g_outputFile, "\t.equ\t%s_grp, voicegroup%03u\n", g_asmLabel.c_str(), g_voiceGroup);
-    std::fprintf(g_outputFile, "\t.equ\t%s_pri, %u\n", g_asmLabel.c_str(), g_priority);
+    std::fprintf(m_outputFile, "\t.include \"MPlayDef.s\"\n\n");
+    std::fprintf(m_outputFile, "\t.equ\t%s_grp, voicegroup%03u\n", m_options.asmLabel.c_str(), m_options.voiceGroup);
+    std::fprintf(m_outputFile, "\t.equ\t%s_pri, %u\n", m_options.asmLabel.c_str(), m_options.priority);
 
-    if (g_reverb >= 0)
-        std::fprintf(g_outputFile, "\t.equ\t%s_rev, reverb_set+%u\n", g_asmLabel.c_str(), g_reverb);
+    if (m_options.reverb >= 0)
+        std::fprintf(m_outputFile, "\t.equ\t%s_rev, reverb_set+%u\n", m_options.asmLabel.c_str(), m_options.reverb);
     else
-        std::fprintf(g_outputFile, "\t.equ\t%s_rev, 0\n", g_asmLabel.c_str());
+        std::fprintf(m_outputFile, "\t.equ\t%s_rev, 0\n", m_options.asmLabel.c_str());
 
-    std::fprintf(g_outputFile, "\t.equ\t%s_mvl, %u\n", g_asmLabel.c_str(), g_masterVolume);
-    std::fprintf(g_outputFile, "\t.equ\t%s_key, %u\n", g_asmLabel.c_str(), 0);
-    std::fprintf(g_outputFile, "\t.equ\t%s_tbs, %u\n", g_asmLabel.c_str(), g_clocksPerBeat);
-    std::fprintf(g_outputFile, "\t.equ\t%s_exg, %u\n", g_asmLabel.c_str(), g_exactGateTime);
-    std::fprintf(g_outputFile, "\t.equ\t%s_cmp, %u\n", g_asmLabel.c_str(), g_compressionEnabled);
+    std::fprintf(m_outputFile, "\t.equ\t%s_mvl, %u\n", m_options.asmLabel.c_str(), m_options.masterVolume);
+    std::fprintf(m_outputFile, "\t.equ\t%s_key, %u\n", m_options.asmLabel.c_str(), 0);
+    std::fprintf(m_outputFile, "\t.equ\t%s_tbs, %u\n", m_options.asmLabel.c_str(), m_options.clocksPerBeat);
+    std::fprintf(m_outputFile, "\t.equ\t%s_exg, %u\n", m_options.asmLabel.c_str(), m_options.exactGateTime);
+    std::fprintf(m_outputFile, "\t.equ\t%s_cmp, %u\n", m_options.asmLabel.c_str(), m_options.compressionEnabled);
 
-    std::fprintf(g_outputFile, "\n\t.section .rodata\n");
-    std::fprintf(g_outputFile, "\t.global\t%s\n", g_asmLabel.c_str());
+    std::fprintf(m_outputFile, "\n\t.section .rodata\n");
+    std::fprintf(m_outputFile, "\t.global\t%s\n", m_options.asmLabel.c_str());
 
-    std::fprintf(g_outputFile, "\t.align\t2\n");
+    std::fprintf(m_outputFile, "\t.align\t2\n");
 }
 
-void ResetTrackVars()
+void Converter::ResetTrackVars()
 {
-    s_lastVelocity = -1;
-    s_lastNote = -1;
-    s_velocityChanged = false;
-    s_noteChanged = false;
-    s_keepLastOpName = false;
-    s_lastOpName = "";
-    s_inPattern = false;
+    m_lastVelocity = -1;
+    m_lastNote = -1;
+    m_velocityChanged = false;
+    m_noteChanged = false;
+    m_keepLastOpName = false;
+    m_lastOpName = "";
+    m_inPattern = false;
 }
 
-void PrintWait(int wait)
+void Converter::PrintWait(int wait)
 {
     if (wait > 0)
     {
-        std::fprintf(g_outputFile, "\t.byte\tW%02d\n", wait);
-        s_velocityChanged = true;
-        s_noteChanged = true;
-        s_keepLastOpName = true;
+        std::fprintf(m_outputFile, "\t.byte\tW%02d\n", wait);
+        m_velocityChanged = true;
+        m_noteChanged = true;
+        m_keepLastOpName = true;
     }
 }
 
-void PrintOp(int wait, std::string name, const char *format, ...)
+void Converter::PrintOp(int wait, std::string name, const char *format, ...)
 {
     std::va_list args;
     va_start(args, format);
-    std::fprintf(g_outputFile, "\t.byte\t\t");
+    std::fprintf(m_outputFile, "\t.byte\t\t");
 
     if (format != nullptr)
     {
-        if (!g_compressionEnabled || s_lastOpName != name)
+        if (!m_options.compressionEnabled || m_lastOpName != name)
         {
-            std::fprintf(g_outputFile, "%s, ", name.c_str());
-            s_lastOpName = name;
+            std::fprintf(m_outputFile, "%s, ", name.c_str());
+            m_lastOpName = name;
         }
         else
         {
-            std::fprintf(g_outputFile, "        ");
+            std::fprintf(m_outputFile, "        ");
         }
-        std::vfprintf(g_outputFile, format, args);
+        std::vfprintf(m_outputFile, format, args);
     }
     else
     {
-        std::fputs(name.c_str(), g_outputFile);
-        s_lastOpName = name;
+        std::fputs(name.c_str(), m_outputFile);
+        m_lastOpName = name;
     }
 
-    std::fprintf(g_outputFile, "\n");
+    std::fprintf(m_outputFile, "\n");
 
     va_end(args);
 
     PrintWait(wait);
 }
 
-void PrintByte(const char *format, ...)
+void Converter::PrintByte(const char *format, ...)
 {
     std::va_list args;
     va_start(args, format);
-    std::fprintf(g_outputFile, "\t.byte\t");
-    std::vfprintf(g_outputFile, format, args);
-    std::fprintf(g_outputFile, "\n");
-    s_velocityChanged = true;
-    s_noteChanged = true;
-    s_keepLastOpName = true;
+    std::fprintf(m_outputFile, "\t.byte\t");
+    std::vfprintf(m_outputFile, format, args);
+    std::fprintf(m_outputFile, "\n");
+    m_velocityChanged = true;
+    m_noteChanged = true;
+    m_keepLastOpName = true;
     va_end(args);
 }
 
-void PrintWord(const char *format, ...)
+void Converter::PrintWord(const char *format, ...)
 {
     std::va_list args;
     va_start(args, format);
-    std::fprintf(g_outputFile, "\t .word\t");
-    std::vfprintf(g_outputFile, format, args);
-    std::fprintf(g_outputFile, "\n");
+    std::fprintf(m_outputFile, "\t .word\t");
+    std::vfprintf(m_outputFile, format, args);
+    std::fprintf(m_outputFile, "\n");
     va_end(args);
 }
 
-void PrintNote(const Event& event)
+void Converter::PrintNote(const Event& event)
 {
     int note = event.note;
     int velocity = g_noteVelocityLUT[event.param1];
@@ -154,7 +138,7 @@ void PrintNote(const Event& event)
 
     int gateTimeParam = 0;
 
-    if (g_exactGateTime && duration != -1)
+    if (m_options.exactGateTime && duration != -1)
         gateTimeParam = event.param2 - duration;
 
     char gtpBuf[16];
@@ -174,20 +158,20 @@ void PrintNote(const Event& event)
     bool noteChanged = true;
     bool velocityChanged = true;
 
-    if (g_compressionEnabled)
+    if (m_options.compressionEnabled)
     {
-        noteChanged = (note != s_lastNote);
-        velocityChanged = (velocity != s_lastVelocity);
+        noteChanged = (note != m_lastNote);
+        velocityChanged = (velocity != m_lastVelocity);
     }
 
-    if (s_keepLastOpName)
-        s_keepLastOpName = false;
+    if (m_keepLastOpName)
+        m_keepLastOpName = false;
     else
-        s_lastOpName = "";
+        m_lastOpName = "";
 
     if (noteChanged || velocityChanged || (gateTimeParam > 0))
     {
-        s_lastNote = note;
+        m_lastNote = note;
 
         char noteBuf[16];
 
@@ -200,7 +184,7 @@ void PrintNote(const Event& event)
 
         if (velocityChanged || (gateTimeParam > 0))
         {
-            s_lastVelocity = velocity;
+            m_lastVelocity = velocity;
             std::snprintf(velocityBuf, sizeof(velocityBuf), ", v%03u", velocity);
         }
         else
@@ -215,63 +199,63 @@ void PrintNote(const Event& event)
         PrintOp(event.time, opName, 0);
     }
 
-    s_noteChanged = noteChanged;
-    s_velocityChanged = velocityChanged;
+    m_noteChanged = noteChanged;
+    m_velocityChanged = velocityChanged;
 }
 
-void PrintEndOfTieOp(const Event& event)
+void Converter::PrintEndOfTieOp(const Event& event)
 {
     int note = event.note;
-    bool noteChanged = (note != s_lastNote);
+    bool noteChanged = (note != m_lastNote);
 
-    if (!noteChanged || !s_noteChanged)
-        s_lastOpName = "";
+    if (!noteChanged || !m_noteChanged)
+        m_lastOpName = "";
 
-    if (!noteChanged && g_compressionEnabled)
+    if (!noteChanged && m_options.compressionEnabled)
     {
         PrintOp(event.time, "EOT   ", nullptr);
     }
     else
     {
-        s_lastNote = note;
+        m_lastNote = note;
         if (note >= 24)
             PrintOp(event.time, "EOT   ", g_noteTable[note % 12], note / 12 - 2);
         else
             PrintOp(event.time, "EOT   ", g_minusNoteTable[note % 12], note / -12 + 2);
     }
 
-    s_noteChanged = noteChanged;
+    m_noteChanged = noteChanged;
 }
 
-void PrintSeqLoopLabel(const Event& event)
+void Converter::PrintSeqLoopLabel(const Event& event)
 {
-    s_blockNum = event.param1 + 1;
-    std::fprintf(g_outputFile, "%s_%u_B%u:\n", g_asmLabel.c_str(), g_agbTrack, s_blockNum);
+    m_blockNum = event.param1 + 1;
+    std::fprintf(m_outputFile, "%s_%u_B%u:\n", m_options.asmLabel.c_str(), m_agbTrack, m_blockNum);
     PrintWait(event.time);
     ResetTrackVars();
 }
 
-void PrintMemAcc(const Event& event)
+void Converter::PrintMemAcc(const Event& event)
 {
-    switch (s_memaccOp)
+    switch (m_memaccOp)
     {
     case 0x00:
-        PrintByte("MEMACC, mem_set, 0x%02X, %u", s_memaccParam1, event.param2);
+        PrintByte("MEMACC, mem_set, 0x%02X, %u", m_memaccParam1, event.param2);
         break;
     case 0x01:
-        PrintByte("MEMACC, mem_add, 0x%02X, %u", s_memaccParam1, event.param2);
+        PrintByte("MEMACC, mem_add, 0x%02X, %u", m_memaccParam1, event.param2);
         break;
     case 0x02:
-        PrintByte("MEMACC, mem_sub, 0x%02X, %u", s_memaccParam1, event.param2);
+        PrintByte("MEMACC, mem_sub, 0x%02X, %u", m_memaccParam1, event.param2);
         break;
     case 0x03:
-        PrintByte("MEMACC, mem_mem_set, 0x%02X, 0x%02X", s_memaccParam1, event.param2);
+        PrintByte("MEMACC, mem_mem_set, 0x%02X, 0x%02X", m_memaccParam1, event.param2);
         break;
     case 0x04:
-        PrintByte("MEMACC, mem_mem_add, 0x%02X, 0x%02X", s_memaccParam1, event.param2);
+        PrintByte("MEMACC, mem_mem_add, 0x%02X, 0x%02X", m_memaccParam1, event.param2);
         break;
     case 0x05:
-        PrintByte("MEMACC, mem_mem_sub, 0x%02X, 0x%02X", s_memaccParam1, event.param2);
+        PrintByte("MEMACC, mem_mem_sub, 0x%02X, 0x%02X", m_memaccParam1, event.param2);
         break;
     // TODO: everything else
     case 0x06:
@@ -329,11 +313,11 @@ void PrintMemAcc(const Event& event)
     PrintWait(event.time);
 }
 
-void PrintExtendedOp(const Event& event)
+void Converter::PrintExtendedOp(const Event& event)
 {
     // TODO: support for other extended commands
 
-    switch (s_extendedCommand)
+    switch (m_extendedCommand)
     {
     case 0x08:
         PrintOp(event.time, "XCMD  ", "xIECV , %u", event.param2);
@@ -347,7 +331,7 @@ void PrintExtendedOp(const Event& event)
     }
 }
 
-void PrintControllerOp(const Event& event)
+void Converter::PrintControllerOp(const Event& event)
 {
     switch (event.param1)
     {
@@ -355,7 +339,7 @@ void PrintControllerOp(const Event& event)
         PrintOp(event.time, "MOD   ", "%u", event.param2);
         break;
     case 0x07:
-        PrintOp(event.time, "VOL   ", "%u*%s_mvl/mxv", event.param2, g_asmLabel.c_str());
+        PrintOp(event.time, "VOL   ", "%u*%s_mvl/mxv", event.param2, m_options.asmLabel.c_str());
         break;
     case 0x0A:
         PrintOp(event.time, "PAN   ", "c_v%+d", event.param2 - 64);
@@ -365,19 +349,19 @@ void PrintControllerOp(const Event& event)
         PrintMemAcc(event);
         break;
     case 0x0D:
-        s_memaccOp = event.param2;
+        m_memaccOp = event.param2;
         PrintWait(event.time);
         break;
     case 0x0E:
-        s_memaccParam1 = event.param2;
+        m_memaccParam1 = event.param2;
         PrintWait(event.time);
         break;
     case 0x0F:
-        s_memaccParam2 = event.param2;
+        m_memaccParam2 = event.param2;
         PrintWait(event.time);
         break;
     case 0x11:
-        std::fprintf(g_outputFile, "%s_%u_L%u:\n", g_asmLabel.c_str(), g_agbTrack, event.param2);
+        std::fprintf(m_outputFile, "%s_%u_L%u:\n", m_options.asmLabel.c_str(), m_agbTrack, event.param2);
         PrintWait(event.time);
         ResetTrackVars();
         break;
@@ -401,7 +385,7 @@ void PrintControllerOp(const Event& event)
         PrintExtendedOp(event);
         break;
     case 0x1E:
-        s_extendedCommand = event.param2;
+        m_extendedCommand = event.param2;
         // TODO: loop op
         break;
     case 0x21:
@@ -415,10 +399,10 @@ void PrintControllerOp(const Event& event)
     }
 }
 
-void PrintAgbTrack(std::vector<Event>& events)
+void Converter::PrintAgbTrack(std::vector<Event>& events)
 {
-    std::fprintf(g_outputFile, "\n@**************** Track %u (Midi-Chn.%u) ****************@\n\n", g_agbTrack, g_midiChan + 1);
-    std::fprintf(g_outputFile, "%s_%u:\n", g_asmLabel.c_str(), g_agbTrack);
+    std::fprintf(m_outputFile, "\n@**************** Track %u (Midi-Chn.%u) ****************@\n\n", m_agbTrack, m_midiChan + 1);
+    std::fprintf(m_outputFile, "%s_%u:\n", m_options.asmLabel.c_str(), m_agbTrack);
 
     int wholeNoteCount = 0;
     int loopEndBlockNum = 0;
@@ -440,10 +424,10 @@ void PrintAgbTrack(std::vector<Event>& events)
     }
 
     if (!foundVolBeforeNote)
-        PrintByte("\tVOL   , 127*%s_mvl/mxv", g_asmLabel.c_str());
+        PrintByte("\tVOL   , 127*%s_mvl/mxv", m_options.asmLabel.c_str());
 
-    PrintWait(g_initialWait);
-    PrintByte("KEYSH , %s_key%+d", g_asmLabel.c_str(), 0);
+    PrintWait(m_initialWait);
+    PrintByte("KEYSH , %s_key%+d", m_options.asmLabel.c_str(), 0);
 
     for (unsigned i = 0; events[i].type != EventType::EndOfTrack; i++)
     {
@@ -451,13 +435,13 @@ void PrintAgbTrack(std::vector<Event>& events)
 
         if (IsPatternBoundary(event.type))
         {
-            if (s_inPattern)
+            if (m_inPattern)
                 PrintByte("PEND");
-            s_inPattern = false;
+            m_inPattern = false;
         }
 
         if (event.type == EventType::WholeNoteMark || event.type == EventType::Pattern)
-            std::fprintf(g_outputFile, "@ %03d   ----------------------------------------\n", wholeNoteCount++);
+            std::fprintf(m_outputFile, "@ %03d   ----------------------------------------\n", wholeNoteCount++);
 
         switch (event.type)
         {
@@ -472,31 +456,31 @@ void PrintAgbTrack(std::vector<Event>& events)
             break;
         case EventType::LoopEnd:
             PrintByte("GOTO");
-            PrintWord("%s_%u_B%u", g_asmLabel.c_str(), g_agbTrack, loopEndBlockNum);
+            PrintWord("%s_%u_B%u", m_options.asmLabel.c_str(), m_agbTrack, loopEndBlockNum);
             PrintSeqLoopLabel(event);
             break;
         case EventType::LoopEndBegin:
             PrintByte("GOTO");
-            PrintWord("%s_%u_B%u", g_asmLabel.c_str(), g_agbTrack, loopEndBlockNum);
+            PrintWord("%s_%u_B%u", m_options.asmLabel.c_str(), m_agbTrack, loopEndBlockNum);
             PrintSeqLoopLabel(event);
-            loopEndBlockNum = s_blockNum;
+            loopEndBlockNum = m_blockNum;
             break;
         case EventType::LoopBegin:
             PrintSeqLoopLabel(event);
-            loopEndBlockNum = s_blockNum;
+            loopEndBlockNum = m_blockNum;
             break;
         case EventType::WholeNoteMark:
             if (event.param2 & 0x80000000)
             {
-                std::fprintf(g_outputFile, "%s_%u_%03lu:\n", g_asmLabel.c_str(), g_agbTrack, (unsigned long)(event.param2 & 0x7FFFFFFF));
+                std::fprintf(m_outputFile, "%s_%u_%03lu:\n", m_options.asmLabel.c_str(), m_agbTrack, (unsigned long)(event.param2 & 0x7FFFFFFF));
                 ResetTrackVars();
-                s_inPattern = true;
+                m_inPattern = true;
             }
             PrintWait(event.time);
             break;
         case EventType::Pattern:
             PrintByte("PATT");
-            PrintWord("%s_%u_%03lu", g_asmLabel.c_str(), g_agbTrack, event.param2);
+            PrintWord("%s_%u_%03lu", m_options.asmLabel.c_str(), m_agbTrack, event.param2);
 
             while (!IsPatternBoundary(events[i + 1].type))
                 i++;
@@ -504,7 +488,7 @@ void PrintAgbTrack(std::vector<Event>& events)
             ResetTrackVars();
             break;
         case EventType::Tempo:
-            PrintByte("TEMPO , %u*%s_tbs/2", static_cast<int>(round(60000000.0f / static_cast<float>(event.param2))), g_asmLabel.c_str());
+            PrintByte("TEMPO , %u*%s_tbs/2", static_cast<int>(round(60000000.0f / static_cast<float>(event.param2))), m_options.asmLabel.c_str());
             PrintWait(event.time);
             break;
         case EventType::InstrumentChange:
@@ -525,24 +509,24 @@ void PrintAgbTrack(std::vector<Event>& events)
     PrintByte("FINE");
 }
 
-void PrintAgbFooter()
+void Converter::PrintAgbFooter()
 {
-    int trackCount = g_agbTrack - 1;
-
-    std::fprintf(g_outputFile, "\n@******************************************************@\n");
-    std::fprintf(g_outputFile, "\t.align\t2\n");
-    std::fprintf(g_outputFile, "\n%s:\n", g_asmLabel.c_str());
-    std::fprintf(g_outputFile, "\t.byte\t%u\t@ NumTrks\n", trackCount);
-    std::fprintf(g_outputFile, "\t.byte\t%u\t@ NumBlks\n", 0);
-    std::fprintf(g_outputFile, "\t.byte\t%s_pri\t@ Priority\n", g_asmLabel.c_str());
-    std::fprintf(g_outputFile, "\t.byte\t%s_rev\t@ Reverb.\n", g_asmLabel.c_str());
-    std::fprintf(g_outputFile, "\n");
-    std::fprintf(g_outputFile, "\t.word\t%s_grp\n", g_asmLabel.c_str());
-    std::fprintf(g_outputFile, "\n");
+    int trackCount = m_agbTrack - 1;
+
+    std::fprintf(m_outputFile, "\n@******************************************************@\n");
+    std::fprintf(m_outputFile, "\t.align\t2\n");
+    std::fprintf(m_outputFile, "\n%s:\n", m_options.asmLabel.c_str());
+    std::fprintf(m_outputFile, "\t.byte\t%u\t@ NumTrks\n", trackCount);
+    std::fprintf(m_outputFile, "\t.byte\t%u\t@ NumBlks\n", 0);
+    std::fprintf(m_outputFile, "\t.byte\t%s_pri\t@ Priority\n", m_options.asmLabel.c_str());
+    std::fprintf(m_outputFile, "\t.byte\t%s_rev\t@ Reverb.\n", m_options.asmLabel.c_str());
+    std::fprintf(m_outputFile, "\n");
+    std::fprintf(m_outputFile, "\t.word\t%s_grp\n", m_options.asmLabel.c_str());
+    std::fprintf(m_outputFile, "\n");
 
     // track pointers
     for (int i = 1; i <= trackCount; i++)
-        std::fprintf(g_outputFile, "\t.word\t%s_%u\n", g_asmLabel.c_str(), i);
+        std::fprintf(m_outputFile, "\t.word\t%s_%u\n", m_options.asmLabel.c_str(), i);
 
-    std::fprintf(g_outputFile, "\n\t.end\n");
+    std::fprintf(m_outputFile, "\n\t.end\n");
 }
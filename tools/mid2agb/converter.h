@@ -0,0 +1,115 @@
+#ifndef CONVERTER_H
+#define CONVERTER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include "midi.h"
+
+struct Options
+{
+    std::string asmLabel;
+    int masterVolume = 127;
+    int voiceGroup = 0;
+    int priority = 0;
+    int reverb = -1;
+    int clocksPerBeat = 1;
+    bool exactGateTime = false;
+    bool compressionEnabled = true;
+};
+
+// Converts one MIDI file to an AGB song. All of the state of a conversion
+// lives here, so songs can be converted on several threads at once. Reading
+// is in midi.cpp and printing is in agb.cpp.
+class Converter
+{
+public:
+    Converter(const std::string& inputFilename, const Options& options);
+    Converter(const Converter&) = delete;
+
+    void Convert(std::FILE *outputFile);
+
+private:
+    const Options& m_options;
+    std::FILE *m_outputFile;
+
+    std::vector<std::uint8_t> m_input;
+    long m_pos;
+
+    MidiFormat m_midiFormat;
+    std::int_fast32_t m_midiTrackCount;
+    std::int16_t m_midiTimeDiv;
+    int m_midiChan;
+    std::int32_t m_initialWait;
+
+    long m_trackDataStart;
+    std::vector<Event> m_seqEvents;
+    std::vector<Event> m_trackEvents;
+    std::int32_t m_absoluteTime;
+    int m_blockCount;
+    int m_minNote;
+    int m_maxNote;
+    int m_runningStatus;
+
+    int m_agbTrack;
+    std::string m_lastOpName;
+    int m_blockNum;
+    bool m_keepLastOpName;
+    int m_lastNote;
+    int m_lastVelocity;
+    bool m_noteChanged;
+    bool m_velocityChanged;
+    bool m_inPattern;
+    int m_extendedCommand;
+    int m_memaccOp;
+    int m_memaccParam1;
+    int m_memaccParam2;
+
+    // midi.cpp
+    void Seek(long offset);
+    void Skip(long offset);
+    std::string ReadSignature();
+    std::uint32_t ReadInt8();
+    std::uint32_t ReadInt16();
+    std::uint32_t ReadInt24();
+    std::uint32_t ReadInt32();
+    std::uint32_t ReadVLQ();
+    void ReadMidiFileHeader();
+    long ReadMidiTrackHeader(long offset);
+    void StartTrack();
+    void SkipEventData();
+    void DetermineEventCategory(MidiEventCategory& category, int& typeChan, int& size);
+    void MakeBlockEvent(Event& event, EventType type);
+    std::string ReadEventText();
+    bool ReadSeqEvent(Event& event);
+    void ReadSeqEvents();
+    bool CheckNoteEnd(Event& event);
+    void FindNoteEnd(Event& event);
+    bool ReadTrackEvent(Event& event);
+    void ReadTrackEvents();
+    std::unique_ptr<std::vector<Event>> MergeEvents();
+    void ConvertTimes(std::vector<Event>& events);
+    std::unique_ptr<std::vector<Event>> InsertTimingEvents(std::vector<Event>& inEvents);
+    void CalculateWaits(std::vector<Event>& events);
+    void ReadMidiTracks();
+
+    // agb.cpp
+    void PrintAgbHeader();
+    void ResetTrackVars();
+    void PrintWait(int wait);
+    void PrintOp(int wait, std::string name, const char *format, ...);
+    void PrintByte(const char *format, ...);
+    void PrintWord(const char *format, ...);
+    void PrintNote(const Event& event);
+    void PrintEndOfTieOp(const Event& event);
+    void PrintSeqLoopLabel(const Event& event);
+    void PrintMemAcc(const Event& event);
+    void PrintExtendedOp(const Event& event);
+    void PrintControllerOp(const Event& event);
+    void PrintAgbTrack(std::vector<Event>& events);
+    void PrintAgbFooter();
+};
+
+#endif // CONVERTER_H
@@ -22,6 +22,14 @@
 #include <cstdlib>
 #include <cstdarg>
 
+// The file being converted on this thread, named in errors in batch mode.
+static thread_local const char* s_errorFilename = nullptr;
+
+void SetErrorFilename(const char* filename)
+{
+    s_errorFilename = filename;
+}
+
 // Reports an error diagnostic and terminates the program.
 [[noreturn]] void RaiseError(const char* format, ...)
 {
@@ -30,7 +38,10 @@
     std::va_list args;
     va_start(args, format);
     std::vsnprintf(buffer, bufferSize, format, args);
-    std::fprintf(stderr, "error: %s\n", buffer);
+    if (s_errorFilename != nullptr)
+        std::fprintf(stderr, "error: %s: %s\n", s_errorFilename, buffer);
+    else
+        std::fprintf(stderr, "error: %s\n", buffer);
     va_end(args);
     std::exit(1);
 }
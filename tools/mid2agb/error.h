@@ -22,5 +22,6 @@
 #define ERROR_H
 
 [[noreturn]] void RaiseError(const char* format, ...);
+void SetErrorFilename(const char* filename);
 
 #endif // ERROR_H
@@ -24,28 +24,34 @@
 #include <cctype>
 #include <cassert>
 #include <string>
-#include <set>
-#include "main.h"
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <sys/stat.h>
 #include "error.h"
-#include "midi.h"
-#include "agb.h"
+#include "converter.h"
 
-FILE* g_inputFile = nullptr;
-FILE* g_outputFile = nullptr;
+#if defined(__APPLE__)
+#define STAT_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#elif defined(_WIN32)
+#define STAT_MTIME_NSEC(st) 0
+#else
+#define STAT_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
 
-std::string g_asmLabel;
-int g_masterVolume = 127;
-int g_voiceGroup = 0;
-int g_priority = 0;
-int g_reverb = -1;
-int g_clocksPerBeat = 1;
-bool g_exactGateTime = false;
-bool g_compressionEnabled = true;
+struct Song
+{
+    std::string inputFilename;
+    std::string outputFilename;
+    Options options;
+};
 
 [[noreturn]] static void PrintUsage()
 {
     std::printf(
         "Usage: MID2AGB name [options]\n"
+        "       MID2AGB --batch manifest_file [-j jobs]\n"
         "\n"
         "    input_file  filename(.mid) of MIDI file\n"
         "   output_file  filename(.s) for AGB file (default:input_file)\n"
@@ -58,6 +64,9 @@ bool g_compressionEnabled = true;
         "            -X  48 clocks/beat (default:24 clocks/beat)\n"
         "            -E  exact gate-time\n"
         "            -N  no compression\n"
+        "\n"
+        "A manifest lists one song per line, written as the arguments MID2AGB\n"
+        "would get for it. Songs whose output is up to date are skipped.\n"
     );
     std::exit(1);
 }
@@ -127,11 +136,10 @@ static const char *GetArgument(int argc, char **argv, int& index)
     }
 }
 
-int main(int argc, char** argv)
+// Fills in song from the arguments in argv, starting at argv[1]. Returns
+// false if they aren't valid.
+static bool ParseArguments(int argc, char **argv, Song& song)
 {
-    std::string inputFilename;
-    std::string outputFilename;
-
     for (int i = 1; i < argc; i++)
     {
         const char *option = argv[i];
@@ -143,91 +151,241 @@ int main(int argc, char** argv)
             switch (std::toupper(option[1]))
             {
             case 'E':
-                g_exactGateTime = true;
+                song.options.exactGateTime = true;
                 break;
             case 'G':
                 arg = GetArgument(argc, argv, i);
                 if (arg == nullptr)
-                    PrintUsage();
-                g_voiceGroup = std::stoi(arg);
+                    return false;
+                song.options.voiceGroup = std::stoi(arg);
                 break;
             case 'L':
                 arg = GetArgument(argc, argv, i);
                 if (arg == nullptr)
-                    PrintUsage();
-                g_asmLabel = arg;
+                    return false;
+                song.options.asmLabel = arg;
                 break;
             case 'N':
-                g_compressionEnabled = false;
+                song.options.compressionEnabled = false;
                 break;
             case 'P':
                 arg = GetArgument(argc, argv, i);
                 if (arg == nullptr)
-                    PrintUsage();
-                g_priority = std::stoi(arg);
+                    return false;
+                song.options.priority = std::stoi(arg);
                 break;
             case 'R':
                 arg = GetArgument(argc, argv, i);
                 if (arg == nullptr)
-                    PrintUsage();
-                g_reverb = std::stoi(arg);
+                    return false;
+                song.options.reverb = std::stoi(arg);
                 break;
             case 'V':
                 arg = GetArgument(argc, argv, i);
                 if (arg == nullptr)
-                    PrintUsage();
-                g_masterVolume = std::stoi(arg);
+                    return false;
+                song.options.masterVolume = std::stoi(arg);
                 break;
             case 'X':
-                g_clocksPerBeat = 2;
+                song.options.clocksPerBeat = 2;
                 break;
             default:
-                PrintUsage();
+                return false;
             }
         }
         else
         {
-            if (inputFilename.empty())
-                inputFilename = argv[i];
-            else if (outputFilename.empty())
-                outputFilename = argv[i];
+            if (song.inputFilename.empty())
+                song.inputFilename = argv[i];
+            else if (song.outputFilename.empty())
+                song.outputFilename = argv[i];
             else
-                PrintUsage();
+                return false;
         }
     }
 
-    if (inputFilename.empty())
-        PrintUsage();
+    if (song.inputFilename.empty())
+        return false;
 
-    if (GetExtension(inputFilename) != "mid")
+    if (GetExtension(song.inputFilename) != "mid")
         RaiseError("input filename extension is not \"mid\"");
 
-    if (outputFilename.empty())
-        outputFilename = StripExtension(inputFilename) + ".s";
+    if (song.outputFilename.empty())
+        song.outputFilename = StripExtension(song.inputFilename) + ".s";
 
-    if (GetExtension(outputFilename) != "s")
+    if (GetExtension(song.outputFilename) != "s")
         RaiseError("output filename extension is not \"s\"");
 
-    if (g_asmLabel.empty())
-        g_asmLabel = BaseName(outputFilename);
+    if (song.options.asmLabel.empty())
+        song.options.asmLabel = BaseName(song.outputFilename);
+
+    return true;
+}
+
+static void ConvertSong(const Song& song)
+{
+    Converter converter(song.inputFilename, song.options);
+
+    std::FILE *outputFile = std::fopen(song.outputFilename.c_str(), "w");
+
+    if (outputFile == nullptr)
+        RaiseError("failed to open \"%s\" for writing", song.outputFilename.c_str());
+
+    converter.Convert(outputFile);
+
+    std::fclose(outputFile);
+}
+
+static bool GetMtime(const std::string& filename, long long& mtime)
+{
+    struct stat st;
+
+    if (stat(filename.c_str(), &st) != 0)
+        return false;
+
+    mtime = (long long)st.st_mtime * 1000000000LL + STAT_MTIME_NSEC(st);
+    return true;
+}
+
+// Songs whose input doesn't exist are left for make to report.
+static bool NeedsConversion(const Song& song)
+{
+    long long inputMtime;
+    long long outputMtime;
+
+    if (!GetMtime(song.inputFilename, inputMtime))
+        return false;
+
+    return !GetMtime(song.outputFilename, outputMtime) || outputMtime < inputMtime;
+}
+
+static std::vector<Song> ReadManifest(const char *filename)
+{
+    std::FILE *fp = std::fopen(filename, "r");
+
+    if (fp == nullptr)
+        RaiseError("failed to open \"%s\" for reading", filename);
+
+    std::vector<Song> songs;
+    char line[4096];
+    int lineNum = 0;
+
+    while (std::fgets(line, sizeof(line), fp) != nullptr)
+    {
+        lineNum++;
+
+        std::vector<char *> args;
+        char programName[] = "mid2agb";
+
+        args.push_back(programName);
+
+        for (char *token = std::strtok(line, " \t\r\n"); token != nullptr; token = std::strtok(nullptr, " \t\r\n"))
+        {
+            if (args.size() == 1 && token[0] == '#')
+                break;
+
+            args.push_back(token);
+        }
+
+        if (args.size() == 1)
+            continue;
 
-    g_inputFile = std::fopen(inputFilename.c_str(), "rb");
+        Song song;
 
-    if (g_inputFile == nullptr)
-        RaiseError("failed to open \"%s\" for reading", inputFilename.c_str());
+        if (!ParseArguments(args.size(), args.data(), song))
+            RaiseError("%s:%d: invalid arguments", filename, lineNum);
 
-    g_outputFile = std::fopen(outputFilename.c_str(), "w");
+        songs.push_back(song);
+    }
+
+    std::fclose(fp);
 
-    if (g_outputFile == nullptr)
-        RaiseError("failed to open \"%s\" for writing", outputFilename.c_str());
+    return songs;
+}
 
-    ReadMidiFileHeader();
-    PrintAgbHeader();
-    ReadMidiTracks();
-    PrintAgbFooter();
+// Looked at by RemovePartialOutputs when a conversion fails and exits.
+static std::vector<Song> *s_batchSongs;
+static std::atomic<bool> *s_batchRunning;
+
+static void RemovePartialOutputs()
+{
+    if (s_batchSongs == nullptr)
+        return;
+
+    for (std::size_t i = 0; i < s_batchSongs->size(); i++)
+        if (s_batchRunning[i])
+            std::remove((*s_batchSongs)[i].outputFilename.c_str());
+}
+
+// Converts every song in the manifest on jobCount threads, or one per CPU if
+// jobCount is 0.
+static void ConvertBatch(const char *manifestFilename, int jobCount)
+{
+    std::vector<Song> songs = ReadManifest(manifestFilename);
+    std::unique_ptr<std::atomic<bool>[]> running(new std::atomic<bool>[songs.size()]);
+    std::atomic<std::size_t> nextSong(0);
+
+    for (std::size_t i = 0; i < songs.size(); i++)
+        running[i] = false;
+
+    s_batchSongs = &songs;
+    s_batchRunning = running.get();
+    std::atexit(RemovePartialOutputs);
+
+    auto worker = [&]()
+    {
+        for (std::size_t i = nextSong++; i < songs.size(); i = nextSong++)
+        {
+            if (!NeedsConversion(songs[i]))
+                continue;
+
+            running[i] = true;
+            SetErrorFilename(songs[i].inputFilename.c_str());
+            ConvertSong(songs[i]);
+            SetErrorFilename(nullptr);
+            running[i] = false;
+        }
+    };
+
+    if (jobCount <= 0)
+        jobCount = std::thread::hardware_concurrency();
+    if (jobCount <= 0)
+        jobCount = 1;
+
+    std::vector<std::thread> threads;
+
+    for (int i = 1; i < jobCount; i++)
+        threads.emplace_back(worker);
+
+    worker();
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    s_batchSongs = nullptr;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc >= 2 && std::strcmp(argv[1], "--batch") == 0)
+    {
+        int jobCount = 0;
+
+        if (argc == 5 && std::strcmp(argv[3], "-j") == 0)
+            jobCount = std::stoi(argv[4]);
+        else if (argc != 3)
+            PrintUsage();
+
+        ConvertBatch(argv[2], jobCount);
+        return 0;
+    }
+
+    Song song;
+
+    if (!ParseArguments(argc, argv, song))
+        PrintUsage();
 
-    std::fclose(g_inputFile);
-    std::fclose(g_outputFile);
+    ConvertSong(song);
 
     return 0;
 }
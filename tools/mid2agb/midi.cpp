@@ -19,74 +19,82 @@
 // THE SOFTWARE.
 
 #include <cstdio>
+#include <cstring>
 #include <cassert>
 #include <string>
 #include <vector>
 #include <algorithm>
 #include <memory>
+#include <unordered_map>
 #include "midi.h"
-#include "main.h"
 #include "error.h"
-#include "agb.h"
+#include "converter.h"
 #include "tables.h"
 
-enum class MidiEventCategory
+// Reads the whole file, since the reader seeks back and forth through it
+// once for each MIDI channel.
+Converter::Converter(const std::string& inputFilename, const Options& options)
+    : m_options(options), m_outputFile(nullptr), m_pos(0), m_blockCount(0)
 {
-    Control,
-    SysEx,
-    Meta,
-    Invalid,
-};
+    std::FILE *fp = std::fopen(inputFilename.c_str(), "rb");
 
-MidiFormat g_midiFormat;
-std::int_fast32_t g_midiTrackCount;
-std::int16_t g_midiTimeDiv;
+    if (fp == nullptr)
+        RaiseError("failed to open \"%s\" for reading", inputFilename.c_str());
 
-int g_midiChan;
-std::int32_t g_initialWait;
+    std::uint8_t buffer[65536];
+    std::size_t count;
 
-static long s_trackDataStart;
-static std::vector<Event> s_seqEvents;
-static std::vector<Event> s_trackEvents;
-static std::int32_t s_absoluteTime;
-static int s_blockCount = 0;
-static int s_minNote;
-static int s_maxNote;
-static int s_runningStatus;
+    while ((count = std::fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        m_input.insert(m_input.end(), buffer, buffer + count);
 
-void Seek(long offset)
+    if (std::ferror(fp))
+        RaiseError("failed to read \"%s\"", inputFilename.c_str());
+
+    std::fclose(fp);
+}
+
+void Converter::Convert(std::FILE *outputFile)
 {
-    if (std::fseek(g_inputFile, offset, SEEK_SET) != 0)
-        RaiseError("failed to seek to %l", offset);
+    m_outputFile = outputFile;
+
+    ReadMidiFileHeader();
+    PrintAgbHeader();
+    ReadMidiTracks();
+    PrintAgbFooter();
 }
 
-void Skip(long offset)
+void Converter::Seek(long offset)
 {
-    if (std::fseek(g_inputFile, offset, SEEK_CUR) != 0)
-        RaiseError("failed to skip %l bytes", offset);
+    if (offset < 0)
+        RaiseError("failed to seek to %ld", offset);
+
+    m_pos = offset;
 }
 
-std::string ReadSignature()
+void Converter::Skip(long offset)
 {
-    char signature[4];
+    Seek(m_pos + offset);
+}
 
-    if (std::fread(signature, 4, 1, g_inputFile) != 1)
+std::string Converter::ReadSignature()
+{
+    if (m_pos + 4 > (long)m_input.size())
         RaiseError("failed to read signature");
 
-    return std::string(signature, 4);
+    std::string signature((const char *)&m_input[m_pos], 4);
+    m_pos += 4;
+    return signature;
 }
 
-std::uint32_t ReadInt8()
+std::uint32_t Converter::ReadInt8()
 {
-    int c = std::fgetc(g_inputFile);
-
-    if (c < 0)
+    if (m_pos >= (long)m_input.size())
         RaiseError("unexpected EOF");
 
-    return c;
+    return m_input[m_pos++];
 }
 
-std::uint32_t ReadInt16()
+std::uint32_t Converter::ReadInt16()
 {
     std::uint32_t val = 0;
     val |= ReadInt8() << 8;
@@ -94,7 +102,7 @@ std::uint32_t ReadInt16()
     return val;
 }
 
-std::uint32_t ReadInt24()
+std::uint32_t Converter::ReadInt24()
 {
     std::uint32_t val = 0;
     val |= ReadInt8() << 16;
@@ -103,7 +111,7 @@ std::uint32_t ReadInt24()
     return val;
 }
 
-std::uint32_t ReadInt32()
+std::uint32_t Converter::ReadInt32()
 {
     std::uint32_t val = 0;
     val |= ReadInt8() << 24;
@@ -113,7 +121,7 @@ std::uint32_t ReadInt32()
     return val;
 }
 
-std::uint32_t ReadVLQ()
+std::uint32_t Converter::ReadVLQ()
 {
     std::uint32_t val = 0;
     std::uint32_t c;
@@ -128,7 +136,7 @@ std::uint32_t ReadVLQ()
     return val;
 }
 
-void ReadMidiFileHeader()
+void Converter::ReadMidiFileHeader()
 {
     Seek(0);
 
@@ -145,15 +153,15 @@ void ReadMidiFileHeader()
     if (midiFormat >= 2)
         RaiseError("unsupported MIDI format (%u)", midiFormat);
 
-    g_midiFormat = (MidiFormat)midiFormat;
-    g_midiTrackCount = ReadInt16();
-    g_midiTimeDiv = ReadInt16();
+    m_midiFormat = (MidiFormat)midiFormat;
+    m_midiTrackCount = ReadInt16();
+    m_midiTimeDiv = ReadInt16();
 
-    if (g_midiTimeDiv < 0)
-        RaiseError("unsupported MIDI time division (%d)", g_midiTimeDiv);
+    if (m_midiTimeDiv < 0)
+        RaiseError("unsupported MIDI time division (%d)", m_midiTimeDiv);
 }
 
-long ReadMidiTrackHeader(long offset)
+long Converter::ReadMidiTrackHeader(long offset)
 {
     Seek(offset);
 
@@ -162,45 +170,45 @@ long ReadMidiTrackHeader(long offset)
 
     long size = ReadInt32();
 
-    s_trackDataStart = std::ftell(g_inputFile);
+    m_trackDataStart = m_pos;
 
     return size + 8;
 }
 
-void StartTrack()
+void Converter::StartTrack()
 {
-    Seek(s_trackDataStart);
-    s_absoluteTime = 0;
-    s_runningStatus = 0;
+    Seek(m_trackDataStart);
+    m_absoluteTime = 0;
+    m_runningStatus = 0;
 }
 
-void SkipEventData()
+void Converter::SkipEventData()
 {
     Skip(ReadVLQ());
 }
 
-void DetermineEventCategory(MidiEventCategory& category, int& typeChan, int& size)
+void Converter::DetermineEventCategory(MidiEventCategory& category, int& typeChan, int& size)
 {
     typeChan = ReadInt8();
 
     if (typeChan < 0x80)
     {
         // If data byte was found, use the running status.
-        ungetc(typeChan, g_inputFile);
-        typeChan = s_runningStatus;
+        m_pos--;
+        typeChan = m_runningStatus;
     }
 
     if (typeChan == 0xFF)
     {
         category = MidiEventCategory::Meta;
         size = 0;
-        s_runningStatus = 0;
+        m_runningStatus = 0;
     }
     else if (typeChan >= 0xF0)
     {
         category = MidiEventCategory::SysEx;
         size = 0;
-        s_runningStatus = 0;
+        m_runningStatus = 0;
     }
     else if (typeChan >= 0x80)
     {
@@ -216,7 +224,7 @@ void DetermineEventCategory(MidiEventCategory& category, int& typeChan, int& siz
             size = 2;
             break;
         }
-        s_runningStatus = typeChan;
+        m_runningStatus = typeChan;
     }
     else
     {
@@ -224,22 +232,25 @@ void DetermineEventCategory(MidiEventCategory& category, int& typeChan, int& siz
     }
 }
 
-void MakeBlockEvent(Event& event, EventType type)
+void Converter::MakeBlockEvent(Event& event, EventType type)
 {
     event.type = type;
-    event.param1 = s_blockCount++;
+    event.param1 = m_blockCount++;
     event.param2 = 0;
 }
 
-std::string ReadEventText()
+std::string Converter::ReadEventText()
 {
     char buffer[2];
     std::uint32_t length = ReadVLQ();
 
     if (length <= 2)
     {
-        if (fread(buffer, length, 1, g_inputFile) != 1)
+        if (length == 0 || m_pos + (long)length > (long)m_input.size())
             RaiseError("failed to read event text");
+
+        std::memcpy(buffer, &m_input[m_pos], length);
+        m_pos += length;
     }
     else
     {
@@ -250,10 +261,10 @@ std::string ReadEventText()
     return std::string(buffer, length);
 }
 
-bool ReadSeqEvent(Event& event)
+bool Converter::ReadSeqEvent(Event& event)
 {
-    s_absoluteTime += ReadVLQ();
-    event.time = s_absoluteTime;
+    m_absoluteTime += ReadVLQ();
+    event.time = m_absoluteTime;
 
     MidiEventCategory category;
     int typeChan;
@@ -326,7 +337,7 @@ bool ReadSeqEvent(Event& event)
 
             Skip(2); // ignore other values
 
-            int clockTicks = 96 * numerator * g_clocksPerBeat;
+            int clockTicks = 96 * numerator * m_options.clocksPerBeat;
             int denominator = 1 << denominatorExponent;
             int timeSig = clockTicks / denominator;
 
@@ -347,7 +358,7 @@ bool ReadSeqEvent(Event& event)
     return true;
 }
 
-void ReadSeqEvents()
+void Converter::ReadSeqEvents()
 {
     StartTrack();
 
@@ -357,7 +368,7 @@ void ReadSeqEvents()
 
         if (ReadSeqEvent(event))
         {
-            s_seqEvents.push_back(event);
+            m_seqEvents.push_back(event);
 
             if (event.type == EventType::EndOfTrack)
                 return;
@@ -365,7 +376,7 @@ void ReadSeqEvents()
     }
 }
 
-bool CheckNoteEnd(Event& event)
+bool Converter::CheckNoteEnd(Event& event)
 {
     event.param2 += ReadVLQ();
 
@@ -379,7 +390,7 @@ bool CheckNoteEnd(Event& event)
     {
         int chan = typeChan & 0xF;
 
-        if (chan != g_midiChan)
+        if (chan != m_midiChan)
         {
             Skip(size);
             return false;
@@ -431,12 +442,12 @@ bool CheckNoteEnd(Event& event)
     RaiseError("invalid event");
 }
 
-void FindNoteEnd(Event& event)
+void Converter::FindNoteEnd(Event& event)
 {
     // Save the current file position and running status
     // which get modified by CheckNoteEnd.
-    long startPos = ftell(g_inputFile);
-    int savedRunningStatus = s_runningStatus;
+    long startPos = m_pos;
+    int savedRunningStatus = m_runningStatus;
 
     event.param2 = 0;
 
@@ -444,13 +455,13 @@ void FindNoteEnd(Event& event)
         ;
 
     Seek(startPos);
-    s_runningStatus = savedRunningStatus;
+    m_runningStatus = savedRunningStatus;
 }
 
-bool ReadTrackEvent(Event& event)
+bool Converter::ReadTrackEvent(Event& event)
 {
-    s_absoluteTime += ReadVLQ();
-    event.time = s_absoluteTime;
+    m_absoluteTime += ReadVLQ();
+    event.time = m_absoluteTime;
 
     MidiEventCategory category;
     int typeChan;
@@ -462,7 +473,7 @@ bool ReadTrackEvent(Event& event)
     {
         int chan = typeChan & 0xF;
 
-        if (chan != g_midiChan)
+        if (chan != m_midiChan)
         {
             Skip(size);
             return false;
@@ -483,10 +494,10 @@ bool ReadTrackEvent(Event& event)
                 FindNoteEnd(event);
                 if (event.param2 > 0)
                 {
-                    if (note < s_minNote)
-                        s_minNote = note;
-                    if (note > s_maxNote)
-                        s_maxNote = note;
+                    if (note < m_minNote)
+                        m_minNote = note;
+                    if (note > m_maxNote)
+                        m_maxNote = note;
                 }
             }
             break;
@@ -539,14 +550,14 @@ bool ReadTrackEvent(Event& event)
     RaiseError("invalid event");
 }
 
-void ReadTrackEvents()
+void Converter::ReadTrackEvents()
 {
     StartTrack();
 
-    s_trackEvents.clear();
+    m_trackEvents.clear();
 
-    s_minNote = 0xFF;
-    s_maxNote = 0;
+    m_minNote = 0xFF;
+    m_maxNote = 0;
 
     for (;;)
     {
@@ -554,7 +565,7 @@ void ReadTrackEvents()
 
         if (ReadTrackEvent(event))
         {
-            s_trackEvents.push_back(event);
+            m_trackEvents.push_back(event);
 
             if (event.type == EventType::EndOfTrack)
                 return;
@@ -597,53 +608,53 @@ bool EventCompare(const Event& event1, const Event& event2)
     return false;
 }
 
-std::unique_ptr<std::vector<Event>> MergeEvents()
+std::unique_ptr<std::vector<Event>> Converter::MergeEvents()
 {
     std::unique_ptr<std::vector<Event>> events(new std::vector<Event>());
 
     unsigned trackEventPos = 0;
     unsigned seqEventPos = 0;
 
-    while (s_trackEvents[trackEventPos].type != EventType::EndOfTrack
-        && s_seqEvents[seqEventPos].type != EventType::EndOfTrack)
+    while (m_trackEvents[trackEventPos].type != EventType::EndOfTrack
+        && m_seqEvents[seqEventPos].type != EventType::EndOfTrack)
     {
-        if (EventCompare(s_trackEvents[trackEventPos], s_seqEvents[seqEventPos]))
-            events->push_back(s_trackEvents[trackEventPos++]);
+        if (EventCompare(m_trackEvents[trackEventPos], m_seqEvents[seqEventPos]))
+            events->push_back(m_trackEvents[trackEventPos++]);
         else
-            events->push_back(s_seqEvents[seqEventPos++]);
+            events->push_back(m_seqEvents[seqEventPos++]);
     }
 
-    while (s_trackEvents[trackEventPos].type != EventType::EndOfTrack)
-        events->push_back(s_trackEvents[trackEventPos++]);
+    while (m_trackEvents[trackEventPos].type != EventType::EndOfTrack)
+        events->push_back(m_trackEvents[trackEventPos++]);
 
-    while (s_seqEvents[seqEventPos].type != EventType::EndOfTrack)
-        events->push_back(s_seqEvents[seqEventPos++]);
+    while (m_seqEvents[seqEventPos].type != EventType::EndOfTrack)
+        events->push_back(m_seqEvents[seqEventPos++]);
 
     // Push the EndOfTrack event with the larger time.
-    if (EventCompare(s_trackEvents[trackEventPos], s_seqEvents[seqEventPos]))
-        events->push_back(s_seqEvents[seqEventPos]);
+    if (EventCompare(m_trackEvents[trackEventPos], m_seqEvents[seqEventPos]))
+        events->push_back(m_seqEvents[seqEventPos]);
     else
-        events->push_back(s_trackEvents[trackEventPos]);
+        events->push_back(m_trackEvents[trackEventPos]);
 
     return events;
 }
 
-void ConvertTimes(std::vector<Event>& events)
+void Converter::ConvertTimes(std::vector<Event>& events)
 {
     for (Event& event : events)
     {
-        event.time = (24 * g_clocksPerBeat * event.time) / g_midiTimeDiv;
+        event.time = (24 * m_options.clocksPerBeat * event.time) / m_midiTimeDiv;
 
         if (event.type == EventType::Note)
         {
             event.param1 = g_noteVelocityLUT[event.param1];
 
-            std::uint32_t duration = (24 * g_clocksPerBeat * event.param2) / g_midiTimeDiv;
+            std::uint32_t duration = (24 * m_options.clocksPerBeat * event.param2) / m_midiTimeDiv;
 
             if (duration == 0)
                 duration = 1;
 
-            if (!g_exactGateTime && duration < 96)
+            if (!m_options.exactGateTime && duration < 96)
                 duration = g_noteDurationLUT[duration];
 
             event.param2 = duration;
@@ -651,14 +662,14 @@ void ConvertTimes(std::vector<Event>& events)
     }
 }
 
-std::unique_ptr<std::vector<Event>> InsertTimingEvents(std::vector<Event>& inEvents)
+std::unique_ptr<std::vector<Event>> Converter::InsertTimingEvents(std::vector<Event>& inEvents)
 {
     std::unique_ptr<std::vector<Event>> outEvents(new std::vector<Event>());
 
     Event timingEvent = {};
     timingEvent.time = 0;
     timingEvent.type = EventType::TimeSignature;
-    timingEvent.param2 = 96 * g_clocksPerBeat;
+    timingEvent.param2 = 96 * m_options.clocksPerBeat;
 
     for (const Event& event : inEvents)
     {
@@ -670,7 +681,7 @@ std::unique_ptr<std::vector<Event>> InsertTimingEvents(std::vector<Event>& inEve
 
         if (event.type == EventType::TimeSignature)
         {
-            if (g_agbTrack == 1 && event.param2 != timingEvent.param2)
+            if (m_agbTrack == 1 && event.param2 != timingEvent.param2)
             {
                 Event originalTimingEvent = event;
                 originalTimingEvent.type = EventType::OriginalTimeSignature;
@@ -756,9 +767,9 @@ std::unique_ptr<std::vector<Event>> CreateTies(std::vector<Event>& inEvents)
     return outEvents;
 }
 
-void CalculateWaits(std::vector<Event>& events)
+void Converter::CalculateWaits(std::vector<Event>& events)
 {
-    g_initialWait = events[0].time;
+    m_initialWait = events[0].time;
     int wholeNoteCount = 0;
 
     for (unsigned i = 0; i < events.size() && events[i].type != EventType::EndOfTrack; i++)
@@ -873,17 +884,46 @@ bool IsCompressionMatch(std::vector<Event>& events, int index1, int index2)
     return IsPatternBoundary(events[index2].type);
 }
 
-void CompressWholeNote(std::vector<Event>& events, int index)
+// Hashes the fields of the segment starting at index that IsCompressionMatch
+// compares, so that segments that can match land in the same bucket.
+std::uint32_t HashWholeNote(std::vector<Event>& events, int index)
 {
-    for (int j = index + 1; events[j].type != EventType::EndOfTrack; j++)
+    std::uint32_t hash = 0x811C9DC5;
+
+    auto hashValue = [&hash](std::uint32_t value)
     {
-        while (events[j].type != EventType::WholeNoteMark)
+        for (int i = 0; i < 4; i++)
         {
-            j++;
-
-            if (events[j].type == EventType::EndOfTrack)
-                return;
+            hash ^= (value >> (i * 8)) & 0xFF;
+            hash *= 0x01000193;
         }
+    };
+
+    hashValue(events[index].note | (events[index].param1 << 8));
+    hashValue(events[index].time);
+
+    for (int i = index + 1; !IsPatternBoundary(events[i].type); i++)
+    {
+        hashValue((int)events[i].type | (events[i].note << 8) | (events[i].param1 << 16));
+        hashValue(events[i].time);
+        hashValue(events[i].param2);
+    }
+
+    return hash;
+}
+
+// Turns every later whole note in candidates that matches the one at index
+// into a reference to it. candidates is in ascending order.
+void CompressWholeNote(std::vector<Event>& events, int index, const std::vector<int>& candidates)
+{
+    auto it = std::upper_bound(candidates.begin(), candidates.end(), index);
+
+    for (; it != candidates.end(); ++it)
+    {
+        int j = *it;
+
+        if (events[j].type != EventType::WholeNoteMark)
+            continue;
 
         if (IsCompressionMatch(events, index, j))
         {
@@ -896,6 +936,14 @@ void CompressWholeNote(std::vector<Event>& events, int index)
 
 void Compress(std::vector<Event>& events)
 {
+    // Buckets the whole notes by hash so each one is only compared with the
+    // ones that can match it.
+    std::unordered_map<std::uint32_t, std::vector<int>> wholeNotes;
+
+    for (int i = 0; events[i].type != EventType::EndOfTrack; i++)
+        if (events[i].type == EventType::WholeNoteMark)
+            wholeNotes[HashWholeNote(events, i)].push_back(i);
+
     for (int i = 0; events[i].type != EventType::EndOfTrack; i++)
     {
         while (events[i].type != EventType::WholeNoteMark)
@@ -908,41 +956,41 @@ void Compress(std::vector<Event>& events)
 
         if (CalculateCompressionScore(events, i) >= 6)
         {
-            CompressWholeNote(events, i);
+            CompressWholeNote(events, i, wholeNotes[HashWholeNote(events, i)]);
         }
     }
 }
 
-void ReadMidiTracks()
+void Converter::ReadMidiTracks()
 {
     long trackHeaderStart = 14;
 
     ReadMidiTrackHeader(trackHeaderStart);
     ReadSeqEvents();
 
-    g_agbTrack = 1;
+    m_agbTrack = 1;
 
-    for (int midiTrack = 0; midiTrack < g_midiTrackCount; midiTrack++)
+    for (int midiTrack = 0; midiTrack < m_midiTrackCount; midiTrack++)
     {
         trackHeaderStart += ReadMidiTrackHeader(trackHeaderStart);
 
-        for (g_midiChan = 0; g_midiChan < 16; g_midiChan++)
+        for (m_midiChan = 0; m_midiChan < 16; m_midiChan++)
         {
             ReadTrackEvents();
 
-            if (s_minNote != 0xFF)
+            if (m_minNote != 0xFF)
             {
 #ifdef DEBUG
-                printf("Track%d = Midi-Ch.%d\n", g_agbTrack, g_midiChan + 1);
+                printf("Track%d = Midi-Ch.%d\n", m_agbTrack, m_midiChan + 1);
 #endif
 
                 std::unique_ptr<std::vector<Event>> events(MergeEvents());
 
                 // We don't need TEMPO in anything but track 1.
-                if (g_agbTrack == 1)
+                if (m_agbTrack == 1)
                 {
-                    auto it = std::remove_if(s_seqEvents.begin(), s_seqEvents.end(), [](const Event& event) { return event.type == EventType::Tempo; });
-                    s_seqEvents.erase(it, s_seqEvents.end());
+                    auto it = std::remove_if(m_seqEvents.begin(), m_seqEvents.end(), [](const Event& event) { return event.type == EventType::Tempo; });
+                    m_seqEvents.erase(it, m_seqEvents.end());
                 }
 
                 ConvertTimes(*events);
@@ -952,12 +1000,12 @@ void ReadMidiTracks()
                 events = SplitTime(*events);
                 CalculateWaits(*events);
 
-                if (g_compressionEnabled)
+                if (m_options.compressionEnabled)
                     Compress(*events);
 
                 PrintAgbTrack(*events);
 
-                g_agbTrack++;
+                m_agbTrack++;
             }
         }
     }
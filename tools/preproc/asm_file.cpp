@@ -20,12 +20,14 @@
 
 #include <cstdio>
 #include <cstdarg>
+#include <map>
 #include <stdexcept>
 #include "preproc.h"
 #include "asm_file.h"
 #include "char_util.h"
 #include "utf8.h"
 #include "string_parser.h"
+#include "output_buffer.h"
 #include "../../gflib/characters.h"
 
 AsmFile::AsmFile(std::string filename) : m_filename(filename)
@@ -507,7 +509,8 @@ void AsmFile::OutputLine()
         if (m_pos >= m_size)
         {
             RaiseWarning("file doesn't end with newline");
-            puts(&m_buffer[m_lineStart]);
+            g_output.Write(&m_buffer[m_lineStart], m_pos - m_lineStart);
+            g_output.Put('\n');
         }
         else
         {
@@ -516,10 +519,8 @@ void AsmFile::OutputLine()
     }
     else
     {
-        m_buffer[m_pos] = 0;
-        puts(&m_buffer[m_lineStart]);
-        m_buffer[m_pos] = '\n';
         m_pos++;
+        g_output.Write(&m_buffer[m_lineStart], m_pos - m_lineStart);
         m_lineStart = m_pos;
         m_lineNum++;
     }
@@ -564,7 +565,11 @@ bool AsmFile::IsAtEnd()
 // Output the current location to set gas's logical file and line numbers.
 void AsmFile::OutputLocation()
 {
-    std::printf("# %ld \"%s\"\n", m_lineNum, m_filename.c_str());
+    g_output.Write("# ");
+    g_output.WriteSigned(m_lineNum);
+    g_output.Write(" \"");
+    g_output.Write(m_filename);
+    g_output.Write("\"\n");
 }
 
 // Reports a diagnostic message.
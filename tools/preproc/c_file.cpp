@@ -25,13 +25,17 @@
 #include <memory>
 #include <cstring>
 #include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
 #include "preproc.h"
 #include "c_file.h"
 #include "char_util.h"
 #include "utf8.h"
 #include "string_parser.h"
+#include "output_buffer.h"
 
-CFile::CFile(const char * filenameCStr, bool isStdin)
+CFile::CFile(const char * filenameCStr, bool isStdin, bool incbinToAsm)
 {
     FILE *fp;
 
@@ -84,6 +88,9 @@ CFile::CFile(const char * filenameCStr, bool isStdin)
     m_pos = 0;
     m_lineNum = 1;
     m_isStdin = isStdin;
+    m_incbinToAsm = incbinToAsm;
+    m_scopePos = 0;
+    m_braceDepth = 0;
 }
 
 CFile::CFile(CFile&& other) : m_filename(std::move(other.m_filename))
@@ -93,6 +100,9 @@ CFile::CFile(CFile&& other) : m_filename(std::move(other.m_filename))
     m_size = other.m_size;
     m_lineNum = other.m_lineNum;
     m_isStdin = other.m_isStdin;
+    m_incbinToAsm = other.m_incbinToAsm;
+    m_scopePos = other.m_scopePos;
+    m_braceDepth = other.m_braceDepth;
 
     other.m_buffer = NULL;
 }
@@ -102,6 +112,13 @@ CFile::~CFile()
     free(m_buffer);
 }
 
+// Characters that need a closer look outside of a string or character literal.
+// Anything else is copied through as is.
+static bool IsSpecialChar(char c)
+{
+    return c == '_' || c == 'I' || c == '"' || c == '\'' || c == '\n';
+}
+
 void CFile::Preproc()
 {
     char stringChar = 0;
@@ -110,23 +127,33 @@ void CFile::Preproc()
     {
         if (stringChar)
         {
+            long start = m_pos;
+
+            while (m_pos < m_size && m_buffer[m_pos] != stringChar && m_buffer[m_pos] != '\\' && m_buffer[m_pos] != '\n')
+                m_pos++;
+
+            g_output.Write(&m_buffer[start], m_pos - start);
+
+            if (m_pos >= m_size)
+                break;
+
             if (m_buffer[m_pos] == stringChar)
             {
-                std::putchar(stringChar);
+                g_output.Put(stringChar);
                 m_pos++;
                 stringChar = 0;
             }
             else if (m_buffer[m_pos] == '\\' && m_buffer[m_pos + 1] == stringChar)
             {
-                std::putchar('\\');
-                std::putchar(stringChar);
+                g_output.Put('\\');
+                g_output.Put(stringChar);
                 m_pos += 2;
             }
             else
             {
                 if (m_buffer[m_pos] == '\n')
                     m_lineNum++;
-                std::putchar(m_buffer[m_pos]);
+                g_output.Put(m_buffer[m_pos]);
                 m_pos++;
             }
         }
@@ -140,7 +167,7 @@ void CFile::Preproc()
 
             char c = m_buffer[m_pos++];
 
-            std::putchar(c);
+            g_output.Put(c);
 
             if (c == '\n')
                 m_lineNum++;
@@ -148,6 +175,16 @@ void CFile::Preproc()
                 stringChar = '"';
             else if (c == '\'')
                 stringChar = '\'';
+
+            if (!stringChar)
+            {
+                long start = m_pos;
+
+                while (m_pos < m_size && !IsSpecialChar(m_buffer[m_pos]))
+                    m_pos++;
+
+                g_output.Write(&m_buffer[start], m_pos - start);
+            }
         }
     }
 }
@@ -169,7 +206,7 @@ bool CFile::ConsumeNewline()
     {
         m_pos += 2;
         m_lineNum++;
-        std::putchar('\n');
+        g_output.Put('\n');
         return true;
     }
 
@@ -177,7 +214,7 @@ bool CFile::ConsumeNewline()
     {
         m_pos++;
         m_lineNum++;
-        std::putchar('\n');
+        g_output.Put('\n');
         return true;
     }
 
@@ -220,7 +257,7 @@ void CFile::TryConvertString()
 
     SkipWhitespace();
 
-    std::printf("{ ");
+    g_output.Write("{ ");
 
     while (1)
     {
@@ -241,8 +278,7 @@ void CFile::TryConvertString()
                 RaiseError(e.what());
             }
 
-            for (int i = 0; i < length; i++)
-                printf("0x%02X, ", s[i]);
+            g_output.WriteHexBytes(s, length, ", ", true);
         }
         else if (m_buffer[m_pos] == ')')
         {
@@ -261,9 +297,9 @@ void CFile::TryConvertString()
     }
 
     if (noTerminator)
-        std::printf(" }");
+        g_output.Write(" }");
     else
-        std::printf("0xFF }");
+        g_output.Write("0xFF }");
 }
 
 bool CFile::CheckIdentifier(const std::string& ident)
@@ -339,6 +375,9 @@ void CFile::TryConvertIncbin()
     int size = 1 << (incbinType / 2);
     bool isSigned = ((incbinType % 2) == 0);
 
+    if (m_incbinToAsm && TryConvertIncbinToAsm(idents[incbinType].length(), size))
+        return;
+
     long oldPos = m_pos;
     long oldLineNum = m_lineNum;
 
@@ -355,7 +394,7 @@ void CFile::TryConvertIncbin()
 
     m_pos++;
 
-    std::printf("{");
+    g_output.Put('{');
 
     while (true)
     {
@@ -406,9 +445,15 @@ void CFile::TryConvertIncbin()
             offset += size;
 
             if (isSigned)
-                std::printf("%d,", data);
+            {
+                g_output.WriteSigned(data);
+                g_output.Put(',');
+            }
             else
-                std::printf("%uu,", data);
+            {
+                g_output.WriteUnsigned(data);
+                g_output.Write("u,");
+            }
         }
 
         SkipWhitespace();
@@ -424,7 +469,287 @@ void CFile::TryConvertIncbin()
 
     m_pos++;
 
-    std::printf("}");
+    g_output.Put('}');
+}
+
+// Keeps count of the braces between the last position checked and pos, which
+// must not come before it.
+bool CFile::IsAtFileScope(long pos)
+{
+    char stringChar = 0;
+
+    for (; m_scopePos < pos; m_scopePos++)
+    {
+        char c = m_buffer[m_scopePos];
+
+        if (stringChar)
+        {
+            if (c == '\\')
+                m_scopePos++;
+            else if (c == stringChar || c == '\n')
+                stringChar = 0;
+        }
+        else if (c == '"' || c == '\'')
+        {
+            stringChar = c;
+        }
+        else if (c == '{')
+        {
+            m_braceDepth++;
+        }
+        else if (c == '}')
+        {
+            m_braceDepth--;
+        }
+    }
+
+    return m_braceDepth == 0;
+}
+
+static std::size_t FindWord(const std::string& s, const std::string& word)
+{
+    std::size_t pos = 0;
+
+    while ((pos = s.find(word, pos)) != std::string::npos)
+    {
+        std::size_t end = pos + word.length();
+
+        if ((pos == 0 || !IsIdentifierChar(s[pos - 1])) && (end == s.length() || !IsIdentifierChar(s[end])))
+            return pos;
+
+        pos = end;
+    }
+
+    return std::string::npos;
+}
+
+// Returns the n in an "aligned(n)" attribute, or 0 if there is none.
+static long GetAlignment(const std::string& qualifiers)
+{
+    std::size_t pos = qualifiers.find("aligned");
+
+    if (pos == std::string::npos)
+        return 0;
+
+    pos += 7;
+
+    while (pos < qualifiers.length() && (qualifiers[pos] == '_' || qualifiers[pos] == ' ' || qualifiers[pos] == '('))
+        pos++;
+
+    return std::strtol(qualifiers.c_str() + pos, nullptr, 0);
+}
+
+// With --incbin-asm, turns a file scope definition on a single line such as
+//     static const u16 sFoo[] = INCBIN_U16("foo.bin");
+// into a declaration of a sized array plus an asm block that defines it with
+// .incbin, so the data never goes through the compiler. Anything else, such as
+// an INCBIN inside an initializer list, is left for TryConvertIncbin to
+// expand. Returns whether the definition was converted.
+bool CFile::TryConvertIncbinToAsm(int identLength, int size)
+{
+    long lineStart = m_pos;
+
+    while (lineStart > 0 && m_buffer[lineStart - 1] != '\n')
+        lineStart--;
+
+    // Match "NAME[] =" backwards from the INCBIN.
+    long pos = m_pos;
+
+    while (pos > lineStart && (m_buffer[pos - 1] == ' ' || m_buffer[pos - 1] == '\t'))
+        pos--;
+
+    if (pos == lineStart || m_buffer[pos - 1] != '=')
+        return false;
+
+    pos--;
+
+    while (pos > lineStart && (m_buffer[pos - 1] == ' ' || m_buffer[pos - 1] == '\t'))
+        pos--;
+
+    if (pos - lineStart < 2 || m_buffer[pos - 1] != ']' || m_buffer[pos - 2] != '[')
+        return false;
+
+    pos -= 2;
+
+    while (pos > lineStart && (m_buffer[pos - 1] == ' ' || m_buffer[pos - 1] == '\t'))
+        pos--;
+
+    long nameEnd = pos;
+
+    while (pos > lineStart && IsIdentifierChar(m_buffer[pos - 1]))
+        pos--;
+
+    if (pos == nameEnd || !IsIdentifierStartingChar(m_buffer[pos]))
+        return false;
+
+    std::string name(&m_buffer[pos], nameEnd - pos);
+    std::string qualifiers(&m_buffer[lineStart], pos - lineStart);
+
+    if (qualifiers.find_first_of(";{}=,\"'#") != std::string::npos)
+        return false;
+
+    bool hasType = false;
+
+    for (char c : qualifiers)
+        if (IsIdentifierChar(c))
+            hasType = true;
+
+    if (!hasType)
+        return false;
+
+    // Match the paths and the closing ";" without producing any output.
+    long oldPos = m_pos;
+    int newlineCount = 0;
+    std::vector<std::string> paths;
+
+    auto skipWhitespace = [&]()
+    {
+        while (true)
+        {
+            if (m_buffer[m_pos] == ' ' || m_buffer[m_pos] == '\t' || m_buffer[m_pos] == '\r')
+            {
+                m_pos++;
+            }
+            else if (m_buffer[m_pos] == '\n')
+            {
+                m_pos++;
+                newlineCount++;
+            }
+            else
+            {
+                break;
+            }
+        }
+    };
+
+    m_pos += identLength;
+    skipWhitespace();
+
+    bool matched = false;
+
+    if (m_buffer[m_pos] == '(')
+    {
+        m_pos++;
+
+        while (true)
+        {
+            skipWhitespace();
+
+            if (m_buffer[m_pos] != '"')
+                break;
+
+            long startPos = ++m_pos;
+
+            while (m_buffer[m_pos] != '"' && m_buffer[m_pos] != '\\' && m_buffer[m_pos] != '\r' && m_buffer[m_pos] != '\n' && m_buffer[m_pos] != 0)
+                m_pos++;
+
+            if (m_buffer[m_pos] != '"')
+                break;
+
+            paths.push_back(std::string(&m_buffer[startPos], m_pos - startPos));
+            m_pos++;
+            skipWhitespace();
+
+            if (m_buffer[m_pos] == ',')
+            {
+                m_pos++;
+                continue;
+            }
+
+            if (m_buffer[m_pos] == ')')
+            {
+                m_pos++;
+                skipWhitespace();
+                matched = (m_buffer[m_pos] == ';');
+            }
+
+            break;
+        }
+    }
+
+    // The rest of the line has to be taken back from the output, and the
+    // definition can't be inside a function, where the asm block could be
+    // duplicated or dropped along with the function.
+    if (!matched || !IsAtFileScope(lineStart) || !g_output.Unwrite(&m_buffer[lineStart], oldPos - lineStart))
+    {
+        m_pos = oldPos;
+        return false;
+    }
+
+    m_pos++;
+
+    long totalSize = 0;
+
+    for (const std::string& path : paths)
+    {
+        FILE *fp = std::fopen(path.c_str(), "rb");
+
+        if (fp == nullptr)
+            RaiseError("Failed to open \"%s\" for reading.\n", path.c_str());
+
+        std::fseek(fp, 0, SEEK_END);
+        long fileSize = std::ftell(fp);
+        std::fclose(fp);
+
+        if ((fileSize % size) != 0)
+            RaiseError("Size %d doesn't evenly divide file size %ld.\n", size, fileSize);
+
+        totalSize += fileSize;
+    }
+
+    bool isStatic = false;
+    std::size_t staticPos = FindWord(qualifiers, "static");
+
+    if (staticPos != std::string::npos)
+    {
+        qualifiers.erase(staticPos, 6);
+        isStatic = true;
+    }
+
+    long alignment = std::max(4L, GetAlignment(qualifiers));
+    const char *section = (FindWord(qualifiers, "const") != std::string::npos) ? ".rodata" : ".data";
+
+    // A static array gets a local label, which keeps it from clashing with
+    // arrays of the same name in other files.
+    g_output.Write("extern ");
+    g_output.Write(qualifiers);
+    g_output.Write(name);
+    g_output.Put('[');
+    g_output.WriteUnsigned(totalSize / size);
+    g_output.Write("]; __asm__(\".pushsection ");
+    g_output.Write(section);
+    g_output.Write("\\n.balign ");
+    g_output.WriteUnsigned(alignment);
+    if (!isStatic)
+    {
+        g_output.Write("\\n.global ");
+        g_output.Write(name);
+    }
+    g_output.Write("\\n.type ");
+    g_output.Write(name);
+    g_output.Write(", %object\\n");
+    g_output.Write(name);
+    g_output.Write(":\\n");
+
+    for (const std::string& path : paths)
+    {
+        g_output.Write(".incbin \\\"");
+        g_output.Write(path);
+        g_output.Write("\\\"\\n");
+    }
+
+    g_output.Write(".size ");
+    g_output.Write(name);
+    g_output.Write(", .-");
+    g_output.Write(name);
+    g_output.Write("\\n.popsection\");");
+
+    for (int i = 0; i < newlineCount; i++)
+        g_output.Put('\n');
+
+    m_lineNum += newlineCount;
+
+    return true;
 }
 
 // Reports a diagnostic message.
@@ -30,7 +30,7 @@
 class CFile
 {
 public:
-    CFile(const char * filenameCStr, bool isStdin);
+    CFile(const char * filenameCStr, bool isStdin, bool incbinToAsm);
     CFile(CFile&& other);
     CFile(const CFile&) = delete;
     ~CFile();
@@ -43,6 +43,9 @@ private:
     long m_lineNum;
     std::string m_filename;
     bool m_isStdin;
+    bool m_incbinToAsm;
+    long m_scopePos;
+    int m_braceDepth;
 
     bool ConsumeHorizontalWhitespace();
     bool ConsumeNewline();
@@ -51,6 +54,8 @@ private:
     std::unique_ptr<unsigned char[]> ReadWholeFile(const std::string& path, int& size);
     bool CheckIdentifier(const std::string& ident);
     void TryConvertIncbin();
+    bool IsAtFileScope(long pos);
+    bool TryConvertIncbinToAsm(int identLength, int size);
     void ReportDiagnostic(const char* type, const char* format, std::va_list args);
     void RaiseError(const char* format, ...);
     void RaiseWarning(const char* format, ...);
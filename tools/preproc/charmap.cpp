@@ -21,6 +21,8 @@
 #include <cstdio>
 #include <cstdint>
 #include <cstdarg>
+#include <cstring>
+#include <map>
 #include "preproc.h"
 #include "charmap.h"
 #include "char_util.h"
@@ -369,16 +371,30 @@ void CharmapReader::SkipWhitespace()
         m_pos++;
 }
 
+// Returns a power of two that keeps the table at most half full.
+static std::size_t GetTableSize(std::size_t count)
+{
+    std::size_t size = 16;
+
+    while (size < count * 2)
+        size *= 2;
+
+    return size;
+}
+
 Charmap::Charmap(std::string filename)
 {
     CharmapReader reader(filename);
+    std::map<std::int32_t, std::string> chars;
+    std::string escapes[128];
+    std::map<std::string, std::string> constants;
 
     for (;;)
     {
         Lhs lhs = reader.ReadLhs();
 
         if (lhs.type == LhsType::None)
-            return;
+            break;
 
         reader.ExpectEqualsSign();
 
@@ -387,22 +403,79 @@ Charmap::Charmap(std::string filename)
         switch (lhs.type)
         {
         case LhsType::Char:
-            if (m_chars.find(lhs.code) != m_chars.end())
+            if (chars.find(lhs.code) != chars.end())
                 reader.RaiseError("redefining char");
-            m_chars[lhs.code] = sequence;
+            chars[lhs.code] = sequence;
             break;
         case LhsType::Escape:
-            if (m_escapes[lhs.code].length() != 0)
+            if (escapes[lhs.code].length() != 0)
                 reader.RaiseError("redefining escape");
-            m_escapes[lhs.code] = sequence;
+            escapes[lhs.code] = sequence;
             break;
         case LhsType::Constant:
-            if (m_constants.find(lhs.name) != m_constants.end())
+            if (constants.find(lhs.name) != constants.end())
                 reader.RaiseError("redefining constant");
-            m_constants[lhs.name] = sequence;
+            constants[lhs.name] = sequence;
             break;
         }
 
         reader.ExpectEmptyRestOfLine();
     }
+
+    for (int i = 0; i < 128; i++)
+        m_escapes[i] = AddToArena(escapes[i]);
+
+    m_chars.assign(GetTableSize(chars.size()), CharSlot{ 0, { 0, 0 } });
+
+    for (const auto& pair : chars)
+    {
+        std::size_t mask = m_chars.size() - 1;
+        std::size_t i = HashCode(pair.first) & mask;
+
+        while (m_chars[i].sequence.length != 0)
+            i = (i + 1) & mask;
+
+        m_chars[i].code = pair.first;
+        m_chars[i].sequence = AddToArena(pair.second);
+    }
+
+    m_constants.assign(GetTableSize(constants.size()), ConstantSlot{ 0, { 0, 0 }, { 0, 0 } });
+
+    for (const auto& pair : constants)
+    {
+        std::uint32_t hash = HashName(pair.first.data(), pair.first.length());
+        std::size_t mask = m_constants.size() - 1;
+        std::size_t i = hash & mask;
+
+        while (m_constants[i].sequence.length != 0)
+            i = (i + 1) & mask;
+
+        m_constants[i].hash = hash;
+        m_constants[i].name = AddToArena(pair.first);
+        m_constants[i].sequence = AddToArena(pair.second);
+    }
+}
+
+Charmap::ArenaSpan Charmap::AddToArena(const std::string& s)
+{
+    ArenaSpan span = { static_cast<std::uint32_t>(m_arena.length()), static_cast<std::uint32_t>(s.length()) };
+    m_arena += s;
+    return span;
+}
+
+CharmapSequence Charmap::Constant(const char *name, std::size_t length) const
+{
+    std::uint32_t hash = HashName(name, length);
+    std::size_t mask = m_constants.size() - 1;
+
+    for (std::size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        const ConstantSlot& slot = m_constants[i];
+
+        if (slot.sequence.length == 0)
+            return { nullptr, 0 };
+
+        if (slot.hash == hash && slot.name.length == length && std::memcmp(m_arena.data() + slot.name.offset, name, length) == 0)
+            return GetSequence(slot.sequence);
+    }
 }
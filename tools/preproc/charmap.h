@@ -21,44 +21,99 @@
 #ifndef CHARMAP_H
 #define CHARMAP_H
 
+#include <cstddef>
 #include <cstdint>
 #include <string>
-#include <map>
 #include <vector>
 
+// A mapped byte sequence. The bytes belong to the charmap and stay valid as
+// long as it does. A length of 0 means there is no mapping.
+struct CharmapSequence
+{
+    const char *data;
+    std::size_t length;
+};
+
+// Once loaded, the sequences are kept in one arena, and chars and constants
+// are looked up in open-addressed hash tables, so a lookup doesn't allocate.
 class Charmap
 {
 public:
     Charmap(std::string filename);
 
-    std::string Char(std::int32_t code)
+    CharmapSequence Char(std::int32_t code) const
     {
-        auto it = m_chars.find(code);
+        std::size_t mask = m_chars.size() - 1;
 
-        if (it == m_chars.end())
-            return std::string();
+        for (std::size_t i = HashCode(code) & mask;; i = (i + 1) & mask)
+        {
+            const CharSlot& slot = m_chars[i];
 
-        return it->second;
+            if (slot.sequence.length == 0)
+                return { nullptr, 0 };
+
+            if (slot.code == code)
+                return GetSequence(slot.sequence);
+        }
     }
 
-    std::string Escape(unsigned char code)
+    CharmapSequence Escape(unsigned char code) const
     {
-        return m_escapes[code];
+        return GetSequence(m_escapes[code]);
     }
 
-    std::string Constant(std::string identifier)
+    CharmapSequence Constant(const char *name, std::size_t length) const;
+
+private:
+    struct ArenaSpan
     {
-        auto it = m_constants.find(identifier);
+        std::uint32_t offset;
+        std::uint32_t length;
+    };
 
-        if (it == m_constants.end())
-            return std::string();
+    struct CharSlot
+    {
+        std::int32_t code;
+        ArenaSpan sequence;
+    };
+
+    struct ConstantSlot
+    {
+        std::uint32_t hash;
+        ArenaSpan name;
+        ArenaSpan sequence;
+    };
 
-        return it->second;
+    std::string m_arena;
+    std::vector<CharSlot> m_chars;
+    ArenaSpan m_escapes[128];
+    std::vector<ConstantSlot> m_constants;
+
+    static std::uint32_t HashCode(std::int32_t code)
+    {
+        std::uint32_t hash = static_cast<std::uint32_t>(code) * 0x9E3779B1U;
+        return hash ^ (hash >> 16);
     }
-private:
-    std::map<std::int32_t, std::string> m_chars;
-    std::string m_escapes[128];
-    std::map<std::string, std::string> m_constants;
+
+    static std::uint32_t HashName(const char *name, std::size_t length)
+    {
+        std::uint32_t hash = 0x811C9DC5U;
+
+        for (std::size_t i = 0; i < length; i++)
+        {
+            hash ^= static_cast<unsigned char>(name[i]);
+            hash *= 0x01000193U;
+        }
+
+        return hash;
+    }
+
+    CharmapSequence GetSequence(ArenaSpan span) const
+    {
+        return { m_arena.data() + span.offset, span.length };
+    }
+
+    ArenaSpan AddToArena(const std::string& s);
 };
 
 #endif // CHARMAP_H
@@ -0,0 +1,226 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "preproc.h"
+#include "output_buffer.h"
+#include "server.h"
+#include "compile.h"
+
+// Usage: preproc --compile [--timings] [--incbin-asm] [--client SOCKET]
+//            SRC_FILE CHARMAP_FILE
+//            --cpp CPP_COMMAND... --cc1 CC1_COMMAND... --as AS_COMMAND...
+//
+// Each stage's output goes to an anonymous in-memory file that is the next
+// stage's input, so the stages run one after another. The .align trailer that
+// the Makefile used to add with cat goes on the end of cc1's output. If a
+// stage fails, the later ones don't run. With --client, the preproc stage is
+// handed to the server on SOCKET, as "preproc --client" would hand it.
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static const char s_asmTrailer[] = ".text\n\t.align\t2, 0\n";
+
+static int CreateTempFile(const char *name)
+{
+#ifdef __linux__
+    int fd = memfd_create(name, MFD_CLOEXEC);
+
+    if (fd >= 0)
+        return fd;
+#endif
+
+    std::FILE *fp = std::tmpfile();
+
+    if (fp == nullptr)
+        FATAL_ERROR("Failed to create a temporary file for %s output.\n", name);
+
+    int fd2 = fcntl(fileno(fp), F_DUPFD_CLOEXEC, 0);
+    std::fclose(fp);
+
+    if (fd2 < 0)
+        FATAL_ERROR("Failed to create a temporary file for %s output.\n", name);
+
+    return fd2;
+}
+
+// Runs command with its stdin and stdout redirected to inFd and outFd, if
+// they aren't -1. Returns the exit code.
+static int RunStage(std::vector<char *> command, int inFd, int outFd)
+{
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&actions);
+    if (inFd >= 0)
+    {
+        lseek(inFd, 0, SEEK_SET);
+        posix_spawn_file_actions_adddup2(&actions, inFd, 0);
+    }
+    if (outFd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, outFd, 1);
+
+    command.push_back(nullptr);
+
+    int error = posix_spawnp(&pid, command[0], &actions, nullptr, command.data(), environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (error != 0)
+        FATAL_ERROR("Failed to run \"%s\". (error: %s)\n", command[0], std::strerror(error));
+
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return 1;
+
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+
+    return 128 + WTERMSIG(status);
+}
+
+// Runs preproc on this process's stdin and stdout, the way the server runs
+// its jobs, with those pointed at inFd and outFd for the duration. If
+// socketPath isn't empty, the job goes to the server there instead.
+static int RunPreprocStage(std::vector<char *> args, const std::string& socketPath, int inFd, int outFd)
+{
+    int savedStdin = dup(0);
+    int savedStdout = dup(1);
+
+    std::fflush(stdout);
+    lseek(inFd, 0, SEEK_SET);
+    dup2(inFd, 0);
+    dup2(outFd, 1);
+    std::clearerr(stdin);
+
+    int exitCode = socketPath.empty()
+                 ? RunPreproc(args.size(), args.data())
+                 : RunClient(socketPath, args.size(), args.data());
+
+    g_output.Flush();
+    std::fflush(stdout);
+    dup2(savedStdin, 0);
+    dup2(savedStdout, 1);
+    close(savedStdin);
+    close(savedStdout);
+
+    return exitCode;
+}
+
+static double ElapsedMs(std::chrono::steady_clock::time_point& start)
+{
+    auto now = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(now - start).count();
+
+    start = now;
+    return ms;
+}
+
+int RunCompile(int argc, char **argv)
+{
+    bool timings = false;
+    bool incbinToAsm = false;
+    std::string socketPath;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] == '-'; i++)
+    {
+        if (std::strcmp(argv[i], "--timings") == 0)
+            timings = true;
+        else if (std::strcmp(argv[i], "--incbin-asm") == 0)
+            incbinToAsm = true;
+        else if (std::strcmp(argv[i], "--client") == 0 && i + 1 < argc)
+            socketPath = argv[++i];
+        else
+            break;
+    }
+
+    if (argc - i < 2)
+        FATAL_ERROR("Usage: preproc --compile [--timings] [--incbin-asm] [--client SOCKET] SRC_FILE CHARMAP_FILE --cpp CPP... --cc1 CC1... --as AS...\n");
+
+    char *srcFile = argv[i++];
+    char *charmapFile = argv[i++];
+    std::vector<char *> cppCommand;
+    std::vector<char *> cc1Command;
+    std::vector<char *> asCommand;
+    std::vector<char *> *command = nullptr;
+
+    for (; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--cpp") == 0)
+            command = &cppCommand;
+        else if (std::strcmp(argv[i], "--cc1") == 0)
+            command = &cc1Command;
+        else if (std::strcmp(argv[i], "--as") == 0)
+            command = &asCommand;
+        else if (command != nullptr)
+            command->push_back(argv[i]);
+        else
+            FATAL_ERROR("Unexpected argument \"%s\" before --cpp.\n", argv[i]);
+    }
+
+    if (cppCommand.empty() || cc1Command.empty() || asCommand.empty())
+        FATAL_ERROR("The --cpp, --cc1 and --as commands must all be given.\n");
+
+    static char stdinFlag[] = "-i";
+    static char incbinAsmFlag[] = "--incbin-asm";
+    std::vector<char *> preprocArgs = { argv[0], srcFile, charmapFile, stdinFlag };
+
+    if (incbinToAsm)
+        preprocArgs.push_back(incbinAsmFlag);
+
+    int cppOutput = CreateTempFile("cpp");
+    int preprocOutput = CreateTempFile("preproc");
+    int cc1Output = CreateTempFile("cc1");
+    double cppMs, preprocMs, cc1Ms, asMs;
+    auto start = std::chrono::steady_clock::now();
+    int exitCode;
+
+    if ((exitCode = RunStage(cppCommand, -1, cppOutput)) != 0)
+        return exitCode;
+    cppMs = ElapsedMs(start);
+
+    if ((exitCode = RunPreprocStage(preprocArgs, socketPath, cppOutput, preprocOutput)) != 0)
+        return exitCode;
+    preprocMs = ElapsedMs(start);
+
+    if ((exitCode = RunStage(cc1Command, preprocOutput, cc1Output)) != 0)
+        return exitCode;
+
+    if (write(cc1Output, s_asmTrailer, sizeof(s_asmTrailer) - 1) != sizeof(s_asmTrailer) - 1)
+        FATAL_ERROR("Failed to add the .align trailer to the output of cc1.\n");
+    cc1Ms = ElapsedMs(start);
+
+    if ((exitCode = RunStage(asCommand, cc1Output, -1)) != 0)
+        return exitCode;
+    asMs = ElapsedMs(start);
+
+    if (timings)
+        std::fprintf(stderr, "%s: cpp %.1f ms, preproc %.1f ms, cc1 %.1f ms, as %.1f ms\n", srcFile, cppMs, preprocMs, cc1Ms, asMs);
+
+    close(cppOutput);
+    close(preprocOutput);
+    close(cc1Output);
+    return 0;
+}
+
+#else
+
+int RunCompile(int argc, char **argv)
+{
+    FATAL_ERROR("--compile isn't supported on Windows.\n");
+}
+
+#endif // _WIN32
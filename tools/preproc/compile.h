@@ -0,0 +1,10 @@
+#ifndef COMPILE_H
+#define COMPILE_H
+
+// Compiles one C file the way "cpp | preproc | cc1 | as" does, running the
+// preproc step in this process, or on the preproc server, and each other
+// stage directly, without a shell. argv[0] is the path to this program.
+// Returns the exit code.
+int RunCompile(int argc, char **argv);
+
+#endif // COMPILE_H
@@ -0,0 +1,117 @@
+#include <cstdio>
+#include <cstring>
+#include "output_buffer.h"
+
+OutputBuffer g_output;
+
+static const char s_hexDigits[] = "0123456789ABCDEF";
+
+OutputBuffer::OutputBuffer()
+{
+    m_buffer = new char[kCapacity];
+    m_length = 0;
+}
+
+// Also runs when exiting after an error, so partial output still comes out
+// the way it did when it was written straight to stdout.
+OutputBuffer::~OutputBuffer()
+{
+    Flush();
+    delete[] m_buffer;
+}
+
+void OutputBuffer::Flush()
+{
+    if (m_length != 0)
+        std::fwrite(m_buffer, 1, m_length, stdout);
+    m_length = 0;
+}
+
+// Flushes everything up to the last newline and keeps the unfinished line.
+void OutputBuffer::FlushCompleteLines()
+{
+    std::size_t lineStart = m_length;
+
+    while (lineStart > 0 && m_buffer[lineStart - 1] != '\n')
+        lineStart--;
+
+    if (lineStart == 0)
+    {
+        Flush();
+        return;
+    }
+
+    std::fwrite(m_buffer, 1, lineStart, stdout);
+    std::memmove(m_buffer, &m_buffer[lineStart], m_length - lineStart);
+    m_length -= lineStart;
+}
+
+// Takes back the last length bytes written if they are still buffered and
+// match s. Returns whether they were taken back.
+bool OutputBuffer::Unwrite(const char *s, std::size_t length)
+{
+    if (length > m_length || std::memcmp(&m_buffer[m_length - length], s, length) != 0)
+        return false;
+
+    m_length -= length;
+    return true;
+}
+
+// Writes each byte as "0xHH", with separator between bytes and optionally
+// after the last one.
+void OutputBuffer::WriteHexBytes(const unsigned char *s, int length, const char *separator, bool trailingSeparator)
+{
+    std::size_t separatorLength = std::strlen(separator);
+
+    for (int i = 0; i < length; i++)
+    {
+        char *p = Reserve(4 + separatorLength);
+
+        p[0] = '0';
+        p[1] = 'x';
+        p[2] = s_hexDigits[s[i] >> 4];
+        p[3] = s_hexDigits[s[i] & 0xF];
+
+        if (trailingSeparator || i < length - 1)
+        {
+            std::memcpy(&p[4], separator, separatorLength);
+            m_length += 4 + separatorLength;
+        }
+        else
+        {
+            m_length += 4;
+        }
+    }
+}
+
+void OutputBuffer::WriteSigned(std::int32_t value)
+{
+    if (value < 0)
+    {
+        Put('-');
+        WriteUnsigned(0U - static_cast<std::uint32_t>(value));
+    }
+    else
+    {
+        WriteUnsigned(value);
+    }
+}
+
+void OutputBuffer::WriteUnsigned(std::uint32_t value)
+{
+    char digits[10];
+    int count = 0;
+
+    do
+    {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+
+    char *p = Reserve(count);
+
+    for (int i = 0; i < count; i++)
+        p[i] = digits[count - 1 - i];
+
+    m_length += count;
+}
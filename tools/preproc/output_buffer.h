@@ -0,0 +1,83 @@
+#ifndef OUTPUT_BUFFER_H
+#define OUTPUT_BUFFER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+// Collects preprocessed output in a large buffer and hands it to stdout in
+// big chunks. Everything written to stdout must go through g_output so that
+// it comes out in order. Unless a line is longer than the buffer, the line
+// being written stays in the buffer and can still be taken back.
+class OutputBuffer
+{
+public:
+    OutputBuffer();
+    OutputBuffer(const OutputBuffer&) = delete;
+    ~OutputBuffer();
+
+    void Put(char c)
+    {
+        if (m_length == kCapacity)
+            FlushCompleteLines();
+        m_buffer[m_length++] = c;
+    }
+
+    void Write(const char *s, std::size_t length)
+    {
+        if (length > kCapacity - m_length)
+        {
+            FlushCompleteLines();
+
+            if (length > kCapacity - m_length)
+                Flush();
+
+            if (length > kCapacity)
+            {
+                std::fwrite(s, 1, length, stdout);
+                return;
+            }
+        }
+
+        std::memcpy(&m_buffer[m_length], s, length);
+        m_length += length;
+    }
+
+    void Write(const char *s)
+    {
+        Write(s, std::strlen(s));
+    }
+
+    void Write(const std::string& s)
+    {
+        Write(s.data(), s.length());
+    }
+
+    void WriteHexBytes(const unsigned char *s, int length, const char *separator, bool trailingSeparator);
+    void WriteSigned(std::int32_t value);
+    void WriteUnsigned(std::uint32_t value);
+    bool Unwrite(const char *s, std::size_t length);
+    void Flush();
+
+private:
+    static const std::size_t kCapacity = 1 << 20;
+
+    char *m_buffer;
+    std::size_t m_length;
+
+    char *Reserve(std::size_t length)
+    {
+        if (length > kCapacity - m_length)
+            FlushCompleteLines();
+        if (length > kCapacity - m_length)
+            Flush();
+        return &m_buffer[m_length];
+    }
+
+    void FlushCompleteLines();
+};
+
+extern OutputBuffer g_output;
+
+#endif // OUTPUT_BUFFER_H
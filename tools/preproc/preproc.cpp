@@ -18,12 +18,16 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#include <cstring>
 #include <string>
 #include <stack>
 #include "preproc.h"
 #include "asm_file.h"
 #include "c_file.h"
 #include "charmap.h"
+#include "output_buffer.h"
+#include "server.h"
+#include "compile.h"
 
 Charmap* g_charmap;
 
@@ -31,15 +35,9 @@ void PrintAsmBytes(unsigned char *s, int length)
 {
     if (length > 0)
     {
-        std::printf("\t.byte ");
-        for (int i = 0; i < length; i++)
-        {
-            std::printf("0x%02X", s[i]);
-
-            if (i < length - 1)
-                std::printf(", ");
-        }
-        std::putchar('\n');
+        g_output.Write("\t.byte ");
+        g_output.WriteHexBytes(s, length, ", ", false);
+        g_output.Put('\n');
     }
 }
 
@@ -89,8 +87,10 @@ void PreprocAsmFile(std::string filename)
 
             if (globalLabel.length() != 0)
             {
-                const char *s = globalLabel.c_str();
-                std::printf("%s: ; .global %s\n", s, s);
+                g_output.Write(globalLabel);
+                g_output.Write(": ; .global ");
+                g_output.Write(globalLabel);
+                g_output.Put('\n');
             }
             else
             {
@@ -103,9 +103,9 @@ void PreprocAsmFile(std::string filename)
     }
 }
 
-void PreprocCFile(const char * filename, bool isStdin)
+void PreprocCFile(const char * filename, bool isStdin, bool incbinToAsm)
 {
-    CFile cFile(filename, isStdin);
+    CFile cFile(filename, isStdin, incbinToAsm);
     cFile.Preproc();
 }
 
@@ -130,15 +130,22 @@ char* GetFileExtension(char* filename)
     return extension;
 }
 
-int main(int argc, char **argv)
+int RunPreproc(int argc, char **argv)
 {
-    if (argc < 3 || argc > 4)
+    if (argc < 3 || argc > 5)
     {
-        std::fprintf(stderr, "Usage: %s SRC_FILE CHARMAP_FILE [-i]\nwhere -i denotes if input is from stdin\n", argv[0]);
+        std::fprintf(stderr, "Usage: %s SRC_FILE CHARMAP_FILE [-i] [--incbin-asm]\n"
+                             "       %s --client SOCKET SRC_FILE CHARMAP_FILE [-i] [--incbin-asm]\n"
+                             "       %s --server SOCKET CHARMAP_FILE [IDLE_SECONDS]\n"
+                             "       %s --compile [--timings] [--incbin-asm] [--client SOCKET] SRC_FILE CHARMAP_FILE --cpp CPP... --cc1 CC1... --as AS...\n"
+                             "where -i denotes if input is from stdin\n"
+                             "and --incbin-asm turns INCBIN array definitions into .incbin directives\n", argv[0], argv[0], argv[0], argv[0]);
         return 1;
     }
 
-    g_charmap = new Charmap(argv[2]);
+    // A server process may already have loaded it.
+    if (g_charmap == nullptr)
+        g_charmap = new Charmap(argv[2]);
 
     char* extension = GetFileExtension(argv[1]);
 
@@ -148,17 +155,43 @@ int main(int argc, char **argv)
     if ((extension[0] == 's') && extension[1] == 0)
         PreprocAsmFile(argv[1]);
     else if ((extension[0] == 'c' || extension[0] == 'i') && extension[1] == 0) {
-        if (argc == 4) {
-            if (argv[3][0] == '-' && argv[3][1] == 'i' && argv[3][2] == '\0') {
-                PreprocCFile(argv[1], true);
+        bool isStdin = false;
+        bool incbinToAsm = false;
+
+        for (int i = 3; i < argc; i++) {
+            if (std::strcmp(argv[i], "-i") == 0) {
+                isStdin = true;
+            } else if (std::strcmp(argv[i], "--incbin-asm") == 0) {
+                incbinToAsm = true;
             } else {
-                FATAL_ERROR("unknown argument flag \"%s\".\n", argv[3]);
+                FATAL_ERROR("unknown argument flag \"%s\".\n", argv[i]);
             }
-        } else {
-            PreprocCFile(argv[1], false);
         }
+
+        PreprocCFile(argv[1], isStdin, incbinToAsm);
     } else
         FATAL_ERROR("\"%s\" has an unknown file extension of \"%s\".\n", argv[1], extension);
 
     return 0;
 }
+
+int main(int argc, char **argv)
+{
+    if (argc >= 4 && argc <= 5 && std::strcmp(argv[1], "--server") == 0)
+        return RunServer(argv[0], argv[2], argv[3], argc == 5 ? std::atoi(argv[4]) : kServerIdleSeconds);
+
+    if (argc >= 3 && std::strcmp(argv[1], "--client") == 0)
+    {
+        std::string socketPath(argv[2]);
+        argv[2] = argv[0];
+        return RunClient(socketPath, argc - 2, argv + 2);
+    }
+
+    if (argc >= 2 && std::strcmp(argv[1], "--compile") == 0)
+    {
+        argv[1] = argv[0];
+        return RunCompile(argc - 1, argv + 1);
+    }
+
+    return RunPreproc(argc, argv);
+}
@@ -0,0 +1,482 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "preproc.h"
+#include "server.h"
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Protocol: the client sends a 4-byte payload length along with its stdin,
+// stdout and stderr descriptors, then the payload, which is the identity of
+// its preproc binary, its working directory and its arguments, each
+// NUL-terminated. The job's output goes straight to the passed descriptors.
+// When the job finishes, the server replies with the 4-byte exit code.
+//
+// A server started by a preproc binary that has since been rebuilt would
+// preprocess the old way, so if the client's binary isn't the server's, the
+// server replies with kStaleServer without running the job, and shuts down.
+
+const std::int32_t kStaleServer = -1;
+
+// Set when a connection handler finds that the server is stale.
+static volatile sig_atomic_t s_stale;
+
+struct FileId
+{
+    std::string path;
+    long long mtime;
+    long long size;
+
+    bool operator==(const FileId& other) const
+    {
+        return path == other.path && mtime == other.mtime && size == other.size;
+    }
+};
+
+static bool GetFileId(const char *path, FileId& id)
+{
+    char resolvedPath[PATH_MAX];
+    struct stat st;
+
+    if (realpath(path, resolvedPath) == nullptr || stat(resolvedPath, &st) != 0)
+        return false;
+
+    id.path = resolvedPath;
+#ifdef __APPLE__
+    id.mtime = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    id.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    id.size = st.st_size;
+    return true;
+}
+
+// Identifies the running preproc binary by its path, size and mtime.
+static bool GetProgramId(const char *programPath, std::string& id)
+{
+    FileId fileId;
+    bool found = false;
+
+#ifdef __linux__
+    found = GetFileId("/proc/self/exe", fileId);
+#endif
+
+    if (!found && (std::strchr(programPath, '/') == nullptr || !GetFileId(programPath, fileId)))
+        return false;
+
+    id = std::to_string(fileId.size) + " " + std::to_string(fileId.mtime) + " " + fileId.path;
+    return true;
+}
+
+static bool MakeSocketAddress(const std::string& socketPath, sockaddr_un& addr)
+{
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (socketPath.size() >= sizeof(addr.sun_path))
+        return false;
+
+    std::memcpy(addr.sun_path, socketPath.c_str(), socketPath.size());
+    return true;
+}
+
+static bool ReadFully(int fd, void *buffer, std::size_t size)
+{
+    char *p = static_cast<char *>(buffer);
+
+    while (size > 0)
+    {
+        ssize_t count = read(fd, p, size);
+
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+
+        p += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+static bool WriteFully(int fd, const void *buffer, std::size_t size)
+{
+    const char *p = static_cast<const char *>(buffer);
+
+    while (size > 0)
+    {
+        ssize_t count = write(fd, p, size);
+
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+
+        p += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+static int HandleConnection(int conn, const std::string& programId, const FileId& charmapId)
+{
+    std::uint32_t length;
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    iovec iov = { &length, sizeof(length) };
+    msghdr msg = {};
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(conn, &msg, MSG_WAITALL) != sizeof(length))
+        return 1;
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        return 1;
+
+    std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    std::vector<char> payload(length);
+
+    if (length == 0 || !ReadFully(conn, payload.data(), length) || payload.back() != 0)
+        return 1;
+
+    std::vector<char *> args;
+
+    for (std::uint32_t i = std::strlen(&payload[0]) + 1; i < length; i += std::strlen(&payload[i]) + 1)
+        args.push_back(&payload[i]);
+
+    if (args.empty() || programId != &payload[0])
+    {
+        for (int i = 0; i < 3; i++)
+            close(fds[i]);
+
+        kill(getppid(), SIGUSR1);
+        WriteFully(conn, &kStaleServer, sizeof(kStaleServer));
+        return 0;
+    }
+
+    pid_t worker = fork();
+
+    if (worker == 0)
+    {
+        std::signal(SIGPIPE, SIG_DFL);
+
+        for (int i = 0; i < 3; i++)
+        {
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+        close(conn);
+
+        if (chdir(args[0]) != 0)
+            FATAL_ERROR("Failed to change directory to \"%s\".\n", args[0]);
+
+        // args[0] now stands in for the program name.
+        FileId requestedId;
+        if (args.size() >= 3 && (!GetFileId(args[2], requestedId) || !(requestedId == charmapId)))
+            g_charmap = nullptr;
+
+        std::exit(RunPreproc(args.size(), args.data()));
+    }
+
+    for (int i = 0; i < 3; i++)
+        close(fds[i]);
+
+    std::int32_t exitCode = 1;
+    int status;
+
+    if (worker > 0 && waitpid(worker, &status, 0) == worker)
+    {
+        if (WIFEXITED(status))
+            exitCode = WEXITSTATUS(status);
+        else if (WIFSIGNALED(status))
+            exitCode = 128 + WTERMSIG(status);
+    }
+
+    WriteFully(conn, &exitCode, sizeof(exitCode));
+    return 0;
+}
+
+static void ServeConnection(int listenFd, int conn, const std::string& programId, const FileId& charmapId)
+{
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        close(listenFd);
+        std::signal(SIGCHLD, SIG_DFL);
+        std::signal(SIGUSR1, SIG_DFL);
+        _exit(HandleConnection(conn, programId, charmapId));
+    }
+
+    close(conn);
+}
+
+static void OnStale(int)
+{
+    s_stale = 1;
+}
+
+// Binds listenFd to socketPath, replacing a socket left behind by a server
+// that died. Returns false if a live server already has it. Servers starting
+// at the same time take turns, so one can't unlink the socket that another
+// just bound.
+static bool BindSocket(int listenFd, const std::string& socketPath, const sockaddr_un& addr)
+{
+    std::string lockPath = socketPath + ".lock";
+    int lockFd = open(lockPath.c_str(), O_RDWR | O_CREAT, 0666);
+
+    if (lockFd < 0)
+        FATAL_ERROR("Failed to open \"%s\". (error: %s)\n", lockPath.c_str(), std::strerror(errno));
+
+    while (flock(lockFd, LOCK_EX) != 0)
+        if (errno != EINTR)
+            FATAL_ERROR("Failed to lock \"%s\". (error: %s)\n", lockPath.c_str(), std::strerror(errno));
+
+    bool bound = true;
+
+    if (bind(listenFd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        if (errno != EADDRINUSE)
+            FATAL_ERROR("Failed to bind \"%s\". (error: %s)\n", socketPath.c_str(), std::strerror(errno));
+
+        int probeFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool alive = connect(probeFd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == 0;
+        close(probeFd);
+
+        if (alive)
+        {
+            bound = false;
+        }
+        else
+        {
+            unlink(socketPath.c_str());
+
+            if (bind(listenFd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0)
+                FATAL_ERROR("Failed to bind \"%s\". (error: %s)\n", socketPath.c_str(), std::strerror(errno));
+        }
+    }
+
+    // Closing the lock file releases the lock. The file itself stays, since
+    // another server may already be waiting on it.
+    close(lockFd);
+    return bound;
+}
+
+int RunServer(const char *programPath, const std::string& socketPath, const std::string& charmapPath, int idleSeconds)
+{
+    sockaddr_un addr;
+
+    if (!MakeSocketAddress(socketPath, addr))
+        FATAL_ERROR("Socket path \"%s\" is too long.\n", socketPath.c_str());
+
+    std::string programId;
+
+    if (!GetProgramId(programPath, programId))
+        FATAL_ERROR("Failed to find the preproc binary \"%s\".\n", programPath);
+
+    FileId charmapId;
+
+    if (!GetFileId(charmapPath.c_str(), charmapId))
+        FATAL_ERROR("Failed to open \"%s\" for reading.\n", charmapPath.c_str());
+
+    g_charmap = new Charmap(charmapPath);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (listenFd < 0)
+        FATAL_ERROR("Failed to create socket.\n");
+
+    // Leave a live server alone.
+    if (!BindSocket(listenFd, socketPath, addr))
+        return 0;
+
+    if (listen(listenFd, 64) != 0)
+        FATAL_ERROR("Failed to listen on \"%s\".\n", socketPath.c_str());
+
+    // Connection handlers are reaped automatically.
+    std::signal(SIGCHLD, SIG_IGN);
+    std::signal(SIGPIPE, SIG_IGN);
+    std::signal(SIGUSR1, OnStale);
+
+    while (!s_stale)
+    {
+        pollfd pfd = { listenFd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, idleSeconds * 1000);
+
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0)
+            break;
+
+        int conn = accept(listenFd, nullptr, nullptr);
+
+        if (conn >= 0)
+            ServeConnection(listenFd, conn, programId, charmapId);
+    }
+
+    // Once the socket is unlinked no new client can find it, but some may
+    // already be queued.
+    unlink(socketPath.c_str());
+
+    pollfd pfd = { listenFd, POLLIN, 0 };
+
+    while (poll(&pfd, 1, 0) > 0)
+    {
+        int conn = accept(listenFd, nullptr, nullptr);
+
+        if (conn < 0)
+            break;
+
+        ServeConnection(listenFd, conn, programId, charmapId);
+    }
+
+    close(listenFd);
+    return 0;
+}
+
+// Starts a detached server so that later jobs can use it.
+static void SpawnServer(const char *programPath, const std::string& socketPath, const char *charmapPath)
+{
+    pid_t pid = fork();
+
+    if (pid != 0)
+        return;
+
+    setsid();
+
+    // Don't hold on to the client's pipes, or whoever reads them would wait
+    // for the server to exit.
+    int nullFd = open("/dev/null", O_RDWR);
+
+    for (int i = 0; i < 3; i++)
+        dup2(nullFd, i);
+    close(nullFd);
+
+    // Nor on to anything else the client has open, such as the compile
+    // driver's own stdout, which it keeps while a stage has the real one.
+    long maxFd = sysconf(_SC_OPEN_MAX);
+
+    for (int i = 3; i < maxFd && i < 1024; i++)
+        close(i);
+
+    _exit(RunServer(programPath, socketPath, charmapPath, kServerIdleSeconds));
+}
+
+int RunClient(const std::string& socketPath, int argc, char **argv)
+{
+    std::string programId;
+
+    // Without a way to tell which server matches this binary, use none.
+    if (!GetProgramId(argv[0], programId))
+        return RunPreproc(argc, argv);
+
+    sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0 || !MakeSocketAddress(socketPath, addr)
+     || connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        if (argc >= 3)
+            SpawnServer(argv[0], socketPath, argv[2]);
+        return RunPreproc(argc, argv);
+    }
+
+    char cwd[PATH_MAX];
+
+    if (getcwd(cwd, sizeof(cwd)) == nullptr)
+        FATAL_ERROR("Failed to get the current directory.\n");
+
+    std::string payload(programId);
+    payload += '\0';
+    payload += cwd;
+    payload += '\0';
+
+    for (int i = 1; i < argc; i++)
+    {
+        payload += argv[i];
+        payload += '\0';
+    }
+
+    std::uint32_t length = payload.size();
+    int fds[3] = { 0, 1, 2 };
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+    iovec iov = { &length, sizeof(length) };
+    msghdr msg = {};
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // Nothing has run yet if the request can't be sent, so it's still safe
+    // to do the job here instead.
+    std::signal(SIGPIPE, SIG_IGN);
+    bool sent = sendmsg(fd, &msg, 0) == sizeof(length) && WriteFully(fd, payload.data(), payload.size());
+    std::signal(SIGPIPE, SIG_DFL);
+
+    if (!sent)
+    {
+        close(fd);
+        return RunPreproc(argc, argv);
+    }
+
+    std::int32_t exitCode;
+
+    if (!ReadFully(fd, &exitCode, sizeof(exitCode)))
+        FATAL_ERROR("Lost connection to the preproc server at \"%s\".\n", socketPath.c_str());
+
+    close(fd);
+
+    // The server is shutting down without having run the job. A later job
+    // starts a server from this binary.
+    if (exitCode == kStaleServer)
+        return RunPreproc(argc, argv);
+
+    return exitCode;
+}
+
+#else
+
+int RunServer(const char *programPath, const std::string& socketPath, const std::string& charmapPath, int idleSeconds)
+{
+    FATAL_ERROR("The preproc server isn't supported on this platform.\n");
+}
+
+int RunClient(const std::string& socketPath, int argc, char **argv)
+{
+    return RunPreproc(argc, argv);
+}
+
+#endif // _WIN32
@@ -0,0 +1,22 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+
+const int kServerIdleSeconds = 30;
+
+// Runs one preprocessing job with the given command line. Returns the exit
+// code.
+int RunPreproc(int argc, char **argv);
+
+// Keeps the charmap loaded and serves jobs from RunClient over a Unix socket
+// until no job has arrived for idleSeconds, or until a job comes from a
+// preproc binary other than programPath.
+int RunServer(const char *programPath, const std::string& socketPath, const std::string& charmapPath, int idleSeconds);
+
+// Hands a job to the server listening on socketPath, passing along this
+// process's stdin, stdout and stderr. If no server is listening, starts one
+// for later jobs and runs this job in this process.
+int RunClient(const std::string& socketPath, int argc, char **argv);
+
+#endif // SERVER_H
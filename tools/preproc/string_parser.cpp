@@ -20,6 +20,7 @@
 
 #include <cstdio>
 #include <cstdarg>
+#include <cstring>
 #include <stdexcept>
 #include "preproc.h"
 #include "string_parser.h"
@@ -27,9 +28,9 @@
 #include "utf8.h"
 
 // Reads a charmap char or escape sequence.
-std::string StringParser::ReadCharOrEscape()
+CharmapSequence StringParser::ReadCharOrEscape()
 {
-    std::string sequence;
+    CharmapSequence sequence;
 
     bool isEscape = (m_buffer[m_pos] == '\\');
 
@@ -41,7 +42,7 @@ std::string StringParser::ReadCharOrEscape()
         {
             sequence = g_charmap->Char('"');
 
-            if (sequence.length() == 0)
+            if (sequence.length == 0)
                 RaiseError("no mapping exists for double quote");
 
             return sequence;
@@ -50,7 +51,7 @@ std::string StringParser::ReadCharOrEscape()
         {
             sequence = g_charmap->Char('\\');
 
-            if (sequence.length() == 0)
+            if (sequence.length == 0)
                 RaiseError("no mapping exists for backslash");
 
             return sequence;
@@ -82,7 +83,7 @@ std::string StringParser::ReadCharOrEscape()
 
     sequence = isEscape ? g_charmap->Escape(code) : g_charmap->Char(code);
 
-    if (sequence.length() == 0)
+    if (sequence.length == 0)
     {
         if (isEscape)
             RaiseError("unknown escape '\\%c'", code);
@@ -94,10 +95,8 @@ std::string StringParser::ReadCharOrEscape()
 }
 
 // Reads a charmap constant, i.e. "{FOO}".
-std::string StringParser::ReadBracketedConstants()
+void StringParser::ReadBracketedConstants()
 {
-    std::string totalSequence;
-
     m_pos++; // Assume we're on the left curly bracket.
 
     while (m_buffer[m_pos] != '}')
@@ -113,15 +112,15 @@ std::string StringParser::ReadBracketedConstants()
             while (IsIdentifierChar(m_buffer[m_pos]))
                 m_pos++;
 
-            std::string sequence = g_charmap->Constant(std::string(&m_buffer[startPos], m_pos - startPos));
+            CharmapSequence sequence = g_charmap->Constant(&m_buffer[startPos], m_pos - startPos);
 
-            if (sequence.length() == 0)
+            if (sequence.length == 0)
             {
                 m_buffer[m_pos] = 0;
                 RaiseError("unknown constant '%s'", &m_buffer[startPos]);
             }
 
-            totalSequence += sequence;
+            Append(sequence.data, sequence.length);
         }
         else if (IsAsciiDigit(m_buffer[m_pos]))
         {
@@ -130,17 +129,17 @@ std::string StringParser::ReadBracketedConstants()
             switch (integer.size)
             {
             case 1:
-                totalSequence += (unsigned char)integer.value;
+                AppendByte(integer.value);
                 break;
             case 2:
-                totalSequence += (unsigned char)integer.value;
-                totalSequence += (unsigned char)(integer.value >> 8);
+                AppendByte(integer.value);
+                AppendByte(integer.value >> 8);
                 break;
             case 4:
-                totalSequence += (unsigned char)integer.value;
-                totalSequence += (unsigned char)(integer.value >> 8);
-                totalSequence += (unsigned char)(integer.value >> 16);
-                totalSequence += (unsigned char)(integer.value >> 24);
+                AppendByte(integer.value);
+                AppendByte(integer.value >> 8);
+                AppendByte(integer.value >> 16);
+                AppendByte(integer.value >> 24);
                 break;
             }
         }
@@ -161,8 +160,6 @@ std::string StringParser::ReadBracketedConstants()
     }
 
     m_pos++; // Go past the right curly bracket.
-
-    return totalSequence;
 }
 
 // Reads a charmap string.
@@ -177,26 +174,46 @@ int StringParser::ParseString(long srcPos, unsigned char* dest, int& destLength)
 
     m_pos++;
 
-    destLength = 0;
+    m_dest = dest;
+    m_destLength = 0;
 
     while (m_buffer[m_pos] != '"')
     {
-        std::string sequence = (m_buffer[m_pos] == '{') ? ReadBracketedConstants() : ReadCharOrEscape();
-
-        for (const char& c : sequence)
+        if (m_buffer[m_pos] == '{')
         {
-            if (destLength == kMaxStringLength)
-                RaiseError("mapped string longer than %d bytes", kMaxStringLength);
-
-            dest[destLength++] = c;
+            ReadBracketedConstants();
+        }
+        else
+        {
+            CharmapSequence sequence = ReadCharOrEscape();
+            Append(sequence.data, sequence.length);
         }
     }
 
     m_pos++; // Go past the right quote.
 
+    destLength = m_destLength;
+
     return m_pos - start;
 }
 
+void StringParser::Append(const char* s, std::size_t length)
+{
+    if (length > static_cast<std::size_t>(kMaxStringLength - m_destLength))
+        RaiseError("mapped string longer than %d bytes", kMaxStringLength);
+
+    std::memcpy(&m_dest[m_destLength], s, length);
+    m_destLength += length;
+}
+
+void StringParser::AppendByte(unsigned char c)
+{
+    if (m_destLength == kMaxStringLength)
+        RaiseError("mapped string longer than %d bytes", kMaxStringLength);
+
+    m_dest[m_destLength++] = c;
+}
+
 void StringParser::RaiseError(const char* format, ...)
 {
     const int bufferSize = 1024;
@@ -1,236 +1,281 @@
 #include <cstdio>
 #include <cstring>
 #include <cstdint>
+#include <cstdlib>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
 #include "ramscrgen.h"
 #include "elf.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define SHN_COMMON 0xFFF2
 
-static std::string s_elfPath;
-static std::string s_archiveFilePath;
-static std::string s_archiveObjectPath;
+// A whole file, mapped into memory where possible.
+class MappedFile
+{
+public:
+    MappedFile(const std::string& path);
+    MappedFile(const MappedFile&) = delete;
+    ~MappedFile();
+
+    const unsigned char *Data() const { return m_data; }
+    std::size_t Size() const { return m_size; }
+
+private:
+    const unsigned char *m_data;
+    std::size_t m_size;
+    std::vector<unsigned char> m_buffer;
+};
 
-static FILE *s_file;
+MappedFile::MappedFile(const std::string& path) : m_data(nullptr), m_size(0)
+{
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
 
-static std::uint32_t s_sectionHeaderOffset;
-static int s_sectionHeaderEntrySize;
-static int s_sectionCount;
-static int s_shstrtabIndex;
+    if (fd < 0)
+        FATAL_ERROR("error: failed to open \"%s\" for reading\n", path.c_str());
 
-static std::uint32_t s_symtabOffset;
-static std::uint32_t s_strtabOffset;
+    struct stat st;
 
-static std::uint32_t s_symbolCount;
-static std::uint32_t s_elfFileOffset;
+    if (fstat(fd, &st) != 0)
+        FATAL_ERROR("error: failed to read \"%s\"\n", path.c_str());
 
-struct Symbol
-{
-    std::uint32_t nameOffset;
-    std::uint32_t size;
-};
+    m_size = st.st_size;
 
-static void Seek(long offset)
-{
-    if (std::fseek(s_file, s_elfFileOffset + offset, SEEK_SET) != 0)
-        FATAL_ERROR("error: failed to seek to %ld in \"%s\"", offset, s_elfPath.c_str());
+    if (m_size != 0)
+    {
+        void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data == MAP_FAILED)
+            FATAL_ERROR("error: failed to read \"%s\"\n", path.c_str());
+
+        m_data = static_cast<const unsigned char *>(data);
+    }
+
+    close(fd);
+#else
+    FILE *fp = std::fopen(path.c_str(), "rb");
+
+    if (fp == nullptr)
+        FATAL_ERROR("error: failed to open \"%s\" for reading\n", path.c_str());
+
+    std::fseek(fp, 0, SEEK_END);
+    m_buffer.resize(std::ftell(fp));
+    std::rewind(fp);
+
+    if (m_buffer.size() != 0 && std::fread(m_buffer.data(), m_buffer.size(), 1, fp) != 1)
+        FATAL_ERROR("error: failed to read \"%s\"\n", path.c_str());
+
+    std::fclose(fp);
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+#endif
 }
 
-static void Skip(long offset)
+MappedFile::~MappedFile()
 {
-    if (std::fseek(s_file, offset, SEEK_CUR) != 0)
-        FATAL_ERROR("error: failed to skip %ld bytes in \"%s\"", offset, s_elfPath.c_str());
+#ifndef _WIN32
+    if (m_data != nullptr)
+        munmap(const_cast<unsigned char *>(m_data), m_size);
+#endif
 }
 
-static std::uint32_t ReadInt8()
+// An archive and where each of its members starts and ends.
+struct Archive
 {
-    int c = std::fgetc(s_file);
+    std::unique_ptr<MappedFile> file;
+    std::map<std::string, std::pair<std::size_t, std::size_t>> members;
+};
 
-    if (c < 0)
-        FATAL_ERROR("error: unexpected EOF when reading ELF file \"%s\"\n", s_elfPath.c_str());
+// Archives are indexed the first time one of their members is needed, and
+// shared by all threads after that.
+static std::map<std::string, std::unique_ptr<Archive>> s_archives;
+static std::mutex s_archivesMutex;
+
+// An ELF file, which is either a whole file or a member of an archive.
+struct ElfFile
+{
+    std::string path;
+    const unsigned char *data;
+    std::size_t size;
+};
 
-    return c;
+static void CheckBounds(const ElfFile& elf, std::uint32_t offset, std::uint32_t length)
+{
+    if (offset > elf.size || length > elf.size - offset)
+        FATAL_ERROR("error: unexpected EOF when reading ELF file \"%s\"\n", elf.path.c_str());
 }
 
-static std::uint32_t ReadInt16()
+static std::uint32_t ReadInt16(const ElfFile& elf, std::uint32_t offset)
 {
-    std::uint32_t val = 0;
-    val |= ReadInt8();
-    val |= ReadInt8() << 8;
-    return val;
+    CheckBounds(elf, offset, 2);
+    const unsigned char *p = elf.data + offset;
+    return p[0] | (p[1] << 8);
 }
 
-static std::uint32_t ReadInt32()
+static std::uint32_t ReadInt32(const ElfFile& elf, std::uint32_t offset)
 {
-    std::uint32_t val = 0;
-    val |= ReadInt8();
-    val |= ReadInt8() << 8;
-    val |= ReadInt8() << 16;
-    val |= ReadInt8() << 24;
-    return val;
+    CheckBounds(elf, offset, 4);
+    const unsigned char *p = elf.data + offset;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<std::uint32_t>(p[3]) << 24);
 }
 
-static std::string ReadString()
+static const char *ReadString(const ElfFile& elf, std::uint32_t offset)
 {
-    std::string s;
-    char c;
+    CheckBounds(elf, offset, 1);
+    const void *end = std::memchr(elf.data + offset, 0, elf.size - offset);
 
-    while ((c = ReadInt8()) != 0)
-        s += c;
+    if (end == nullptr)
+        FATAL_ERROR("error: unexpected EOF when reading ELF file \"%s\"\n", elf.path.c_str());
 
-    return s;
+    return reinterpret_cast<const char *>(elf.data + offset);
 }
 
-static void VerifyElfIdent()
+static void VerifyElfIdent(const ElfFile& elf)
 {
     char expectedMagic[4] = { 0x7F, 'E', 'L', 'F' };
-    char magic[4];
 
-    if (std::fread(magic, 4, 1, s_file) != 1)
-        FATAL_ERROR("error: failed to read ELF magic from \"%s\"\n", s_elfPath.c_str());
+    if (elf.size < 6)
+        FATAL_ERROR("error: failed to read ELF magic from \"%s\"\n", elf.path.c_str());
 
-    if (std::memcmp(magic, expectedMagic, 4) != 0)
-        FATAL_ERROR("error: ELF magic did not match in \"%s\"\n", s_elfPath.c_str());
+    if (std::memcmp(elf.data, expectedMagic, 4) != 0)
+        FATAL_ERROR("error: ELF magic did not match in \"%s\"\n", elf.path.c_str());
 
-    if (std::fgetc(s_file) != 1)
-        FATAL_ERROR("error: \"%s\" not 32-bit ELF\n", s_elfPath.c_str());
+    if (elf.data[4] != 1)
+        FATAL_ERROR("error: \"%s\" not 32-bit ELF\n", elf.path.c_str());
 
-    if (std::fgetc(s_file) != 1)
-        FATAL_ERROR("error: \"%s\" not little-endian ELF\n", s_elfPath.c_str());
+    if (elf.data[5] != 1)
+        FATAL_ERROR("error: \"%s\" not little-endian ELF\n", elf.path.c_str());
 }
 
-static void VerifyAr()
+// Indexes every member of the archive in one pass. If two members have the
+// same name, the first one is used.
+static std::unique_ptr<Archive> ReadArchive(const std::string& archiveFilePath)
 {
     char expectedMagic[8] = {'!', '<', 'a', 'r', 'c', 'h', '>', '\n'};
-    char magic[8];
+    char expectedEndMagic[2] = { 0x60, 0x0a };
+    std::unique_ptr<Archive> archive(new Archive);
 
-    if (std::fread(magic, 8, 1, s_file) != 1)
-        FATAL_ERROR("error: failed to read AR magic from \"%s\"\n", s_archiveFilePath.c_str());
+    archive->file.reset(new MappedFile(archiveFilePath));
 
-    if (std::memcmp(magic, expectedMagic, 8) != 0)
-        FATAL_ERROR("error: AR magic did not match in \"%s\"\n", s_archiveFilePath.c_str());
-}
+    const char *data = reinterpret_cast<const char *>(archive->file->Data());
+    std::size_t size = archive->file->Size();
 
-static void ReadElfHeader()
-{
-    Seek(0x20);
-    s_sectionHeaderOffset = ReadInt32();
-    Seek(0x2E);
-    s_sectionHeaderEntrySize = ReadInt16();
-    s_sectionCount = ReadInt16();
-    s_shstrtabIndex = ReadInt16();
-}
+    if (size < 8)
+        FATAL_ERROR("error: failed to read AR magic from \"%s\"\n", archiveFilePath.c_str());
 
-static void FindArObj()
-{
-    char file_ident[17] = {0};
-    char filesize_s[11] = {0};
-    char expectedEndMagic[2] = { 0x60, 0x0a };
-    char end_magic[2];
-    std::size_t filesize;
-
-    Seek(8);
-    while (!std::feof(s_file)) {
-        if (std::fread(file_ident, 16, 1, s_file) != 1)
-            FATAL_ERROR("error: failed to read file ident in \"%s\"\n", s_archiveFilePath.c_str());
-        Skip(32);
-        if (std::fread(filesize_s, 10, 1, s_file) != 1)
-            FATAL_ERROR("error: failed to read filesize in \"%s\"\n", s_archiveFilePath.c_str());
-        if (std::fread(end_magic, 2, 1, s_file) != 1)
-            FATAL_ERROR("error: failed to read end sentinel in \"%s\"\n", s_archiveFilePath.c_str());
-        if (std::memcmp(end_magic, expectedEndMagic, 2) != 0)
-            FATAL_ERROR("error: corrupted archive header in \"%s\" at \"%s\"\n", s_archiveFilePath.c_str(), file_ident);
-
-        char * ptr = std::strchr(file_ident, '/');
-        if (ptr != nullptr)
-            *ptr = 0;
-        filesize = std::strtoul(filesize_s, nullptr, 10);
-        if (std::strncmp(s_archiveObjectPath.c_str(), file_ident, 16) == 0) {
-            s_elfFileOffset = std::ftell(s_file);
-            return;
-        }
-        Skip(filesize);
+    if (std::memcmp(data, expectedMagic, 8) != 0)
+        FATAL_ERROR("error: AR magic did not match in \"%s\"\n", archiveFilePath.c_str());
+
+    std::size_t pos = 8;
+
+    while (pos < size)
+    {
+        if (size - pos < 60)
+            FATAL_ERROR("error: failed to read file ident in \"%s\"\n", archiveFilePath.c_str());
+
+        char fileIdent[17] = {0};
+        char fileSizeString[11] = {0};
+
+        std::memcpy(fileIdent, data + pos, 16);
+        std::memcpy(fileSizeString, data + pos + 48, 10);
+
+        if (std::memcmp(data + pos + 58, expectedEndMagic, 2) != 0)
+            FATAL_ERROR("error: corrupted archive header in \"%s\" at \"%s\"\n", archiveFilePath.c_str(), fileIdent);
+
+        char *slash = std::strchr(fileIdent, '/');
+        if (slash != nullptr)
+            *slash = 0;
+
+        std::size_t start = pos + 60;
+        std::size_t fileSize = std::strtoul(fileSizeString, nullptr, 10);
+
+        if (fileSize > size - start)
+            FATAL_ERROR("error: member \"%s\" runs past the end of \"%s\"\n", fileIdent, archiveFilePath.c_str());
+
+        archive->members.emplace(fileIdent, std::make_pair(start, fileSize));
+
+        // Members are padded to an even offset.
+        pos = start + fileSize + (fileSize & 1);
     }
 
-    FATAL_ERROR("error: could not find object \"%s\" in archive \"%s\"\n", s_archiveObjectPath.c_str(), s_archiveFilePath.c_str());
+    return archive;
 }
 
-static std::string GetSectionName(std::uint32_t shstrtabOffset, int index)
+static ElfFile FindArObj(const std::string& archiveFilePath, const std::string& archiveObjectPath, const std::string& elfPath)
 {
-    Seek(s_sectionHeaderOffset + s_sectionHeaderEntrySize * index);
-    std::uint32_t nameOffset = ReadInt32();
-    Seek(shstrtabOffset + nameOffset);
-    return ReadString();
+    std::lock_guard<std::mutex> lock(s_archivesMutex);
+    std::unique_ptr<Archive>& archive = s_archives[archiveFilePath];
+
+    if (!archive)
+        archive = ReadArchive(archiveFilePath);
+
+    // Member names are at most 16 characters.
+    auto member = archive->members.find(archiveObjectPath.substr(0, 16));
+
+    if (member == archive->members.end())
+        FATAL_ERROR("error: could not find object \"%s\" in archive \"%s\"\n", archiveObjectPath.c_str(), archiveFilePath.c_str());
+
+    return ElfFile{ elfPath, archive->file->Data() + member->second.first, member->second.second };
 }
 
-static void FindTableOffsets()
+static std::map<std::string, std::uint32_t> GetCommonSymbols_Shared(const ElfFile& elf)
 {
-    s_symtabOffset = 0;
-    s_strtabOffset = 0;
+    VerifyElfIdent(elf);
 
-    Seek(s_sectionHeaderOffset + s_sectionHeaderEntrySize * s_shstrtabIndex + 0x10);
-    std::uint32_t shstrtabOffset = ReadInt32();
+    std::uint32_t sectionHeaderOffset = ReadInt32(elf, 0x20);
+    std::uint32_t sectionHeaderEntrySize = ReadInt16(elf, 0x2E);
+    std::uint32_t sectionCount = ReadInt16(elf, 0x30);
+    std::uint32_t shstrtabIndex = ReadInt16(elf, 0x32);
 
-    for (int i = 0; i < s_sectionCount; i++)
+    std::uint32_t shstrtabOffset = ReadInt32(elf, sectionHeaderOffset + sectionHeaderEntrySize * shstrtabIndex + 0x10);
+    std::uint32_t symtabOffset = 0;
+    std::uint32_t symbolCount = 0;
+    std::uint32_t strtabOffset = 0;
+
+    for (std::uint32_t i = 0; i < sectionCount; i++)
     {
-        std::string name = GetSectionName(shstrtabOffset, i);
+        std::uint32_t header = sectionHeaderOffset + sectionHeaderEntrySize * i;
+        const char *name = ReadString(elf, shstrtabOffset + ReadInt32(elf, header));
 
-        if (name == ".symtab")
+        if (std::strcmp(name, ".symtab") == 0)
         {
-            if (s_symtabOffset)
-                FATAL_ERROR("error: mutiple .symtab sections found in \"%s\"\n", s_elfPath.c_str());
-            Seek(s_sectionHeaderOffset + s_sectionHeaderEntrySize * i + 0x10);
-            s_symtabOffset = ReadInt32();
-            std::uint32_t size = ReadInt32();
-            s_symbolCount = size / 16;
+            if (symtabOffset)
+                FATAL_ERROR("error: mutiple .symtab sections found in \"%s\"\n", elf.path.c_str());
+            symtabOffset = ReadInt32(elf, header + 0x10);
+            symbolCount = ReadInt32(elf, header + 0x14) / 16;
         }
-        else if (name == ".strtab")
+        else if (std::strcmp(name, ".strtab") == 0)
         {
-            if (s_strtabOffset)
-                FATAL_ERROR("error: mutiple .strtab sections found in \"%s\"\n", s_elfPath.c_str());
-            Seek(s_sectionHeaderOffset + s_sectionHeaderEntrySize * i + 0x10);
-            s_strtabOffset = ReadInt32();
+            if (strtabOffset)
+                FATAL_ERROR("error: mutiple .strtab sections found in \"%s\"\n", elf.path.c_str());
+            strtabOffset = ReadInt32(elf, header + 0x10);
         }
     }
 
-    if (!s_symtabOffset)
-        FATAL_ERROR("error: couldn't find .symtab section in \"%s\"\n", s_elfPath.c_str());
+    if (!symtabOffset)
+        FATAL_ERROR("error: couldn't find .symtab section in \"%s\"\n", elf.path.c_str());
 
-    if (!s_strtabOffset)
-        FATAL_ERROR("error: couldn't find .strtab section in \"%s\"\n", s_elfPath.c_str());
-}
-
-static std::map<std::string, std::uint32_t> GetCommonSymbols_Shared()
-{
-    VerifyElfIdent();
-    ReadElfHeader();
-    FindTableOffsets();
+    if (!strtabOffset)
+        FATAL_ERROR("error: couldn't find .strtab section in \"%s\"\n", elf.path.c_str());
 
     std::map<std::string, std::uint32_t> commonSymbols;
 
-    std::vector<Symbol> commonSymbolVec;
-
-    Seek(s_symtabOffset);
-
-    for (std::uint32_t i = 0; i < s_symbolCount; i++)
+    for (std::uint32_t i = 0; i < symbolCount; i++)
     {
-        Symbol sym;
-        sym.nameOffset = ReadInt32();
-        Skip(4);
-        sym.size = ReadInt32();
-        Skip(2);
-        std::uint16_t sectionIndex = ReadInt16();
-        if (sectionIndex == SHN_COMMON)
-            commonSymbolVec.push_back(sym);
-    }
+        std::uint32_t symbol = symtabOffset + i * 16;
 
-    for (const Symbol& sym : commonSymbolVec)
-    {
-        Seek(s_strtabOffset + sym.nameOffset);
-        std::string name = ReadString();
-        commonSymbols[name] = sym.size;
+        if (ReadInt16(elf, symbol + 14) == SHN_COMMON)
+            commonSymbols[ReadString(elf, strtabOffset + ReadInt32(elf, symbol))] = ReadInt32(elf, symbol + 8);
     }
 
     return commonSymbols;
@@ -240,33 +285,21 @@ std::map<std::string, std::uint32_t> GetCommonSymbolsFromLib(std::string sourceP
 {
     std::size_t colonPos = libpath.find(':');
     if (colonPos == std::string::npos)
-        FATAL_ERROR("error: missing colon separator in libfile \"%s\"\n", s_elfPath.c_str());
-
-    s_archiveObjectPath = libpath.substr(colonPos + 1);
-    s_archiveFilePath = sourcePath + "/" + libpath.substr(1, colonPos - 1);
-    s_elfPath = sourcePath + "/" + libpath.substr(1);
+        FATAL_ERROR("error: missing colon separator in libfile \"%s\"\n", libpath.c_str());
 
-    s_file = std::fopen(s_archiveFilePath.c_str(), "rb");
+    std::string archiveObjectPath = libpath.substr(colonPos + 1);
+    std::string archiveFilePath = sourcePath + "/" + libpath.substr(1, colonPos - 1);
+    std::string elfPath = sourcePath + "/" + libpath.substr(1);
 
-    if (s_file == NULL)
-        FATAL_ERROR("error: failed to open \"%s\" for reading\n", s_archiveFilePath.c_str());
-
-    VerifyAr();
-    FindArObj();
-    return GetCommonSymbols_Shared();
+    return GetCommonSymbols_Shared(FindArObj(archiveFilePath, archiveObjectPath, elfPath));
 }
 
 std::map<std::string, std::uint32_t> GetCommonSymbols(std::string sourcePath, std::string path)
 {
-    s_elfFileOffset = 0;
     if (path[0] == '*')
         return GetCommonSymbolsFromLib(sourcePath, path);
 
-    s_elfPath = sourcePath + "/" + path;
-    s_file = std::fopen(s_elfPath.c_str(), "rb");
-
-    if (s_file == NULL)
-        FATAL_ERROR("error: failed to open \"%s\" for reading\n", path.c_str());
+    MappedFile file(sourcePath + "/" + path);
 
-    return GetCommonSymbols_Shared();
+    return GetCommonSymbols_Shared(ElfFile{ sourcePath + "/" + path, file.Data(), file.Size() });
 }
@@ -25,6 +25,9 @@
 #include <map>
 #include <string>
 
+// Returns the size of each common symbol in the object at path, which is
+// either a file under sourcePath or "*lib.a:member.o" for a member of an
+// archive under sourcePath. May be called from several threads at once.
 std::map<std::string, std::uint32_t> GetCommonSymbols(std::string sourcePath, std::string path);
 
 #endif // ELF_H
@@ -20,14 +20,74 @@
 
 #include <cstdio>
 #include <cstring>
+#include <atomic>
+#include <map>
 #include <string>
+#include <thread>
+#include <vector>
 #include "ramscrgen.h"
 #include "sym_file.h"
 #include "elf.h"
 
-void HandleCommonInclude(std::string filename, std::string sourcePath, std::string symOrderPath, std::string lang)
+typedef std::map<std::string, std::map<std::string, std::uint32_t>> CommonSymbolsMap;
+
+// Reads the common symbols of every object that the sym file includes ahead
+// of time, spread over one thread per CPU.
+CommonSymbolsMap ReadAllCommonSymbols(std::string filename, std::string lang, std::string sourcePath, std::string libSourcePath)
+{
+    SymFile symFile(filename);
+    std::vector<std::string> includes;
+
+    while (!symFile.IsAtEnd())
+    {
+        symFile.HandleLangConditional(lang);
+
+        if (symFile.GetDirective() == Directive::Include)
+            includes.push_back(symFile.ReadPath());
+
+        symFile.SkipLine();
+    }
+
+    CommonSymbolsMap allCommonSymbols;
+
+    for (const std::string& incFilename : includes)
+        allCommonSymbols[incFilename];
+
+    std::vector<CommonSymbolsMap::iterator> entries;
+
+    for (auto it = allCommonSymbols.begin(); it != allCommonSymbols.end(); ++it)
+        entries.push_back(it);
+
+    std::atomic<std::size_t> nextEntry(0);
+
+    auto worker = [&]() {
+        for (std::size_t i = nextEntry++; i < entries.size(); i = nextEntry++)
+        {
+            const std::string& incFilename = entries[i]->first;
+            entries[i]->second = GetCommonSymbols(incFilename[0] == '*' ? libSourcePath : sourcePath, incFilename);
+        }
+    };
+
+    std::size_t threadCount = std::thread::hardware_concurrency();
+    if (threadCount == 0)
+        threadCount = 1;
+    if (threadCount > entries.size())
+        threadCount = entries.size();
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < threadCount; i++)
+        threads.emplace_back(worker);
+
+    worker();
+
+    for (auto& thread : threads)
+        thread.join();
+
+    return allCommonSymbols;
+}
+
+void HandleCommonInclude(std::string filename, std::map<std::string, std::uint32_t>& commonSymbols, std::string symOrderPath, std::string lang)
 {
-    auto commonSymbols = GetCommonSymbols(sourcePath, filename);
     std::size_t dotIndex;
 
     if (filename[0] == '*') {
@@ -81,6 +141,11 @@ void HandleCommonInclude(std::string filename, std::string sourcePath, std::stri
 
 void ConvertSymFile(std::string filename, std::string sectionName, std::string lang, bool common, std::string sourcePath, std::string commonSymPath, std::string libSourcePath)
 {
+    CommonSymbolsMap allCommonSymbols;
+
+    if (common)
+        allCommonSymbols = ReadAllCommonSymbols(filename, lang, sourcePath, libSourcePath);
+
     SymFile symFile(filename);
 
     while (!symFile.IsAtEnd())
@@ -97,7 +162,7 @@ void ConvertSymFile(std::string filename, std::string sectionName, std::string l
             symFile.ExpectEmptyRestOfLine();
             printf(". = ALIGN(4);\n");
             if (common)
-                HandleCommonInclude(incFilename, incFilename[0] == '*' ? libSourcePath : sourcePath, commonSymPath, lang);
+                HandleCommonInclude(incFilename, allCommonSymbols[incFilename], commonSymPath, lang);
             else
                 printf("%s(%s);\n", incFilename.c_str(), sectionName.c_str());
             break;
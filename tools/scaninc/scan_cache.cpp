@@ -0,0 +1,263 @@
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <sys/stat.h>
+#include "scan_cache.h"
+#include "source_file.h"
+
+#if defined(__APPLE__)
+#define STAT_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#elif defined(_WIN32)
+#define STAT_MTIME_NSEC(st) 0
+#else
+#define STAT_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+// Bump this whenever the cache file layout changes so stale caches are
+// discarded instead of misread.
+static const char *const CACHE_HEADER = "scaninc cache 2";
+
+// Stamps are kept in nanoseconds where the platform provides them.
+static bool GetStamp(const std::string& path, long long& mtime, long long& size)
+{
+    struct stat st;
+
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+
+    mtime = (long long)st.st_mtime * 1000000000LL + STAT_MTIME_NSEC(st);
+    size = st.st_size;
+    return true;
+}
+
+// 64-bit FNV-1a over the whole file.
+static uint64_t HashFile(const std::string& path)
+{
+    FILE *fp = std::fopen(path.c_str(), "rb");
+
+    if (fp == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for reading.\n", path.c_str());
+
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    unsigned char buffer[65536];
+    std::size_t count;
+
+    while ((count = std::fread(buffer, 1, sizeof(buffer), fp)) > 0)
+    {
+        for (std::size_t i = 0; i < count; i++)
+        {
+            hash ^= buffer[i];
+            hash *= 0x100000001B3ULL;
+        }
+    }
+
+    std::fclose(fp);
+    return hash;
+}
+
+ScanCache::ScanCache()
+{
+    m_startTime = std::time(nullptr);
+    m_dirty = false;
+}
+
+void ScanCache::Load(const std::string& path)
+{
+    std::ifstream in(path);
+
+    if (!in.is_open())
+        return;
+
+    std::string line;
+
+    if (!std::getline(in, line) || line != CACHE_HEADER)
+        return;
+
+    ScanCacheEntry *entry = nullptr;
+
+    while (std::getline(in, line))
+    {
+        if (line.size() < 2 || line[1] != ' ')
+            break;
+
+        if (line[0] == 'f')
+        {
+            long long mtime;
+            long long size;
+            uint64_t hash;
+            int pathPos;
+
+            if (std::sscanf(line.c_str() + 2, "%lld %lld %" SCNx64 " %n", &mtime, &size, &hash, &pathPos) != 3)
+                break;
+
+            entry = &m_entries[line.substr(2 + pathPos)];
+            entry->mtime = mtime;
+            entry->size = size;
+            entry->hash = hash;
+        }
+        else if (line[0] == 'i' && entry != nullptr)
+        {
+            entry->includes.insert(line.substr(2));
+        }
+        else if (line[0] == 'b' && entry != nullptr)
+        {
+            entry->incbins.insert(line.substr(2));
+        }
+        else if (line[0] == 'r')
+        {
+            long long dirMtime;
+            int exists;
+            int pathPos;
+
+            if (std::sscanf(line.c_str() + 2, "%lld %d %n", &dirMtime, &exists, &pathPos) != 2)
+                break;
+
+            m_resolved[line.substr(2 + pathPos)] = ResolvedPath{dirMtime, exists != 0};
+        }
+        else
+        {
+            break;
+        }
+    }
+}
+
+void ScanCache::Save(const std::string& path, bool pruneUnused)
+{
+    // When pruning, only what was looked at in this run is kept, so entries
+    // for deleted or no longer referenced files fall out of the cache.
+    if (pruneUnused && (m_entries.size() != m_checked.size() || m_resolved.size() != m_checkedResolved.size()))
+        m_dirty = true;
+
+    if (!m_dirty)
+        return;
+
+    std::string tempPath = path + ".tmp";
+    FILE *fp = std::fopen(tempPath.c_str(), "wb");
+
+    if (fp == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for writing.\n", tempPath.c_str());
+
+    std::fprintf(fp, "%s\n", CACHE_HEADER);
+
+    for (const auto& pair : m_entries)
+    {
+        const ScanCacheEntry& entry = pair.second;
+
+        if (pruneUnused && m_checked.count(pair.first) == 0)
+            continue;
+
+        std::fprintf(fp, "f %lld %lld %016" PRIx64 " %s\n", entry.mtime, entry.size, entry.hash, pair.first.c_str());
+        for (const std::string& include : entry.includes)
+            std::fprintf(fp, "i %s\n", include.c_str());
+        for (const std::string& incbin : entry.incbins)
+            std::fprintf(fp, "b %s\n", incbin.c_str());
+    }
+
+    for (const auto& pair : pruneUnused ? m_checkedResolved : m_resolved)
+        std::fprintf(fp, "r %lld %d %s\n", pair.second.dirMtime, pair.second.exists ? 1 : 0, pair.first.c_str());
+
+    if (std::fclose(fp) != 0)
+        FATAL_ERROR("Failed to write \"%s\".\n", tempPath.c_str());
+
+    if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        // Windows refuses to rename over an existing file.
+        std::remove(path.c_str());
+        if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+            FATAL_ERROR("Failed to rename \"%s\" to \"%s\".\n", tempPath.c_str(), path.c_str());
+    }
+}
+
+// A stamp taken in the same second the scan started may still change without
+// its value changing, so it can't be trusted on the next run.
+bool ScanCache::IsRacy(long long mtime)
+{
+    return mtime / 1000000000LL >= (long long)m_startTime - 1;
+}
+
+const ScanCacheEntry& ScanCache::Get(const std::string& path)
+{
+    ScanCacheEntry& entry = m_entries[path];
+
+    if (!m_checked.insert(path).second)
+        return entry;
+
+    long long mtime;
+    long long size;
+
+    if (!GetStamp(path, mtime, size))
+        FATAL_ERROR("Failed to open \"%s\" for reading.\n", path.c_str());
+
+    if (entry.mtime == mtime && entry.size == size)
+        return entry;
+
+    // The stamp changed, but the contents might not have.
+    uint64_t hash = HashFile(path);
+
+    m_dirty = true;
+
+    if (entry.hash != hash || entry.size != size)
+    {
+        SourceFile file(path);
+
+        entry.hash = hash;
+        entry.includes = file.GetIncludes();
+        entry.incbins = file.GetIncbins();
+    }
+
+    entry.mtime = IsRacy(mtime) ? -1 : mtime;
+    entry.size = size;
+
+    return entry;
+}
+
+long long ScanCache::GetDirMtime(const std::string& dir)
+{
+    auto it = m_dirMtimes.find(dir);
+
+    if (it != m_dirMtimes.end())
+        return it->second;
+
+    long long mtime;
+    long long size;
+
+    if (!GetStamp(dir.empty() ? "." : dir, mtime, size))
+        mtime = -1;
+
+    m_dirMtimes[dir] = mtime;
+    return mtime;
+}
+
+// Adding, removing or renaming a file updates the mtime of its directory, so
+// an existence check stays valid while the directory's mtime is unchanged.
+bool ScanCache::FileExists(const std::string& path)
+{
+    auto checked = m_checkedResolved.find(path);
+
+    if (checked != m_checkedResolved.end())
+        return checked->second.exists;
+
+    std::string dir = path;
+    long long dirMtime = GetDirMtime(GetDir(dir));
+    auto it = m_resolved.find(path);
+    ResolvedPath resolved;
+
+    if (it != m_resolved.end() && it->second.dirMtime == dirMtime)
+    {
+        resolved = it->second;
+    }
+    else
+    {
+        struct stat st;
+
+        resolved.exists = (stat(path.c_str(), &st) == 0);
+        // -2 never matches a real stamp, so a racy result is checked again.
+        resolved.dirMtime = (dirMtime != -1 && IsRacy(dirMtime)) ? -2 : dirMtime;
+        m_resolved[path] = resolved;
+        m_dirty = true;
+    }
+
+    m_checkedResolved[path] = resolved;
+    return resolved.exists;
+}
@@ -0,0 +1,56 @@
+#ifndef SCAN_CACHE_H
+#define SCAN_CACHE_H
+
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <set>
+#include <string>
+#include "scaninc.h"
+
+// The direct includes and incbins of a single source file, along with the
+// file stamp and content hash they were scanned from.
+struct ScanCacheEntry
+{
+    long long mtime;
+    long long size;
+    uint64_t hash;
+    std::set<std::string> includes;
+    std::set<std::string> incbins;
+};
+
+// Whether an include path candidate exists, valid for as long as the
+// directory it would live in hasn't been modified.
+struct ResolvedPath
+{
+    long long dirMtime;
+    bool exists;
+};
+
+// Remembers the result of scanning each source file and of probing each
+// include path candidate. Backed by a cache file, a file is only lexed again
+// when its contents change and a candidate is only probed again when its
+// directory changes.
+class ScanCache
+{
+public:
+    ScanCache();
+    void Load(const std::string& path);
+    void Save(const std::string& path, bool pruneUnused);
+    const ScanCacheEntry& Get(const std::string& path);
+    bool FileExists(const std::string& path);
+
+private:
+    std::map<std::string, ScanCacheEntry> m_entries;
+    std::set<std::string> m_checked;
+    std::map<std::string, ResolvedPath> m_resolved;
+    std::map<std::string, ResolvedPath> m_checkedResolved;
+    std::map<std::string, long long> m_dirMtimes;
+    std::time_t m_startTime;
+    bool m_dirty;
+
+    long long GetDirMtime(const std::string& dir);
+    bool IsRacy(long long mtime);
+};
+
+#endif // SCAN_CACHE_H
@@ -24,91 +24,44 @@
 #include <queue>
 #include <set>
 #include <string>
+#include <vector>
 #include "scaninc.h"
+#include "scan_cache.h"
 #include "source_file.h"
 
-bool CanOpenFile(std::string path)
-{
-    FILE *fp = std::fopen(path.c_str(), "rb");
-
-    if (fp == NULL)
-        return false;
-
-    std::fclose(fp);
-    return true;
-}
-
-const char *const USAGE = "Usage: scaninc [-I INCLUDE_PATH] FILE_PATH\n";
-
-int main(int argc, char **argv)
+std::set<std::string> ScanDependencies(std::string initialPath, std::vector<std::string> includeDirs, ScanCache& cache)
 {
     std::queue<std::string> filesToProcess;
     std::set<std::string> dependencies;
 
-    std::vector<std::string> includeDirs;
-
-    argc--;
-    argv++;
-
-    while (argc > 1)
-    {
-        std::string arg(argv[0]);
-        if (arg.substr(0, 2) == "-I")
-        {
-            std::string includeDir = arg.substr(2);
-            if (includeDir.empty())
-            {
-                argc--;
-                argv++;
-                includeDir = std::string(argv[0]);
-            }
-            if (!includeDir.empty() && includeDir.back() != '/')
-            {
-                includeDir += '/';
-            }
-            includeDirs.push_back(includeDir);
-        }
-        else
-        {
-            FATAL_ERROR(USAGE);
-        }
-        argc--;
-        argv++;
-    }
-
-    if (argc != 1) {
-        FATAL_ERROR(USAGE);
-    }
-
-    std::string initialPath(argv[0]);
-
     filesToProcess.push(initialPath);
 
     while (!filesToProcess.empty())
     {
         std::string filePath = filesToProcess.front();
-        SourceFile file(filePath);
+        const ScanCacheEntry& file = cache.Get(filePath);
+        SourceFileType fileType = GetFileType(filePath);
         filesToProcess.pop();
 
-        includeDirs.push_back(file.GetSrcDir());
-        for (auto incbin : file.GetIncbins())
+        includeDirs.push_back(GetDir(filePath));
+        for (auto incbin : file.incbins)
         {
             dependencies.insert(incbin);
         }
-        for (auto include : file.GetIncludes())
+        for (auto include : file.includes)
         {
             bool exists = false;
             std::string path("");
             for (auto includeDir : includeDirs)
             {
                 path = includeDir + include;
-                if (CanOpenFile(path))
+                if (cache.FileExists(path))
                 {
                     exists = true;
                     break;
                 }
             }
-            if (!exists && (file.FileType() == SourceFileType::Asm || file.FileType() == SourceFileType::Inc))
+            if (!exists && (fileType == SourceFileType::Asm || fileType == SourceFileType::Inc))
             {
                 path = include;
             }
@@ -121,8 +74,184 @@ int main(int argc, char **argv)
         includeDirs.pop_back();
     }
 
-    for (const std::string &path : dependencies)
+    return dependencies;
+}
+
+std::string GetObjectPath(std::string objDir, std::string path)
+{
+    std::size_t dot = path.find_last_of('.');
+
+    if (dot != std::string::npos && path.find('/', dot) == std::string::npos)
+        path = path.substr(0, dot);
+
+    if (objDir.empty())
+        return path + ".o";
+
+    if (objDir.back() != '/')
+        objDir += '/';
+
+    return objDir + path + ".o";
+}
+
+std::string ReadIncludeDirArg(int& argc, char **&argv)
+{
+    std::string includeDir = std::string(argv[0]).substr(2);
+    if (includeDir.empty())
+    {
+        if (argc < 2)
+            FATAL_ERROR("missing path after \"-I\"\n");
+        argc--;
+        argv++;
+        includeDir = std::string(argv[0]);
+    }
+    if (!includeDir.empty() && includeDir.back() != '/')
+    {
+        includeDir += '/';
+    }
+    return includeDir;
+}
+
+const char *const USAGE = "Usage: scaninc [--cache CACHE_FILE] [-I INCLUDE_PATH] FILE_PATH\n"
+                          "       scaninc --batch DEP_FILE [--cache CACHE_FILE] [--obj-dir OBJ_DIR]\n"
+                          "               [[-I INCLUDE_PATH]... FILE_PATH...]...\n";
+
+// Scans many files in one process and writes a make-includable rule for each
+// one. Each run of -I options applies to the files that follow it, so groups
+// of sources with different include paths can share one invocation.
+int RunBatch(int argc, char **argv)
+{
+    std::string depFilePath;
+    std::string cachePath;
+    std::string objDir;
+    std::vector<std::string> includeDirs;
+    std::vector<std::pair<std::string, std::vector<std::string>>> sources;
+    bool startNewGroup = true;
+
+    if (argc < 1)
+        FATAL_ERROR(USAGE);
+
+    depFilePath = argv[0];
+    argc--;
+    argv++;
+
+    while (argc > 0)
+    {
+        std::string arg(argv[0]);
+        if (arg == "--cache" || arg == "--obj-dir")
+        {
+            if (argc < 2)
+                FATAL_ERROR(USAGE);
+            (arg == "--cache" ? cachePath : objDir) = argv[1];
+            argc--;
+            argv++;
+        }
+        else if (arg.substr(0, 2) == "-I")
+        {
+            if (startNewGroup)
+            {
+                includeDirs.clear();
+                startNewGroup = false;
+            }
+            includeDirs.push_back(ReadIncludeDirArg(argc, argv));
+        }
+        else
+        {
+            sources.emplace_back(arg, includeDirs);
+            startNewGroup = true;
+        }
+        argc--;
+        argv++;
+    }
+
+    ScanCache cache;
+
+    if (!cachePath.empty())
+        cache.Load(cachePath);
+
+    std::string output;
+
+    for (const auto& source : sources)
+    {
+        output += GetObjectPath(objDir, source.first) + ": " + source.first;
+        for (const std::string &path : ScanDependencies(source.first, source.second, cache))
+            output += " " + path;
+        output += "\n";
+    }
+
+    if (!cachePath.empty())
+        cache.Save(cachePath, true);
+
+    // Leave an unchanged dependency file alone so its timestamp stays put.
+    FILE *fp = std::fopen(depFilePath.c_str(), "rb");
+    if (fp != NULL)
+    {
+        std::string oldOutput;
+        char buffer[4096];
+        std::size_t count;
+        while ((count = std::fread(buffer, 1, sizeof(buffer), fp)) > 0)
+            oldOutput.append(buffer, count);
+        std::fclose(fp);
+        if (oldOutput == output)
+            return 0;
+    }
+
+    fp = std::fopen(depFilePath.c_str(), "wb");
+    if (fp == NULL)
+        FATAL_ERROR("Failed to open \"%s\" for writing.\n", depFilePath.c_str());
+    if (std::fwrite(output.data(), 1, output.size(), fp) != output.size())
+        FATAL_ERROR("Failed to write \"%s\".\n", depFilePath.c_str());
+    std::fclose(fp);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    std::string cachePath;
+    std::vector<std::string> includeDirs;
+
+    argc--;
+    argv++;
+
+    if (argc > 0 && std::string(argv[0]) == "--batch")
+        return RunBatch(argc - 1, argv + 1);
+
+    while (argc > 1)
+    {
+        std::string arg(argv[0]);
+        if (arg.substr(0, 2) == "-I")
+        {
+            includeDirs.push_back(ReadIncludeDirArg(argc, argv));
+        }
+        else if (arg == "--cache")
+        {
+            argc--;
+            argv++;
+            cachePath = argv[0];
+        }
+        else
+        {
+            FATAL_ERROR(USAGE);
+        }
+        argc--;
+        argv++;
+    }
+
+    if (argc != 1) {
+        FATAL_ERROR(USAGE);
+    }
+
+    ScanCache cache;
+
+    if (!cachePath.empty())
+        cache.Load(cachePath);
+
+    for (const std::string &path : ScanDependencies(argv[0], includeDirs, cache))
     {
         std::printf("%s\n", path.c_str());
     }
+
+    // Other files share the cache, so nothing is pruned from it here.
+    if (!cachePath.empty())
+        cache.Save(cachePath, false);
 }